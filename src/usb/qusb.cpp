@@ -1,6 +1,7 @@
 #include "qusb.h"
 #include "qusb_p.h"
 #include <QDebug>
+#include <QHash>
 #include <QThread>
 #include <QMutexLocker>
 #include <QMutex>
@@ -13,8 +14,11 @@
     if (info->logLevel() >= QUsb::logDebug) \
     qDebug() << "***[" << Q_FUNC_INFO << "]***"
 
-static libusb_hotplug_callback_handle callback_handle;
 static QMutex g_mtx_hid_enumerate; // protects calls to `hid_enumerate` and `hid_free_enumeration`
+static QMutex g_mtx_devices; // protects the cache of devices()
+static QUsb::IdList g_devices;
+static quint64 g_devices_generation = 0;
+static bool g_devices_valid = false;
 
 static int LIBUSB_CALL hotplugCallback(libusb_context *ctx,
                                        libusb_device *device,
@@ -61,21 +65,15 @@ static int LIBUSB_CALL hotplugCallback(libusb_context *ctx,
 }
 
 QUsbPrivate::QUsbPrivate()
-    : m_has_hotplug(false), m_ctx(Q_NULLPTR), m_refresh_timer(new QTimer)
+    : m_has_hotplug(false), m_callback_handle(0), m_context(Q_NULLPTR), m_ctx(Q_NULLPTR), m_refresh_timer(Q_NULLPTR)
 {
-    QThread *t = new QThread();
-    m_refresh_timer->moveToThread(t);
-
-    m_refresh_timer->setSingleShot(false);
-    m_refresh_timer->setInterval(250);
-
-    m_refresh_timer->connect(t, SIGNAL(started()), SLOT(start()));
-    m_refresh_timer->connect(t, SIGNAL(finished()), SLOT(stop()));
-    t->start();
 }
 
 QUsbPrivate::~QUsbPrivate()
 {
+    if (!m_refresh_timer)
+        return;
+
     m_refresh_timer->thread()->exit();
     m_refresh_timer->thread()->wait();
     m_refresh_timer->thread()->deleteLater();
@@ -84,6 +82,25 @@ QUsbPrivate::~QUsbPrivate()
     m_refresh_timer->deleteLater();
 }
 
+/*!
+    \brief Poll the device list from a dedicated thread, only used without hotplug support.
+ */
+void QUsbPrivate::startPolling()
+{
+    Q_Q(QUsb);
+    m_refresh_timer = new QTimer;
+    QThread *t = new QThread();
+    m_refresh_timer->moveToThread(t);
+
+    m_refresh_timer->setSingleShot(false);
+    m_refresh_timer->setInterval(250);
+
+    m_refresh_timer->connect(t, SIGNAL(started()), SLOT(start()));
+    m_refresh_timer->connect(t, SIGNAL(finished()), SLOT(stop()));
+    q->connect(m_refresh_timer, SIGNAL(timeout()), q, SLOT(checkDevices()));
+    t->start();
+}
+
 /*!
     \class QUsb
 
@@ -228,14 +245,9 @@ QUsb::QUsb(QObject *parent)
     qRegisterMetaType<QUsb::IdList>("QUsb::IdList");
     qRegisterMetaType<QUsb::ConfigList>("QUsb::ConfigList");
 
-    rc = libusb_init(&d->m_ctx);
-    if (rc < 0) {
-        libusb_exit(d->m_ctx);
-        qCritical("LibUsb Init Error %d", rc);
-        return;
-    }
-
-    libusb_set_option(d->m_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_WARNING);
+    d->m_context = QUsbContext::acquire();
+    d->m_ctx = d->m_context->context();
+    d->m_context->setLogLevel(this, LIBUSB_LOG_LEVEL_WARNING);
 
     // Populate list once
     m_system_list = devices();
@@ -252,15 +264,18 @@ QUsb::QUsb(QObject *parent)
                                               LIBUSB_HOTPLUG_MATCH_ANY,
                                               reinterpret_cast<libusb_hotplug_callback_fn>(hotplugCallback),
                                               reinterpret_cast<void *>(this),
-                                              &callback_handle);
+                                              &d->m_callback_handle);
         if (LIBUSB_SUCCESS != rc) {
-            libusb_exit(d->m_ctx);
+            d->m_has_hotplug = false; // Poll instead
             qWarning("Error creating hotplug callback");
-            return;
+        } else {
+            // Delivered by the event thread shared with the devices, as they happen
+            d->m_context->startEvents();
         }
     }
 
-    connect(d->m_refresh_timer, SIGNAL(timeout()), this, SLOT(checkDevices()));
+    if (!d->m_has_hotplug)
+        d->startPolling();
 }
 
 /*!
@@ -270,19 +285,19 @@ QUsb::~QUsb()
 {
     Q_D(QUsb);
     DbgPrintFuncName();
-    // Process any remaining events, then deregister hotplug callback
+    // Deregister the hotplug callback, then wait for it to return if it is running
     if (d->m_has_hotplug) {
-        timeval t = { 0, 0 };
-        libusb_handle_events_timeout_completed(d->m_ctx, &t, Q_NULLPTR);
-        libusb_hotplug_deregister_callback(d->m_ctx, callback_handle);
+        libusb_hotplug_deregister_callback(d->m_ctx, d->m_callback_handle);
+        d->m_context->syncEvents();
+        d->m_context->stopEvents();
     }
-    libusb_exit(d->m_ctx);
+    d->m_context->release(this);
 }
 
 /*!
     Check devices present in system.
 
-    This gets called by the internal timer.
+    This gets called by the internal timer, which only runs without hotplug support.
  */
 void QUsb::checkDevices()
 {
@@ -290,11 +305,8 @@ void QUsb::checkDevices()
     Q_D(QUsb);
     QUsb::IdList list;
 
-    timeval t = { 0, 0 };
-
-    if (d->m_has_hotplug) {
-        libusb_handle_events_timeout_completed(d->m_ctx, &t, Q_NULLPTR);
-    } else {
+    // Hotplug events are handled by the shared event thread
+    if (!d->m_has_hotplug) {
         list = devices();
         monitorDevices(list);
     }
@@ -302,41 +314,33 @@ void QUsb::checkDevices()
 
 /*!
     \brief Returns all present \c devices.
+
+    While hotplug events are handled, the list is only built again after a device
+    arrived or left, other calls return a copy of the previous one.
  */
 QUsb::IdList QUsb::devices()
 {
     QUsb::IdList list;
-    ssize_t cnt; // holding number of devices in list
-    libusb_device **devs;
-    libusb_context *ctx;
     struct hid_device_info *hid_devs, *cur_hid_dev;
 
-    libusb_init(&ctx);
-    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_NONE);
-    cnt = libusb_get_device_list(ctx, &devs); // get the list of devices
-    if (cnt < 0) {
-        qCritical("libusb_get_device_list Error");
-        libusb_free_device_list(devs, 1);
-        return list;
-    }
-
-    for (int i = 0; i < cnt; i++) {
-        libusb_device *dev = devs[i];
-        libusb_device_descriptor desc;
-
-        if (libusb_get_device_descriptor(dev, &desc) == 0) {
-            QUsb::Id id;
-            id.pid = desc.idProduct;
-            id.vid = desc.idVendor;
-            id.bus = libusb_get_bus_number(dev);
-            id.port = libusb_get_port_number(dev);
+    // Reuse the context of the devices and monitors alive, if any
+    QUsbContext *context = QUsbContext::acquire();
 
-            list.append(id);
-        }
+    QMutexLocker cache_lock(&g_mtx_devices);
+    // Read before enumerating, an event coming meanwhile invalidates the result
+    const quint64 generation = QUsbContext::generation();
+    if (g_devices_valid && g_devices_generation == generation && context->hotplugWatched()) {
+        list = g_devices;
+        cache_lock.unlock();
+        context->release();
+        return list;
     }
 
-    libusb_free_device_list(devs, 1);
-    libusb_exit(ctx);
+    bool ok;
+    list = context->enumerate(&ok);
+    context->release();
+    if (!ok)
+        return list;
 
     {
         // NOTE: on some platforms hid_enumerate is not thread-safe, so we need an application-wide mutex
@@ -359,9 +363,45 @@ QUsb::IdList QUsb::devices()
         hid_free_enumeration(hid_devs);
     }
 
+    g_devices = list;
+    g_devices_generation = generation;
+    g_devices_valid = true;
     return list;
 }
 
+/*!
+    \brief Handle USB events from the event loop of \a thread.
+
+    By default libusb events are handled by an internal thread, and transfer completions
+    reach objects living in other threads through queued signals. With an event thread set,
+    libusb file descriptors are watched with QSocketNotifier and its timeouts with a precise
+    QTimer from \a thread instead, so completions, readyRead() included, are delivered
+    there directly. The internal thread is not used anymore.
+
+    \a thread must run an event loop for as long as devices are open. This affects every
+    QUsb and QUsbDevice of the process, pass \c nullptr to go back to the internal thread.
+
+    While \a thread blocks, nothing else handles events. The blocking calls of QtUsb handle them
+    while they wait: QUsbEndpoint::waitForReadyRead(), QUsbEndpoint::waitForBytesWritten(),
+    QUsbEndpoint::close() and QUsbDevice::close(). Don't call QFuture::waitForFinished() on a
+    control transfer from \a thread, it never returns. Use QUsbDevice::waitForControlTransfer()
+    instead. Blocking from a transfer callback or a slot directly connected to a completion
+    signal is not supported either.
+    Returns \c false if the platform has no pollable descriptors (Windows).
+ */
+bool QUsb::setEventThread(QThread *thread)
+{
+    return QUsbContext::setDispatchThread(thread);
+}
+
+/*!
+    \brief Returns the thread set with setEventThread(), or \c nullptr.
+ */
+QThread *QUsb::eventThread()
+{
+    return QUsbContext::dispatchThread();
+}
+
 /*!
       Check if \a id  device is present.
 
@@ -370,6 +410,10 @@ QUsb::IdList QUsb::devices()
 bool QUsb::isPresent(const QUsb::Id &id) const
 {
     DbgPrintFuncName();
+    Q_D(const QUsb);
+    // The list is only refreshed by polling, devices() is cached until the next hotplug event
+    if (d->m_has_hotplug)
+        return this->findDevice(id, devices()) >= 0;
     return this->findDevice(id, m_system_list) >= 0;
 }
 
@@ -399,11 +443,11 @@ bool QUsb::removeDevice(const QUsb::Id &id)
 
     DbgPrintFuncName();
     const int pos = this->findDevice(id, m_list);
-    if (pos > 0) {
+    if (pos >= 0) {
         m_list.removeAt(pos);
         return true;
     }
-    return true;
+    return false;
 }
 
 /*!
@@ -437,11 +481,11 @@ void QUsb::setLogLevel(QUsb::LogLevel level)
     Q_D(QUsb);
     m_log_level = level;
     if (m_log_level >= QUsb::logDebug)
-        libusb_set_option(d->m_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
+        d->m_context->setLogLevel(this, LIBUSB_LOG_LEVEL_DEBUG);
     else if (m_log_level >= QUsb::logWarning)
-        libusb_set_option(d->m_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_WARNING);
+        d->m_context->setLogLevel(this, LIBUSB_LOG_LEVEL_WARNING);
     else
-        libusb_set_option(d->m_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_ERROR);
+        d->m_context->setLogLevel(this, LIBUSB_LOG_LEVEL_ERROR);
 }
 
 /*!
@@ -454,27 +498,39 @@ QUsb::LogLevel QUsb::logLevel() const
 
 /*!
     Add a \a list to monitor.
+
+    The lists are compared as multisets, so identical devices are counted
+    rather than merged, in linear time.
  */
 void QUsb::monitorDevices(const QUsb::IdList &list)
 {
 
     DbgPrintFuncName();
     QUsb::IdList inserted, removed;
-    QUsb::Id filter;
+    QHash<QUsb::Id, int> count; // Occurrences in the old system list not matched yet
+
+    count.reserve(m_system_list.length());
+    for (int i = 0; i < m_system_list.length(); i++)
+        count[m_system_list.at(i)]++;
 
     for (int i = 0; i < list.length(); i++) {
-        filter = list.at(i);
-        if (this->findDevice(filter, m_system_list) < 0) {
-            // It's not in the old system list
-            inserted.append(filter);
+        const QUsb::Id &id = list.at(i);
+        auto it = count.find(id);
+        if (it == count.end() || it.value() == 0) {
+            // It's not in the old system list, or not that many times
+            inserted.append(id);
+        } else {
+            it.value()--;
         }
     }
 
     for (int i = 0; i < m_system_list.length(); i++) {
-        filter = m_system_list.at(i);
-        if (this->findDevice(filter, list) < 0) {
+        const QUsb::Id &id = m_system_list.at(i);
+        auto it = count.find(id);
+        if (it.value() > 0) {
             // It's in the old system list but not in the current one
-            removed.append(filter);
+            it.value()--;
+            removed.append(id);
         }
     }
 
@@ -562,6 +618,17 @@ bool QUsb::Id::operator==(const QUsb::Id &other) const
             && other.dSubClass == dSubClass;
 }
 
+/*!
+    \relates QUsb
+
+    Returns the hash value for \a id, using \a seed to seed the calculation.
+    Every attribute compared by QUsb::Id::operator==() is taken into account.
+ */
+size_t qHash(const QUsb::Id &id, size_t seed) noexcept
+{
+    return qHashMulti(seed, id.pid, id.vid, id.bus, id.port, id.dClass, id.dSubClass);
+}
+
 /*!
     \brief Copy operator.
  */
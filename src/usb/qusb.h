@@ -12,6 +12,7 @@
 QT_BEGIN_NAMESPACE
 
 class QUsbPrivate;
+class QThread;
 
 class Q_USB_EXPORT QUsb : public QObject
 {
@@ -77,6 +78,8 @@ public:
     ~QUsb(void);
 
     static IdList devices();
+    static bool setEventThread(QThread *thread);
+    static QThread *eventThread();
     bool isPresent(const Id &id) const;
     int findDevice(const Id &id,
                    const IdList &list) const;
@@ -105,6 +108,8 @@ private:
     Q_DISABLE_COPY(QUsb)
 };
 
+Q_USB_EXPORT size_t qHash(const QUsb::Id &id, size_t seed = 0) noexcept;
+
 Q_DECLARE_METATYPE(QUsb::Config);
 Q_DECLARE_METATYPE(QUsb::Id);
 
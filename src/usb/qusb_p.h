@@ -13,6 +13,7 @@
 //
 
 #include "qusb.h"
+#include "qusbcontext_p.h"
 #include <private/qobject_p.h>
 #include <QTimer>
 
@@ -37,9 +38,13 @@ public:
     QUsbPrivate();
     ~QUsbPrivate();
 
+    void startPolling();
+
     bool m_has_hotplug;
-    libusb_context *m_ctx;
-    QTimer *m_refresh_timer;
+    libusb_hotplug_callback_handle m_callback_handle;
+    QUsbContext *m_context;
+    libusb_context *m_ctx; // Shared with the devices
+    QTimer *m_refresh_timer; // Only when polling
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,348 @@
+#include "qusbcapture_p.h"
+
+#include <chrono>
+
+// Linux errno values, usbmon reports them whatever the host is.
+static const qint32 UsbmonEPROTO = -71;
+static const qint32 UsbmonETIMEDOUT = -110;
+static const qint32 UsbmonENOENT = -2;
+static const qint32 UsbmonEPIPE = -32;
+static const qint32 UsbmonENODEV = -19;
+static const qint32 UsbmonEOVERFLOW = -75;
+static const qint32 UsbmonEIO = -5;
+static const qint32 UsbmonEBUSY = -16;
+static const qint32 UsbmonEINVAL = -22;
+static const qint32 UsbmonENOMEM = -12;
+static const qint32 UsbmonEOPNOTSUPP = -95;
+
+// pcapng block types
+static const quint32 SectionHeaderBlock = 0x0A0D0D0A;
+static const quint32 InterfaceDescriptionBlock = 0x00000001;
+static const quint32 EnhancedPacketBlock = 0x00000006;
+
+static void appendValue(QByteArray &block, const void *value, qint64 size)
+{
+    block.append(reinterpret_cast<const char *>(value), size);
+}
+
+template <typename T>
+static void appendValue(QByteArray &block, T value)
+{
+    appendValue(block, &value, sizeof(T));
+}
+
+void QUsbCaptureWriter::run()
+{
+    while (!this->isInterruptionRequested()) {
+        m_capture->flush();
+        QThread::msleep(QUsbCapture::FlushInterval);
+    }
+    // Drain what was recorded before stop()
+    m_capture->flush();
+}
+
+QUsbCapture::QUsbCapture()
+    : m_active(0), m_dropped(0), m_bus(0), m_address(0), m_cells(Q_NULLPTR), m_payload(Q_NULLPTR),
+      m_tail(0), m_head(0), m_writer(Q_NULLPTR)
+{
+}
+
+QUsbCapture::~QUsbCapture()
+{
+    stop();
+    delete[] m_cells;
+    delete[] m_payload;
+}
+
+/*!
+    \brief Starts writing records to \a fileName, which is truncated.
+
+    The ring is allocated on first use and kept until the capture is destroyed.
+    Returns \c false if the file can't be opened.
+ */
+bool QUsbCapture::start(const QString &fileName)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_writer)
+        return false;
+
+    m_file.setFileName(fileName);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    if (!m_cells) {
+        m_cells = new Cell[RingSize];
+        m_payload = new char[RingSize * SnapLength];
+        for (int i = 0; i < RingSize; i++)
+            m_cells[i].m_seq.storeRelaxed(static_cast<quint32>(i));
+    }
+
+    // Section header, byte order is given by the magic
+    m_block.clear();
+    QByteArray body;
+    appendValue<quint32>(body, 0x1A2B3C4D);
+    appendValue<quint16>(body, 1);
+    appendValue<quint16>(body, 0);
+    appendValue<qint64>(body, -1); // Section length unknown
+    appendBlock(SectionHeaderBlock, body.constData(), body.size());
+
+    // Single interface, timestamps keep the default microsecond resolution
+    body.clear();
+    appendValue<quint16>(body, LinkType);
+    appendValue<quint16>(body, 0);
+    appendValue<quint32>(body, sizeof(QUsbCaptureHeader) + SnapLength);
+    appendBlock(InterfaceDescriptionBlock, body.constData(), body.size());
+
+    m_file.write(m_block);
+    m_block.clear();
+
+    m_dropped.storeRelaxed(0);
+    m_writer = new QUsbCaptureWriter();
+    m_writer->m_capture = this;
+    m_writer->start();
+    m_active.storeRelease(1);
+    return true;
+}
+
+/*!
+    \brief Stops recording, writes the records still in the ring and closes the file.
+ */
+void QUsbCapture::stop()
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_writer)
+        return;
+
+    m_active.storeRelease(0);
+    m_writer->requestInterruption();
+    m_writer->wait();
+    delete m_writer;
+    m_writer = Q_NULLPTR;
+    m_file.close();
+}
+
+/*!
+    \brief Sets the \a bus and device \a address reported in the records.
+ */
+void QUsbCapture::setDevice(quint16 bus, quint8 address)
+{
+    m_bus = bus;
+    m_address = address;
+}
+
+/*!
+    \brief Maps a libusb transfer type to its usbmon value.
+ */
+quint8 QUsbCapture::xferType(quint8 libusbType)
+{
+    switch (libusbType) {
+    case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+        return 0;
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+        return 1;
+    case LIBUSB_TRANSFER_TYPE_CONTROL:
+        return 2;
+    default: // Bulk and bulk streams
+        return 3;
+    }
+}
+
+/*!
+    \brief Maps a libusb completion \a status to the URB status usbmon would report.
+ */
+qint32 QUsbCapture::transferErrno(libusb_transfer_status status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return UsbmonETIMEDOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return UsbmonENOENT;
+    case LIBUSB_TRANSFER_STALL:
+        return UsbmonEPIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return UsbmonENODEV;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return UsbmonEOVERFLOW;
+    default:
+        return UsbmonEPROTO;
+    }
+}
+
+/*!
+    \brief Maps a libusb \a error code to a negative errno.
+ */
+qint32 QUsbCapture::errorErrno(int error)
+{
+    switch (error) {
+    case LIBUSB_SUCCESS:
+        return 0;
+    case LIBUSB_ERROR_INVALID_PARAM:
+        return UsbmonEINVAL;
+    case LIBUSB_ERROR_NO_DEVICE:
+        return UsbmonENODEV;
+    case LIBUSB_ERROR_BUSY:
+        return UsbmonEBUSY;
+    case LIBUSB_ERROR_TIMEOUT:
+        return UsbmonETIMEDOUT;
+    case LIBUSB_ERROR_OVERFLOW:
+        return UsbmonEOVERFLOW;
+    case LIBUSB_ERROR_PIPE:
+        return UsbmonEPIPE;
+    case LIBUSB_ERROR_NO_MEM:
+        return UsbmonENOMEM;
+    case LIBUSB_ERROR_NOT_SUPPORTED:
+        return UsbmonEOPNOTSUPP;
+    default:
+        return UsbmonEIO;
+    }
+}
+
+void QUsbCapture::recordTransfer(Event event, const libusb_transfer *tr, int error)
+{
+    const quint64 id = reinterpret_cast<quintptr>(tr);
+    const quint8 type = xferType(tr->type);
+    bool in = tr->endpoint & LIBUSB_ENDPOINT_IN;
+    const uchar *data = tr->buffer;
+    const quint8 *setup = Q_NULLPTR;
+    quint8 ep = tr->endpoint;
+    quint32 length = event == Complete ? static_cast<quint32>(tr->actual_length) : static_cast<quint32>(tr->length);
+    qint32 status;
+
+    if (event == Submit)
+        status = InProgress;
+    else if (event == Error)
+        status = errorErrno(error);
+    else
+        status = transferErrno(tr->status);
+
+    if (tr->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        // The direction comes from the setup packet, the data stage follows it.
+        const libusb_control_setup *s = reinterpret_cast<const libusb_control_setup *>(tr->buffer);
+        ep = s->bmRequestType & LIBUSB_ENDPOINT_IN;
+        in = s->bmRequestType & LIBUSB_ENDPOINT_IN;
+        data += LIBUSB_CONTROL_SETUP_SIZE;
+        if (event != Complete) {
+            setup = tr->buffer;
+            length -= LIBUSB_CONTROL_SETUP_SIZE;
+        }
+    } else if (tr->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && event == Complete) {
+        // Packets are scattered over the buffer, only report their total length.
+        length = 0;
+        for (int i = 0; i < tr->num_iso_packets; i++)
+            length += tr->iso_packet_desc[i].actual_length;
+        data = Q_NULLPTR;
+    }
+
+    // OUT data is captured on submission, IN data on completion, like usbmon does.
+    const bool hasData = data && length > 0 && (in ? event == Complete : event == Submit);
+    record(event, id, type, ep, status, length, hasData ? data : Q_NULLPTR, hasData ? length : 0, setup);
+}
+
+/*!
+    \brief Queues a record, this never blocks.
+
+    \a size bytes of \a data are kept, up to SnapLength. \a setup points to the
+    8 byte setup packet of control submissions.
+    The record is dropped if the writer fell behind and the ring is full.
+ */
+void QUsbCapture::record(Event event, quint64 id, quint8 xferType, quint8 ep, qint32 status, quint32 length,
+                         const void *data, quint32 size, const quint8 *setup)
+{
+    if (!m_cells)
+        return;
+
+    // Claim a cell, the writer releases them in order.
+    quint32 pos = m_tail.loadRelaxed();
+    Cell *cell;
+    for (;;) {
+        cell = &m_cells[pos & (RingSize - 1)];
+        const qint32 diff = static_cast<qint32>(cell->m_seq.loadAcquire() - pos);
+        if (diff == 0) {
+            if (m_tail.testAndSetRelaxed(pos, pos + 1, pos))
+                break;
+        } else if (diff < 0) {
+            m_dropped.fetchAndAddRelaxed(1);
+            return;
+        } else {
+            pos = m_tail.loadRelaxed();
+        }
+    }
+
+    const auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::system_clock::now().time_since_epoch())
+                             .count();
+    const quint32 captured = qMin<quint32>(size, SnapLength);
+
+    QUsbCaptureHeader &h = cell->m_header;
+    memset(&h, 0, sizeof(h));
+    h.id = id;
+    h.type = event;
+    h.xferType = xferType;
+    h.epnum = ep;
+    h.devnum = m_address;
+    h.busnum = m_bus;
+    h.flagSetup = setup ? 0 : '-';
+    h.flagData = captured ? 0 : (ep & LIBUSB_ENDPOINT_IN ? '<' : '>');
+    h.tsSec = now / 1000000;
+    h.tsUsec = static_cast<qint32>(now % 1000000);
+    h.status = status;
+    h.length = length;
+    h.lenCap = captured;
+    if (setup)
+        memcpy(h.setup, setup, sizeof(h.setup));
+    if (captured)
+        memcpy(m_payload + (pos & (RingSize - 1)) * SnapLength, data, captured);
+
+    cell->m_seq.storeRelease(pos + 1);
+}
+
+/*!
+    \brief Writes every complete record to the file, called from the writer thread.
+ */
+void QUsbCapture::flush()
+{
+    for (;;) {
+        Cell *cell = &m_cells[m_head & (RingSize - 1)];
+        if (static_cast<qint32>(cell->m_seq.loadAcquire() - (m_head + 1)) < 0)
+            break;
+
+        const QUsbCaptureHeader &h = cell->m_header;
+        const quint64 ts = static_cast<quint64>(h.tsSec) * 1000000 + static_cast<quint64>(h.tsUsec);
+        const quint32 captured = sizeof(h) + h.lenCap;
+        const quint32 original = sizeof(h) + (h.flagData == 0 ? h.length : 0);
+        const quint32 padding = (4 - captured % 4) % 4;
+        const quint32 total = 32 + captured + padding;
+
+        appendValue<quint32>(m_block, EnhancedPacketBlock);
+        appendValue<quint32>(m_block, total);
+        appendValue<quint32>(m_block, 0); // Interface
+        appendValue<quint32>(m_block, static_cast<quint32>(ts >> 32));
+        appendValue<quint32>(m_block, static_cast<quint32>(ts));
+        appendValue<quint32>(m_block, captured);
+        appendValue<quint32>(m_block, original);
+        appendValue(m_block, &h, sizeof(h));
+        appendValue(m_block, m_payload + (m_head & (RingSize - 1)) * SnapLength, h.lenCap);
+        m_block.append(static_cast<int>(padding), '\0');
+        appendValue<quint32>(m_block, total);
+
+        cell->m_seq.storeRelease(m_head + RingSize);
+        m_head++;
+    }
+
+    if (!m_block.isEmpty()) {
+        m_file.write(m_block);
+        m_block.clear();
+        m_file.flush();
+    }
+}
+
+void QUsbCapture::appendBlock(quint32 type, const char *body, qint64 size)
+{
+    const quint32 total = static_cast<quint32>(12 + size);
+    appendValue<quint32>(m_block, type);
+    appendValue<quint32>(m_block, total);
+    m_block.append(body, size);
+    appendValue<quint32>(m_block, total);
+}
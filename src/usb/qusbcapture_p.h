@@ -0,0 +1,147 @@
+#ifndef QUSBCAPTURE_P_H
+#define QUSBCAPTURE_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include "qusbglobal.h"
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+
+#if defined(Q_OS_MACOS)
+  #include <libusb.h>
+#elif defined(Q_OS_UNIX)
+  #include <libusb-1.0/libusb.h>
+#else
+  #include <libusb/libusb.h>
+#endif
+
+QT_BEGIN_NAMESPACE
+
+// Binary usbmon header, as read from /dev/usbmonX with the mmap API.
+// Multi-byte fields are in host order, like the rest of the pcapng section.
+struct QUsbCaptureHeader
+{
+    quint64 id; // Matches a completion with its submission
+    quint8 type; // 'S', 'C' or 'E'
+    quint8 xferType; // 0 iso, 1 interrupt, 2 control, 3 bulk
+    quint8 epnum; // Endpoint number and direction bit
+    quint8 devnum;
+    quint16 busnum;
+    char flagSetup; // 0 when setup is valid
+    char flagData; // 0 when data follows the header
+    qint64 tsSec;
+    qint32 tsUsec;
+    qint32 status; // Negative errno
+    quint32 length; // Length of the transfer
+    quint32 lenCap; // Bytes captured after the header
+    quint8 setup[8];
+    qint32 interval;
+    qint32 startFrame;
+    quint32 xferFlags;
+    quint32 ndesc;
+};
+static_assert(sizeof(QUsbCaptureHeader) == 64, "usbmon header must be 64 bytes");
+
+class QUsbCapture;
+
+class QUsbCaptureWriter : public QThread
+{
+public:
+    void run() override;
+
+    QUsbCapture *m_capture;
+};
+
+class Q_USB_EXPORT QUsbCapture
+{
+public:
+    static const int RingSize = 2048; // Records, must be a power of two
+    static const int SnapLength = 1024; // Payload bytes kept per record
+    static const int FlushInterval = 20; // Milliseconds between writer passes
+    static const quint16 LinkType = 220; // LINKTYPE_USB_LINUX_MMAPPED
+    static const qint32 InProgress = -115; // -EINPROGRESS, status of submissions
+
+    enum Event : quint8 {
+        Submit = 'S',
+        Complete = 'C',
+        Error = 'E'
+    };
+
+    QUsbCapture();
+    ~QUsbCapture();
+
+    bool start(const QString &fileName);
+    void stop();
+    bool isActive() const { return m_active.loadRelaxed() != 0; }
+    quint64 dropped() const { return m_dropped.loadRelaxed(); }
+    void setDevice(quint16 bus, quint8 address);
+
+    void submit(const libusb_transfer *tr)
+    {
+        if (isActive())
+            recordTransfer(Submit, tr, 0);
+    }
+    void complete(const libusb_transfer *tr)
+    {
+        if (isActive())
+            recordTransfer(Complete, tr, 0);
+    }
+    void submitFailed(const libusb_transfer *tr, int error)
+    {
+        if (isActive())
+            recordTransfer(Error, tr, error);
+    }
+
+    void record(Event event, quint64 id, quint8 xferType, quint8 ep, qint32 status, quint32 length,
+                const void *data, quint32 size, const quint8 *setup = Q_NULLPTR);
+    void flush();
+
+    static quint8 xferType(quint8 libusbType);
+    static qint32 transferErrno(libusb_transfer_status status);
+    static qint32 errorErrno(int error);
+
+private:
+    struct Cell {
+        QAtomicInteger<quint32> m_seq; // Ring position this cell is ready for
+        QUsbCaptureHeader m_header;
+    };
+
+    void recordTransfer(Event event, const libusb_transfer *tr, int error);
+    void appendBlock(quint32 type, const char *body, qint64 size);
+
+    Q_DISABLE_COPY(QUsbCapture)
+
+    QAtomicInt m_active;
+    QAtomicInteger<quint64> m_dropped;
+    quint16 m_bus;
+    quint8 m_address;
+
+    // Bounded multi-producer ring, cells are only freed with the capture itself so
+    // a producer that raced with stop() never writes into released memory.
+    Cell *m_cells;
+    char *m_payload;
+    QAtomicInteger<quint32> m_tail; // Next position claimed by producers
+    quint32 m_head; // Next position drained by the writer
+
+    QFile m_file;
+    QByteArray m_block; // Blocks waiting to be written, writer side only
+    QUsbCaptureWriter *m_writer;
+    QMutex m_mutex; // Serializes start() and stop()
+};
+
+QT_END_NAMESPACE
+
+#endif // QUSBCAPTURE_P_H
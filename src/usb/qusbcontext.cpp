@@ -0,0 +1,596 @@
+#include "qusbcontext_p.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPointer>
+
+#if defined(Q_OS_UNIX)
+  #include <poll.h>
+#endif
+
+static QMutex g_mtx_context; // protects g_context, g_dispatch_thread and the state of the shared context
+static QUsbContext *g_context = Q_NULLPTR;
+static QPointer<QThread> g_dispatch_thread;
+static thread_local bool t_handling_events = false; // Inside libusb event handling, callbacks included
+static QAtomicInteger<quint64> g_generation; // Bumped whenever enumerating may give another result
+
+// Event handling failed for good. An interruption only asks the caller to check its state
+// again, and a timeout is harmless.
+static bool isEventError(int rc)
+{
+    return rc != 0 && rc != LIBUSB_ERROR_INTERRUPTED && rc != LIBUSB_ERROR_TIMEOUT;
+}
+
+static int LIBUSB_CALL hotplugCallback(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event,
+                                       void *user_data)
+{
+    Q_UNUSED(ctx);
+    g_generation.fetchAndAddRelease(1);
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+        reinterpret_cast<QUsbContext *>(user_data)->uncacheDevice(device);
+    return 0;
+}
+
+static void LIBUSB_CALL pollfdAdded(int fd, short events, void *user_data)
+{
+    // Called by libusb from any thread, notifiers are only touched from their own.
+    QUsbEventNotifier *n = reinterpret_cast<QUsbEventNotifier *>(user_data);
+    QMetaObject::invokeMethod(n, [n, fd, events]() { n->addFd(fd, events); }, Qt::QueuedConnection);
+}
+
+static void LIBUSB_CALL pollfdRemoved(int fd, void *user_data)
+{
+    QUsbEventNotifier *n = reinterpret_cast<QUsbEventNotifier *>(user_data);
+    QMetaObject::invokeMethod(n, [n, fd]() { n->removeFd(fd); }, Qt::QueuedConnection);
+}
+
+static void destroyNotifier(QUsbEventNotifier *n)
+{
+    // Socket notifiers and timers have to go away in their own thread
+    QThread *thread = n->thread();
+    if (thread && thread != QThread::currentThread() && thread->isRunning())
+        QMetaObject::invokeMethod(n, [n]() { n->stop(); }, Qt::BlockingQueuedConnection);
+    else
+        n->stop();
+    delete n;
+}
+
+QUsbEventNotifier::QUsbEventNotifier(libusb_context *ctx)
+    : m_ctx(ctx), m_timer(Q_NULLPTR)
+{
+    // Linux has a timerfd among the descriptors, other platforms need a timer.
+    if (!libusb_pollfds_handle_timeouts(m_ctx)) {
+        m_timer = new QTimer(this);
+        m_timer->setSingleShot(true);
+        m_timer->setTimerType(Qt::PreciseTimer);
+        connect(m_timer, &QTimer::timeout, this, [this]() { handleEvents(); });
+    }
+}
+
+QUsbEventNotifier::~QUsbEventNotifier()
+{
+    stop();
+}
+
+void QUsbEventNotifier::start()
+{
+    const libusb_pollfd **fds = libusb_get_pollfds(m_ctx);
+    if (fds) {
+        for (int i = 0; fds[i]; i++)
+            addFd(fds[i]->fd, fds[i]->events);
+        libusb_free_pollfds(fds);
+    }
+
+    // Catch up with what happened before the notifiers existed
+    handleEvents();
+}
+
+void QUsbEventNotifier::stop()
+{
+    qDeleteAll(m_notifiers);
+    m_notifiers.clear();
+    delete m_timer;
+    m_timer = Q_NULLPTR;
+}
+
+void QUsbEventNotifier::addFd(int fd, short events)
+{
+#if defined(Q_OS_UNIX)
+    if (m_notifiers.contains(fd)) // Already listed by start()
+        return;
+
+    QList<QSocketNotifier *> notifiers;
+    if (events & POLLIN)
+        notifiers.append(new QSocketNotifier(fd, QSocketNotifier::Read, this));
+    if (events & POLLOUT)
+        notifiers.append(new QSocketNotifier(fd, QSocketNotifier::Write, this));
+    for (QSocketNotifier *n : std::as_const(notifiers)) {
+        connect(n, &QSocketNotifier::activated, this, [this]() { handleEvents(); });
+        m_notifiers.insert(fd, n);
+    }
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(events);
+#endif
+}
+
+void QUsbEventNotifier::removeFd(int fd)
+{
+    const QList<QSocketNotifier *> notifiers = m_notifiers.values(fd);
+    m_notifiers.remove(fd);
+    qDeleteAll(notifiers);
+}
+
+void QUsbEventNotifier::handleEvents()
+{
+    // Never blocks, callbacks run right here
+    timeval t = { 0, 0 };
+    t_handling_events = true;
+    const int rc = libusb_handle_events_timeout_completed(m_ctx, &t, Q_NULLPTR);
+    t_handling_events = false;
+    if (isEventError(rc))
+        qWarning("libusb event handling failed: %s", libusb_error_name(rc));
+    armTimer();
+}
+
+void QUsbEventNotifier::armTimer()
+{
+    if (!m_timer)
+        return;
+
+    timeval t;
+    if (libusb_get_next_timeout(m_ctx, &t) == 1)
+        m_timer->start(static_cast<int>(t.tv_sec * 1000 + (t.tv_usec + 999) / 1000));
+    else
+        m_timer->stop();
+}
+
+QUsbContext::QUsbContext()
+    : m_ctx(Q_NULLPTR), m_ref(0), m_eventUsers(0), m_running(false), m_notifier(Q_NULLPTR), m_hotplug(false),
+      m_hotplugHandle(0)
+{
+    int rc = libusb_init(&m_ctx);
+    if (rc < 0) {
+        qCritical("LibUsb Init Error %d", rc);
+    }
+    libusb_set_option(m_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_NONE);
+
+    // Nothing is known about what happened while there was no context
+    g_generation.fetchAndAddRelease(1);
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        rc = libusb_hotplug_register_callback(m_ctx,
+                                              static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                                              LIBUSB_HOTPLUG_NO_FLAGS,
+                                              LIBUSB_HOTPLUG_MATCH_ANY,
+                                              LIBUSB_HOTPLUG_MATCH_ANY,
+                                              LIBUSB_HOTPLUG_MATCH_ANY,
+                                              hotplugCallback,
+                                              reinterpret_cast<void *>(this),
+                                              &m_hotplugHandle);
+        m_hotplug = rc == LIBUSB_SUCCESS;
+    }
+
+    m_events = new QUsbEventsThread();
+    m_events->m_context = this;
+}
+
+QUsbContext::~QUsbContext()
+{
+    QUsbEventNotifier *n = detachNotifier();
+    if (n)
+        destroyNotifier(n);
+
+    // The last release() happens once every device is closed, the thread is on its way out.
+    if (m_events->isRunning() && QThread::currentThread() != m_events) {
+        libusb_interrupt_event_handler(m_ctx);
+        m_events->wait();
+    }
+    delete m_events;
+
+    if (m_hotplug)
+        libusb_hotplug_deregister_callback(m_ctx, m_hotplugHandle);
+    for (auto it = m_known.cbegin(); it != m_known.cend(); ++it)
+        libusb_unref_device(it.key());
+    for (auto it = m_cache.cbegin(); it != m_cache.cend(); ++it)
+        libusb_unref_device(it.value().m_device);
+    libusb_exit(m_ctx);
+    g_generation.fetchAndAddRelease(1);
+}
+
+/*!
+    \brief Returns the shared context, creating it if needed.
+
+    Every call must be matched by a release().
+ */
+QUsbContext *QUsbContext::acquire()
+{
+    QMutexLocker locker(&g_mtx_context);
+    if (!g_context) {
+        g_context = new QUsbContext();
+        if (g_dispatch_thread)
+            g_context->attachNotifier(g_dispatch_thread);
+    }
+    g_context->m_ref++;
+    return g_context;
+}
+
+/*!
+    \brief Drop a reference taken by acquire(), along with the log level set by \a user.
+ */
+void QUsbContext::release(const void *user)
+{
+    g_mtx_context.lock();
+    Q_ASSERT(m_ref > 0);
+    if (m_logLevels.remove(user))
+        applyLogLevel();
+    if (--m_ref > 0) {
+        g_mtx_context.unlock();
+        return;
+    }
+    g_context = Q_NULLPTR;
+    g_mtx_context.unlock();
+
+    // Not under the lock, the event thread takes it on each iteration
+    delete this;
+}
+
+int QUsbContext::refCount() const
+{
+    QMutexLocker locker(&g_mtx_context);
+    return m_ref;
+}
+
+void QUsbContext::setLogLevel(const void *user, libusb_log_level level)
+{
+    QMutexLocker locker(&g_mtx_context);
+    m_logLevels.insert(user, level);
+    applyLogLevel();
+}
+
+void QUsbContext::applyLogLevel()
+{
+    // g_mtx_context must be held
+    libusb_log_level level = LIBUSB_LOG_LEVEL_NONE;
+    for (libusb_log_level l : std::as_const(m_logLevels))
+        level = qMax(level, l);
+    libusb_set_option(m_ctx, LIBUSB_OPTION_LOG_LEVEL, level);
+}
+
+/*!
+    \brief Start the event thread if it isn't running, it is shared by all the users.
+
+    Nothing is started while events are dispatched from another thread.
+    Every call must be matched by a stopEvents().
+ */
+void QUsbContext::startEvents()
+{
+    QMutexLocker locker(&g_mtx_context);
+    // A thread stopped by an error is started over, whatever the number of users
+    m_eventUsers++;
+    if (m_running || m_notifier)
+        return;
+
+    // A thread that left its loop doesn't touch the context anymore, this is short.
+    m_events->wait();
+    m_running = true;
+    m_events->start();
+    g_generation.fetchAndAddRelease(1); // Hotplug events were not handled until now
+}
+
+/*!
+    \brief The event thread stops once the last user is done with it.
+
+    This doesn't wait for the thread, it may be called from a libusb callback.
+ */
+void QUsbContext::stopEvents()
+{
+    QMutexLocker locker(&g_mtx_context);
+    Q_ASSERT(m_eventUsers > 0);
+    if (--m_eventUsers == 0)
+        libusb_interrupt_event_handler(m_ctx);
+}
+
+/*!
+    \brief Returns \c true while the internal event thread runs.
+ */
+bool QUsbContext::eventsRunning() const
+{
+    QMutexLocker locker(&g_mtx_context);
+    return m_running;
+}
+
+/*!
+    \brief Returns \c true if called from a libusb callback.
+ */
+bool QUsbContext::isEventThread() const
+{
+    return t_handling_events;
+}
+
+/*!
+    \brief Returns \c true if called from the thread set with setDispatchThread(), outside of a callback.
+
+    Its event loop handles the events, so it must not just sleep while waiting for a transfer.
+ */
+bool QUsbContext::isDispatchThread() const
+{
+    if (t_handling_events)
+        return false;
+    QMutexLocker locker(&g_mtx_context);
+    return m_notifier && m_notifier->thread() == QThread::currentThread();
+}
+
+/*!
+    \brief Handle events from the calling thread, blocking until some arrive or \a deadline expires.
+
+    Meant for the dispatch thread while it waits for a transfer, its notifiers can't fire then.
+ */
+void QUsbContext::handleEvents(QDeadlineTimer deadline)
+{
+    // Callbacks run right here, like from the notifier
+    const qint64 ms = deadline.isForever() ? 60000 : qMax(Q_INT64_C(0), deadline.remainingTime());
+    timeval t;
+    t.tv_sec = static_cast<decltype(t.tv_sec)>(ms / 1000);
+    t.tv_usec = static_cast<decltype(t.tv_usec)>(ms % 1000 * 1000);
+    t_handling_events = true;
+    const int rc = libusb_handle_events_timeout_completed(m_ctx, &t, Q_NULLPTR);
+    t_handling_events = false;
+    if (isEventError(rc))
+        qWarning("libusb event handling failed: %s", libusb_error_name(rc));
+
+    // The next timeout may have changed, the notifier timer has to follow
+    transferSubmitted();
+}
+
+/*!
+    \brief Wait for the callbacks being run by the event thread to return.
+
+    Does nothing from a callback.
+ */
+void QUsbContext::syncEvents()
+{
+    if (isEventThread())
+        return;
+    libusb_lock_events(m_ctx);
+    libusb_unlock_events(m_ctx);
+}
+
+/*!
+    \brief Tell the event notifier about a new transfer, its timeout may be the next one.
+
+    Costs an atomic load unless events are dispatched from a thread on a platform
+    without a timer file descriptor.
+ */
+void QUsbContext::transferSubmitted()
+{
+    if (!m_timerNotifier.loadRelaxed())
+        return;
+
+    QMutexLocker locker(&g_mtx_context);
+    QUsbEventNotifier *n = m_timerNotifier.loadRelaxed();
+    if (n && n->m_armPending.testAndSetRelaxed(0, 1)) {
+        QMetaObject::invokeMethod(n, [n]() {
+            n->m_armPending.storeRelaxed(0);
+            n->armTimer();
+        }, Qt::QueuedConnection);
+    }
+}
+
+/*!
+    \brief Handle libusb events from the event loop of \a thread, or from the internal thread if \c nullptr.
+
+    Returns \c false if the platform has no pollable descriptors.
+ */
+bool QUsbContext::setDispatchThread(QThread *thread)
+{
+#if !defined(Q_OS_UNIX)
+    if (thread)
+        return false;
+#endif
+
+    QUsbEventNotifier *old = Q_NULLPTR;
+    g_mtx_context.lock();
+    g_dispatch_thread = thread;
+    if (g_context) {
+        old = g_context->detachNotifier();
+        if (thread) {
+            g_context->attachNotifier(thread);
+            // The internal thread notices it isn't needed anymore
+            if (g_context->m_running)
+                libusb_interrupt_event_handler(g_context->m_ctx);
+        } else if (g_context->m_eventUsers > 0 && !g_context->m_running) {
+            g_context->m_events->wait();
+            g_context->m_running = true;
+            g_context->m_events->start();
+            g_generation.fetchAndAddRelease(1);
+        }
+    }
+    g_mtx_context.unlock();
+
+    // Not under the lock, the dispatch thread may be waiting for it
+    if (old)
+        destroyNotifier(old);
+    return true;
+}
+
+QThread *QUsbContext::dispatchThread()
+{
+    QMutexLocker locker(&g_mtx_context);
+    return g_dispatch_thread;
+}
+
+void QUsbContext::attachNotifier(QThread *thread)
+{
+    // g_mtx_context must be held
+    QUsbEventNotifier *n = new QUsbEventNotifier(m_ctx);
+    n->moveToThread(thread);
+    libusb_set_pollfd_notifiers(m_ctx, pollfdAdded, pollfdRemoved, n);
+    QMetaObject::invokeMethod(n, [n]() { n->start(); }, Qt::QueuedConnection);
+
+    m_notifier = n;
+    if (n->m_timer)
+        m_timerNotifier.storeRelaxed(n);
+    g_generation.fetchAndAddRelease(1);
+}
+
+QUsbEventNotifier *QUsbContext::detachNotifier()
+{
+    // g_mtx_context must be held, or the context be going away
+    QUsbEventNotifier *n = m_notifier;
+    if (n)
+        libusb_set_pollfd_notifiers(m_ctx, Q_NULLPTR, Q_NULLPTR, Q_NULLPTR);
+    m_notifier = Q_NULLPTR;
+    m_timerNotifier.storeRelaxed(Q_NULLPTR);
+    return n;
+}
+
+/*!
+    \brief Returns the devices present, setting \a ok to \c false if they couldn't be listed.
+
+    Descriptors are only read for devices that appeared since the previous call,
+    the others are matched by their libusb_device, which is kept referenced.
+ */
+QUsb::IdList QUsbContext::enumerate(bool *ok)
+{
+    QUsb::IdList list;
+    libusb_device **devs;
+
+    QMutexLocker locker(&m_enumMutex);
+    ssize_t cnt = libusb_get_device_list(m_ctx, &devs); // get the list of devices
+    *ok = cnt >= 0;
+    if (cnt < 0) {
+        qCritical("libusb_get_device_list Error");
+        return list;
+    }
+
+    QHash<libusb_device *, QUsb::Id> known;
+    known.reserve(cnt);
+    list.reserve(cnt);
+    for (ssize_t i = 0; i < cnt; i++) {
+        libusb_device *dev = devs[i];
+        auto it = m_known.find(dev);
+        if (it != m_known.end()) {
+            // Its reference moves along
+            list.append(it.value());
+            known.insert(dev, it.value());
+            m_known.erase(it);
+            continue;
+        }
+
+        libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(dev, &desc) == 0) {
+            QUsb::Id id;
+            id.pid = desc.idProduct;
+            id.vid = desc.idVendor;
+            id.bus = libusb_get_bus_number(dev);
+            id.port = libusb_get_port_number(dev);
+
+            list.append(id);
+            known.insert(dev, id);
+            libusb_ref_device(dev);
+        }
+    }
+
+    // Unplugged since last time
+    for (auto it = m_known.cbegin(); it != m_known.cend(); ++it)
+        libusb_unref_device(it.key());
+    m_known.swap(known);
+
+    libusb_free_device_list(devs, 1);
+    return list;
+}
+
+/*!
+    \brief Returns a counter changing whenever the devices present may have changed.
+
+    It only follows hotplug events while hotplugWatched() is \c true.
+ */
+quint64 QUsbContext::generation()
+{
+    return g_generation.loadAcquire();
+}
+
+/*!
+    \brief Returns \c true while hotplug events are handled as they come.
+ */
+bool QUsbContext::hotplugWatched() const
+{
+    QMutexLocker locker(&g_mtx_context);
+    return m_hotplug && (m_running || m_notifier);
+}
+
+/*!
+    \brief Returns the device last opened with \a id, or \c nullptr if there is none.
+
+    A non empty \a path must match the one of the device, an empty one is filled from it.
+    The device returned is referenced, the caller must unref it.
+ */
+libusb_device *QUsbContext::cachedDevice(const QUsb::Id &id, QList<quint8> *path)
+{
+    QMutexLocker locker(&m_cacheMutex);
+    auto it = m_cache.constFind(id);
+    if (it == m_cache.constEnd() || (!path->isEmpty() && *path != it.value().m_path))
+        return Q_NULLPTR;
+
+    *path = it.value().m_path;
+    return libusb_ref_device(it.value().m_device);
+}
+
+/*!
+    \brief Remember \a device was opened with \a id, at \a path.
+
+    It is forgotten once it leaves, or right away without hotplug support.
+ */
+void QUsbContext::cacheDevice(const QUsb::Id &id, const QList<quint8> &path, libusb_device *device)
+{
+    // Without hotplug, nothing would tell us when it is gone
+    if (!m_hotplug)
+        return;
+
+    QMutexLocker locker(&m_cacheMutex);
+    CachedDevice &cached = m_cache[id];
+    libusb_ref_device(device);
+    if (cached.m_device)
+        libusb_unref_device(cached.m_device);
+    cached.m_path = path;
+    cached.m_device = device;
+}
+
+/*!
+    \brief Forget \a device, it left or can't be opened anymore.
+ */
+void QUsbContext::uncacheDevice(libusb_device *device)
+{
+    QMutexLocker locker(&m_cacheMutex);
+    for (auto it = m_cache.begin(); it != m_cache.end();) {
+        if (it.value().m_device == device) {
+            libusb_unref_device(device);
+            it = m_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool QUsbContext::keepRunning(int rc)
+{
+    QMutexLocker locker(&g_mtx_context);
+    // Only an error ends the loop, startEvents() starts the thread over then
+    const bool failed = isEventError(rc);
+    if (failed)
+        qWarning("libusb event handling failed, event thread stopped: %s", libusb_error_name(rc));
+    m_running = !failed && m_eventUsers > 0 && !m_notifier;
+    return m_running;
+}
+
+void QUsbEventsThread::run()
+{
+    // Transfer timeouts are still honoured by libusb, and every change to keepRunning()
+    // interrupts the handler, so there is no reason to wake up while idle.
+    timeval t = { 60, 0 };
+    int rc = 0;
+    while (m_context->keepRunning(rc)) {
+        t_handling_events = true;
+        rc = libusb_handle_events_timeout_completed(m_context->m_ctx, &t, Q_NULLPTR);
+        t_handling_events = false;
+    }
+}
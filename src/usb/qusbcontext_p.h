@@ -0,0 +1,138 @@
+#ifndef QUSBCONTEXT_P_H
+#define QUSBCONTEXT_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include "qusb.h"
+#include <QAtomicInteger>
+#include <QDeadlineTimer>
+#include <QAtomicPointer>
+#include <QHash>
+#include <QMutex>
+#include <QSocketNotifier>
+#include <QThread>
+#include <QTimer>
+
+#if defined(Q_OS_MACOS)
+  #include <libusb.h>
+#elif defined(Q_OS_UNIX)
+  #include <libusb-1.0/libusb.h>
+#else
+  #include <libusb/libusb.h>
+#endif
+
+QT_BEGIN_NAMESPACE
+
+class QUsbContext;
+
+class QUsbEventsThread : public QThread
+{
+public:
+    void run() override;
+
+    QUsbContext *m_context;
+};
+
+// Handles libusb events from the event loop of the thread it lives in, instead of
+// QUsbEventsThread. Only for platforms with pollable file descriptors.
+class QUsbEventNotifier : public QObject
+{
+public:
+    explicit QUsbEventNotifier(libusb_context *ctx);
+    ~QUsbEventNotifier();
+
+    // Must be called from the thread of the notifier
+    void start();
+    void stop();
+    void addFd(int fd, short events);
+    void removeFd(int fd);
+    void handleEvents();
+    void armTimer();
+
+    libusb_context *m_ctx;
+    QMultiHash<int, QSocketNotifier *> m_notifiers;
+    QTimer *m_timer; // Only if the file descriptors don't cover timeouts
+    QAtomicInt m_armPending; // armTimer() queued from another thread
+};
+
+// The libusb context shared by every QUsb and QUsbDevice of the process, with a single
+// event thread running while at least one user needs events. It is created by the first
+// acquire() and destroyed by the last release().
+class Q_USB_EXPORT QUsbContext
+{
+public:
+    static QUsbContext *acquire();
+    void release(const void *user = Q_NULLPTR);
+
+    libusb_context *context() const { return m_ctx; }
+    int refCount() const;
+
+    // The most verbose level asked by any user is applied, until that user releases the context.
+    void setLogLevel(const void *user, libusb_log_level level);
+
+    void startEvents();
+    void stopEvents();
+    bool eventsRunning() const;
+    bool isEventThread() const;
+    bool isDispatchThread() const;
+    void handleEvents(QDeadlineTimer deadline);
+    void syncEvents();
+    void transferSubmitted();
+
+    // Enumeration, every device is only read once while it stays plugged
+    QUsb::IdList enumerate(bool *ok);
+    static quint64 generation();
+    bool hotplugWatched() const;
+
+    // Devices opened before, by the id they were matched with, referenced until they leave
+    libusb_device *cachedDevice(const QUsb::Id &id, QList<quint8> *path);
+    void cacheDevice(const QUsb::Id &id, const QList<quint8> &path, libusb_device *device);
+    void uncacheDevice(libusb_device *device);
+
+    static bool setDispatchThread(QThread *thread);
+    static QThread *dispatchThread();
+
+private:
+    friend class QUsbEventsThread;
+
+    QUsbContext();
+    ~QUsbContext();
+    Q_DISABLE_COPY(QUsbContext)
+
+    bool keepRunning(int rc);
+    void applyLogLevel();
+    void attachNotifier(QThread *thread);
+    QUsbEventNotifier *detachNotifier();
+
+    libusb_context *m_ctx;
+    QUsbEventsThread *m_events;
+    int m_ref;
+    int m_eventUsers; // startEvents() not yet matched by stopEvents()
+    bool m_running; // Cleared by the event thread itself when it leaves its loop
+    QUsbEventNotifier *m_notifier; // Replaces the event thread when set
+    bool m_hotplug; // Our callback is registered, it bumps generation()
+    libusb_hotplug_callback_handle m_hotplugHandle;
+    QMutex m_enumMutex;
+    QHash<libusb_device *, QUsb::Id> m_known; // Referenced, as of the last enumerate()
+    struct CachedDevice {
+        QList<quint8> m_path;
+        libusb_device *m_device = Q_NULLPTR; // Referenced
+    };
+    QMutex m_cacheMutex;
+    QHash<QUsb::Id, CachedDevice> m_cache;
+    QAtomicPointer<QUsbEventNotifier> m_timerNotifier; // m_notifier, if it needs to be told about new timeouts
+    QHash<const void *, libusb_log_level> m_logLevels;
+};
+
+QT_END_NAMESPACE
+
+#endif // QUSBCONTEXT_P_H
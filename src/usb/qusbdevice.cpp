@@ -1,92 +1,297 @@
 #include "qusbdevice.h"
 #include "qusbdevice_p.h"
+#include "qusbendpoint_p.h"
+#include <QDeadlineTimer>
 #include <QElapsedTimer>
+#include <limits>
 
 #define DbgPrintError() qWarning("In %s, at %s:%d", Q_FUNC_INFO, __FILE__, __LINE__)
 #define DbgPrintPrivFuncName()       \
-    if (m_classes.pub->m_log_level >= QUsb::logDebug) \
+    if (q_func()->m_log_level >= QUsb::logDebug) \
     qDebug() << "***[" << Q_FUNC_INFO << "]***"
 #define DbgPrintFuncName()       \
     if (m_log_level >= QUsb::logDebug) \
     qDebug() << "***[" << Q_FUNC_INFO << "]***"
 
-static int LIBUSB_CALL DeviceLeftCallback(libusb_context *ctx,
-                                          libusb_device *device,
-                                          libusb_hotplug_event event,
-                                          void *user_data)
+static void LIBUSB_CALL cb_control(struct libusb_transfer *transfer)
 {
-    (void)ctx;
-    struct libusb_device_descriptor desc;
-    (void)libusb_get_device_descriptor(device, &desc);
-    qusbdevice_classes_t *dev = reinterpret_cast<qusbdevice_classes_t *>(user_data);
+    QUsbControlTransfer *t = reinterpret_cast<QUsbControlTransfer *>(transfer->user_data);
+    t->m_dev->completeControlTransfer(t);
+}
 
-    if (dev->pub->logLevel() >= QUsb::logDebug)
-        qDebug("DeviceLeftCallback");
+QUsbControlTransfer::QUsbControlTransfer(QUsbDevicePrivate *dev)
+    : m_dev(dev), m_transfer(libusb_alloc_transfer(0)), m_batch(Q_NULLPTR), m_index(0)
+{
+    m_buf.reserve(LIBUSB_CONTROL_SETUP_SIZE + QUsbDevicePrivate::ControlBufferSize);
+}
 
-    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
-        if (dev->priv->m_ctx == ctx && *dev->priv->m_devs == device)
-            dev->pub->close();
-    }
-    return 0;
+QUsbControlTransfer::~QUsbControlTransfer()
+{
+    if (m_transfer != Q_NULLPTR)
+        libusb_free_transfer(m_transfer);
 }
 
 QUsbDevicePrivate::QUsbDevicePrivate()
+    : m_transport(new QUsbLibusbTransport)
 {
-    int rc = libusb_init(&m_ctx);
-    if (rc < 0) {
-        qCritical("LibUsb Init Error %d", rc);
-    }
     m_devHandle = Q_NULLPTR;
-    m_callbackHandle = 0;
-    m_hasHotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) != 0;
+    m_devMem = false;
+}
 
-    m_events = new QUsbEventsThread();
-    m_events->m_ctx = m_ctx;
-    m_events->start();
+QUsbDevicePrivate::~QUsbDevicePrivate()
+{
+    // ~QUsbDevice() closed the device already, pending transfers are only left if that timed out
+    qDeleteAll(m_controlFree);
+    qDeleteAll(m_controlPending);
+    delete m_transport;
 }
 
-void QUsbDevicePrivate::registerDisconnectCallback(int vid, int pid)
+/*!
+    \brief Replace the transport with \a transport, which is owned from now on.
+
+    Only allowed while the device is closed, the previous transport is deleted.
+ */
+void QUsbDevicePrivate::setTransport(QUsbTransport *transport)
+{
+    Q_Q(QUsbDevice);
+    Q_ASSERT(transport);
+    if (m_devHandle) {
+        qWarning("QUsbDevice: Cannot change the transport of an open device");
+        delete transport;
+        return;
+    }
+
+    delete m_transport;
+    m_transport = transport;
+    m_transport->setDevice(q);
+    m_transport->setLogLevel(q->m_log_level);
+}
+
+void QUsbDevicePrivate::parseDescriptors()
 {
     DbgPrintPrivFuncName();
-    if (m_hasHotplug) {
-
-        int rc;
-        rc = libusb_hotplug_register_callback(m_ctx,
-                                              static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
-                                              LIBUSB_HOTPLUG_ENUMERATE,
-                                              vid,
-                                              pid,
-                                              LIBUSB_HOTPLUG_MATCH_ANY,
-                                              reinterpret_cast<libusb_hotplug_callback_fn>(DeviceLeftCallback),
-                                              reinterpret_cast<void *>(&m_classes),
-                                              &m_callbackHandle);
-        if (LIBUSB_SUCCESS != rc) {
-            libusb_exit(m_ctx);
-            qWarning("Error creating hotplug callback");
-            return;
+    m_deviceDescriptor = QUsbDevice::DeviceDescriptor();
+    m_configDescriptor = QUsbDevice::ConfigDescriptor();
+    m_transport->descriptors(m_devHandle, &m_deviceDescriptor, &m_configDescriptor);
+}
+
+QUsbDevice::DeviceStatus QUsbDevicePrivate::transferStatus(libusb_transfer_status status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return QUsbDevice::statusOK;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return QUsbDevice::statusTimeout;
+    case LIBUSB_TRANSFER_STALL:
+        return QUsbDevice::statusPipeError;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return QUsbDevice::statusNoSuchDevice;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return QUsbDevice::statusOverflow;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return QUsbDevice::statusInterrupted;
+    default:
+        return QUsbDevice::statusIoError;
+    }
+}
+
+void QUsbDevicePrivate::reserveControlTransfers()
+{
+    QMutexLocker locker(&m_controlMutex);
+    while (m_controlFree.size() + m_controlPending.size() < ControlPoolSize)
+        m_controlFree.append(new QUsbControlTransfer(this));
+}
+
+QUsbControlTransfer *QUsbDevicePrivate::takeControlTransfer()
+{
+    // m_controlMutex must be held
+    QUsbControlTransfer *t = m_controlFree.isEmpty() ? new QUsbControlTransfer(this) : m_controlFree.takeLast();
+    t->m_batch = Q_NULLPTR;
+    t->m_index = 0;
+    return t;
+}
+
+bool QUsbDevicePrivate::prepareControlTransfer(QUsbControlTransfer *t, const QUsbDevice::ControlRequest &request)
+{
+    Q_Q(QUsbDevice);
+
+    // The data stage length goes in wLength, 16 bits
+    const bool in = request.bmRequestType & LIBUSB_ENDPOINT_IN;
+    if (!in && request.data.size() > std::numeric_limits<quint16>::max())
+        return false;
+    const quint16 length = in ? request.wLength : static_cast<quint16>(request.data.size());
+
+    // Pooled buffers keep their capacity, only unusually large requests allocate.
+    t->m_buf.resize(LIBUSB_CONTROL_SETUP_SIZE + length);
+    auto buf = reinterpret_cast<uchar *>(t->m_buf.data());
+    libusb_fill_control_setup(buf, request.bmRequestType, request.bRequest, request.wValue, request.wIndex, length);
+    if (!in && length)
+        memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, request.data.constData(), length);
+
+    libusb_fill_control_transfer(t->m_transfer, m_devHandle, buf, cb_control, t, q->m_timeout);
+    return true;
+}
+
+int QUsbDevicePrivate::submitControlTransfer(QUsbControlTransfer *t)
+{
+    // m_controlMutex must be held, so the callback can't overtake us.
+    m_capture.submit(t->m_transfer);
+    int rc = m_transport->submit(t->m_transfer);
+    if (rc == LIBUSB_SUCCESS)
+        m_controlPending.append(t);
+    else
+        m_capture.submitFailed(t->m_transfer, rc);
+    return rc;
+}
+
+void QUsbDevicePrivate::completeControlTransfer(QUsbControlTransfer *t)
+{
+    libusb_transfer *tr = t->m_transfer;
+    QUsbControlBatch *b = t->m_batch;
+    const int index = t->m_index;
+    QUsbDevice::ControlResult result;
+
+    m_capture.complete(tr);
+    result.status = transferStatus(tr->status);
+    if (libusb_control_transfer_get_setup(tr)->bmRequestType & LIBUSB_ENDPOINT_IN)
+        result.data = QByteArray(reinterpret_cast<const char *>(libusb_control_transfer_get_data(tr)), tr->actual_length);
+
+    if (!b) {
+        t->m_promise.addResult(result);
+        t->m_promise.finish();
+    }
+
+    m_controlMutex.lock();
+    m_controlPending.removeOne(t);
+    m_controlFree.append(t);
+    m_controlCond.wakeAll();
+    if (!b) {
+        m_controlMutex.unlock();
+        return;
+    }
+
+    b->m_results[index] = result;
+    b->m_inflight--;
+    if (result.status != QUsbDevice::statusOK && (b->m_failed < 0 || index < b->m_failed)) {
+        b->m_failed = index;
+        // Requests queued behind it must not reach the device
+        for (QUsbControlTransfer *p : std::as_const(m_controlPending)) {
+            if (p->m_batch == b && p->m_index > index)
+                m_transport->cancel(p->m_transfer);
+        }
+    }
+
+    // Keep the pipeline full straight from the event thread
+    const bool done = fillControlBatch(b);
+    m_controlMutex.unlock();
+
+    if (done)
+        finishControlBatch(b);
+}
+
+bool QUsbDevicePrivate::fillControlBatch(QUsbControlBatch *b)
+{
+    // m_controlMutex must be held, returns true when the batch is over.
+    while (b->m_failed < 0 && b->m_next < b->m_requests.size() && b->m_inflight < b->m_depth) {
+        QUsbControlTransfer *t = takeControlTransfer();
+        t->m_batch = b;
+        t->m_index = b->m_next;
+        int rc = LIBUSB_ERROR_INVALID_PARAM;
+        if (prepareControlTransfer(t, b->m_requests.at(b->m_next)))
+            rc = submitControlTransfer(t);
+        if (rc != LIBUSB_SUCCESS) {
+            m_controlFree.append(t);
+            b->m_results[b->m_next].status = static_cast<QUsbDevice::DeviceStatus>(rc);
+            b->m_failed = b->m_next;
+            break;
         }
+        b->m_next++;
+        b->m_inflight++;
     }
+    return b->m_inflight == 0 && (b->m_failed >= 0 || b->m_next == b->m_requests.size());
 }
 
-void QUsbDevicePrivate::deregisterDisconnectCallback()
+void QUsbDevicePrivate::finishControlBatch(QUsbControlBatch *b)
 {
-    DbgPrintPrivFuncName();
-    libusb_hotplug_deregister_callback(m_ctx, m_callbackHandle);
-    m_callbackHandle = 0;
+    QUsbDevice::ControlBatchResult result;
+    result.failedIndex = b->m_failed;
+    result.results = b->m_results.mid(0, b->m_failed < 0 ? b->m_results.size() : b->m_failed + 1);
+
+    // Continuations may run right away, don't hold any lock here.
+    b->m_promise.addResult(result);
+    b->m_promise.finish();
+    delete b;
 }
 
-QUsbDevicePrivate::~QUsbDevicePrivate()
+void QUsbDevicePrivate::cancelControlTransfers()
 {
-    DbgPrintPrivFuncName();
-    if (m_hasHotplug) {
-        deregisterDisconnectCallback();
+    // Futures finish with statusInterrupted once the callbacks have run
+    QMutexLocker locker(&m_controlMutex);
+    for (QUsbControlTransfer *t : std::as_const(m_controlPending))
+        m_transport->cancel(t->m_transfer);
+}
+
+bool QUsbDevicePrivate::waitForControlTransfers()
+{
+    Q_Q(QUsbDevice);
+
+    // Callbacks use the transfers and this device, they must all have run. Canceled ones are quick,
+    // the others end within the device timeout, or never when it is 0.
+    const QDeadlineTimer deadline(q->m_timeout ? q->m_timeout + ControlWaitMargin : -1);
+    QMutexLocker locker(&m_controlMutex);
+    if (!m_controlPending.isEmpty() && m_transport->isEventThread()) {
+        // They would only complete once the callback running here returns
+        if (q->m_log_level >= QUsb::logWarning)
+            qWarning("QUsbDevice: Can't wait for control transfers from a transfer callback");
+        return false;
+    }
+    while (!m_controlPending.isEmpty()) {
+        if (!m_transport->wait(&m_controlCond, &m_controlMutex, deadline) && !m_controlPending.isEmpty()) {
+            if (q->m_log_level >= QUsb::logWarning)
+                qWarning("QUsbDevice: Timed out waiting for control transfers");
+            return false;
+        }
+    }
+    return true;
+}
+
+char *QUsbDevicePrivate::allocBuffer(qint64 size, libusb_device_handle **handle)
+{
+    QMutexLocker locker(&m_devMemMutex);
+    *handle = Q_NULLPTR;
+
+    // Kernel buffers mapped into userspace, not every backend has them.
+    if (m_devMem && m_devHandle) {
+        uchar *buffer = m_transport->allocDeviceMemory(m_devHandle, size);
+        if (buffer) {
+            *handle = m_devHandle;
+            m_devMemBuffers[m_devHandle]++;
+            return reinterpret_cast<char *>(buffer);
+        }
+    }
+
+    return reinterpret_cast<char *>(qMallocAligned(static_cast<size_t>(size), QUsbDevice::BufferAlignment));
+}
+
+void QUsbDevicePrivate::freeBuffer(char *buffer, qint64 size, libusb_device_handle *handle)
+{
+    if (!buffer)
+        return;
+
+    if (!handle) {
+        qFreeAligned(buffer);
+        return;
     }
-    m_events->requestInterruption();
-    m_events->wait();
-    m_events->deleteLater();
 
-    m_classes.pub->close();
-    libusb_exit(m_ctx);
+    QMutexLocker locker(&m_devMemMutex);
+    m_transport->freeDeviceMemory(handle, reinterpret_cast<uchar *>(buffer), size);
+
+    // The last buffer of a closed handle finishes closing it
+    if (--m_devMemBuffers[handle] == 0) {
+        m_devMemBuffers.remove(handle);
+        if (m_closingHandles.removeOne(handle))
+            m_transport->close(handle);
+    }
 }
 
 /*!
@@ -99,6 +304,11 @@ QUsbDevicePrivate::~QUsbDevicePrivate()
     \inmodule QtUsb
  */
 
+/*!
+    \variable QUsbDevice::BufferAlignment
+    \brief Alignment of transfer buffers allocated from the heap.
+ */
+
 /*!
     \enum QUsbDevice::DeviceSpeed
 
@@ -134,7 +344,7 @@ QUsbDevice::QUsbDevice(QObject *parent)
 {
     DbgPrintFuncName();
     Q_D(QUsbDevice);
-    d->m_classes = { d, this };
+    d->m_transport->setDevice(this);
 
     m_spd = unknownSpeed;
     m_connected = false;
@@ -241,89 +451,36 @@ qint32 QUsbDevice::open()
     DbgPrintFuncName();
     Q_D(QUsbDevice);
 
-    int rc = -5; // Not found by default
-    ssize_t cnt; // holding number of devices in list
-    libusb_device *dev = Q_NULLPTR;
+    int rc;
 
     if (m_connected)
         return -1;
 
-    if ((m_id.pid == 0 || m_id.vid == 0) && (m_id.dClass == 0 || m_id.dSubClass == 0) && (m_id.bus == QUsb::busAny || m_id.port == QUsb::portAny)) {
+    if ((m_id.pid == 0 || m_id.vid == 0) && (m_id.dClass == 0 || m_id.dSubClass == 0) && (m_id.bus == QUsb::busAny || (m_id.port == QUsb::portAny && d->m_portPath.isEmpty()))) {
         qWarning("No device IDs or classes are defined. Aborting.");
         return -1;
     }
 
-    cnt = libusb_get_device_list(d->m_ctx, &d->m_devs); // get the list of devices
-    if (cnt < 0) {
-        qCritical("libusb_get_device_list error");
-        libusb_free_device_list(d->m_devs, 1);
-        return -1;
-    }
-
-    for (int i = 0; i < cnt; i++) {
-        dev = d->m_devs[i];
-        quint8 bus = libusb_get_bus_number(dev);
-        quint8 port = libusb_get_port_number(dev);
-        libusb_device_descriptor desc;
-
-        if (libusb_get_device_descriptor(dev, &desc) == 0) {
-            QUsb::Id tmp_id(m_id);
-            // Assign default properties in order to match
-            if (tmp_id.pid == 0)
-                tmp_id.pid = desc.idProduct;
-            if (tmp_id.vid == 0)
-                tmp_id.vid = desc.idVendor;
-            if (tmp_id.bus == QUsb::busAny)
-                tmp_id.bus = bus;
-            if (tmp_id.port == QUsb::portAny)
-                tmp_id.port = port;
-            if (tmp_id.dClass == 0)
-                tmp_id.dClass = desc.bDeviceClass;
-            if (tmp_id.dSubClass == 0)
-                tmp_id.dSubClass = desc.bDeviceSubClass;
-
-            // Check all properties match. Defaults have been assigned above.
-            if (desc.idProduct == tmp_id.pid && desc.idVendor == tmp_id.vid
-                && bus == tmp_id.bus && port == tmp_id.port
-                && desc.bDeviceClass == tmp_id.dClass && desc.bDeviceSubClass == tmp_id.dSubClass) {
-                if (m_log_level >= QUsb::logInfo)
-                    qInfo("Found device");
-
-                rc = libusb_open(dev, &d->m_devHandle);
-                if (rc == 0) {
-                    m_id = tmp_id;
-                    break;
-                }
-                else if (m_log_level >= QUsb::logWarning) {
-                    qWarning("Failed to open device: %s", libusb_strerror(static_cast<enum libusb_error>(rc)));
-                }
-            }
-        }
-    }
-    libusb_free_device_list(d->m_devs, 1); // free the list, unref the devices in it
-
+    // The path found is kept apart, the next open() with another id must not be held to it
+    QList<quint8> path = d->m_portPath;
+    rc = d->m_transport->open(&m_id, &path, &d->m_devHandle);
     if (rc != 0 || d->m_devHandle == Q_NULLPTR) {
         return rc;
     }
+    d->m_devicePath = path;
 
     if (m_log_level >= QUsb::logInfo)
         qInfo("Device Open");
 
-    if (libusb_kernel_driver_active(d->m_devHandle, m_config.interface) == 1) { // find out if kernel driver is attached
-        if (m_log_level >= QUsb::logDebug)
-            qDebug("Kernel Driver Active");
-        if (libusb_detach_kernel_driver(d->m_devHandle, m_config.interface) == 0) // detach it
-            if (m_log_level >= QUsb::logDebug)
-                qDebug("Kernel Driver Detached!");
-    }
+    d->m_transport->detachKernelDriver(d->m_devHandle, m_config.interface);
 
     int conf;
-    libusb_get_configuration(d->m_devHandle, &conf);
+    d->m_transport->configuration(d->m_devHandle, &conf);
 
     if (conf != m_config.config) {
         if (m_log_level >= QUsb::logInfo)
             qInfo("Configuration needs to be changed");
-        rc = libusb_set_configuration(d->m_devHandle, m_config.config);
+        rc = d->m_transport->setConfiguration(d->m_devHandle, m_config.config);
         if (rc != 0) {
             if (m_log_level >= QUsb::logWarning)
                 qWarning("Cannot Set Configuration");
@@ -331,7 +488,7 @@ qint32 QUsbDevice::open()
             return -3;
         }
     }
-    rc = libusb_claim_interface(d->m_devHandle, m_config.interface);
+    rc = d->m_transport->claimInterface(d->m_devHandle, m_config.interface);
     if (rc != 0) {
         if (m_log_level >= QUsb::logWarning)
             qWarning("Cannot Claim Interface");
@@ -339,28 +496,14 @@ qint32 QUsbDevice::open()
         return -4;
     }
 
-    switch (libusb_get_device_speed(dev)) {
-    case LIBUSB_SPEED_LOW:
-        this->m_spd = lowSpeed;
-        break;
-    case LIBUSB_SPEED_FULL:
-        this->m_spd = fullSpeed;
-        break;
-    case LIBUSB_SPEED_HIGH:
-        this->m_spd = highSpeed;
-        break;
-    case LIBUSB_SPEED_SUPER:
-        this->m_spd = superSpeed;
-        break;
-    default:
-        this->m_spd = unknownSpeed;
-        break;
-    }
+    this->m_spd = d->m_transport->speed(d->m_devHandle);
 
-    d->registerDisconnectCallback(m_id.vid, m_id.pid);
+    quint8 bus, address;
+    d->m_transport->address(d->m_devHandle, &bus, &address);
+    d->m_capture.setDevice(bus, address);
 
-    if (!d->m_events->isRunning()) // if event handling thread is not running start it. The thread was stopped upon closing the device.
-        d->m_events->start();
+    d->reserveControlTransfers();
+    d->parseDescriptors();
 
     m_connected = true;
     emit connectionChanged(m_connected);
@@ -370,6 +513,9 @@ qint32 QUsbDevice::open()
 
 /*!
     \brief Close the device.
+
+    Transfers of its endpoints are canceled, and queued writes dropped. The endpoints stay
+    open, data already received can still be read.
  */
 void QUsbDevice::close()
 {
@@ -381,14 +527,32 @@ void QUsbDevice::close()
         if (m_log_level >= QUsb::logInfo)
             qInfo("Closing USB connection");
 
-        d->deregisterDisconnectCallback();
+        // Polled endpoints no longer resubmit
+        m_connected = false;
 
-        libusb_release_interface(d->m_devHandle, 0); // release the claimed interface
-        libusb_close(d->m_devHandle); // close the device we opened
-        d->m_events->exit(0); // stop event handling thread
-        d->m_events->wait();
+        // Futures finish and endpoint callbacks run before the handle goes away and events possibly stop
+        d->cancelControlTransfers();
+        const QList<QUsbEndpoint *> endpoints = findChildren<QUsbEndpoint *>(Qt::FindDirectChildrenOnly);
+        for (QUsbEndpoint *ep : endpoints)
+            ep->cancelTransfer();
+        d->waitForControlTransfers();
+        for (QUsbEndpoint *ep : endpoints)
+            static_cast<QUsbEndpointPrivate *>(QObjectPrivate::get(ep))->waitForPendingTransfers();
+
+        d->m_transport->releaseInterface(d->m_devHandle, 0); // release the claimed interface
+
+        // Mapped buffers belong to the handle, it is closed once they are all freed.
+        d->m_devMemMutex.lock();
+        if (d->m_devMemBuffers.value(d->m_devHandle) > 0)
+            d->m_closingHandles.append(d->m_devHandle);
+        else
+            d->m_transport->close(d->m_devHandle); // close the device we opened
+        d->m_devMemMutex.unlock();
+        d->m_transport->stop();
         d->m_devHandle = Q_NULLPTR;
-        m_connected = false;
+        d->m_devicePath.clear();
+        d->m_deviceDescriptor = DeviceDescriptor();
+        d->m_configDescriptor = ConfigDescriptor();
         emit connectionChanged(m_connected);
     } else { // do not emit signal if device is already closed.
         if (m_log_level >= QUsb::logInfo)
@@ -404,10 +568,7 @@ void QUsbDevice::setLogLevel(QUsb::LogLevel level)
     DbgPrintFuncName();
     Q_D(QUsbDevice);
     m_log_level = level;
-    if (level >= QUsb::logDebugAll)
-        libusb_set_option(d->m_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
-    else
-        libusb_set_option(d->m_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_NONE);
+    d->m_transport->setLogLevel(level);
 }
 
 /*!
@@ -418,6 +579,19 @@ void QUsbDevice::setId(const QUsb::Id &id)
     m_id = id;
 }
 
+/*!
+    \brief Set the port numbers leading to the device from its root hub, \a path.
+
+    Unlike the port of the id, which is only the last one, the path tells apart devices
+    plugged in the same port of different hubs. Along with the bus of the id, it is
+    enough to open a device. An empty path matches any device.
+ */
+void QUsbDevice::setPortPath(const QList<quint8> &path)
+{
+    Q_D(QUsbDevice);
+    d->m_portPath = path;
+}
+
 /*!
     \brief Set the device \a config.
  */
@@ -442,6 +616,18 @@ QUsb::Id QUsbDevice::id() const
     return m_id;
 }
 
+/*!
+    \brief Returns the port numbers leading to the device from its root hub.
+
+    While the device is open, this is the path of the device found. Otherwise it is
+    the path set with setPortPath().
+ */
+QList<quint8> QUsbDevice::portPath() const
+{
+    Q_D(const QUsbDevice);
+    return d->m_devHandle ? d->m_devicePath : d->m_portPath;
+}
+
 /*!
     \brief Returns the current \c config.
  */
@@ -491,22 +677,324 @@ QUsb::LogLevel QUsbDevice::logLevel() const
 }
 
 /*!
-    \brief Returns the device \c speed.
+    \brief Returns the device descriptor.
+
+    Descriptors are read once when the device is opened, this never talks to the device.
+    Fields are zero while the device is closed.
  */
-QUsbDevice::DeviceSpeed QUsbDevice::speed() const
+QUsbDevice::DeviceDescriptor QUsbDevice::deviceDescriptor() const
 {
-    return m_spd;
+    Q_D(const QUsbDevice);
+    return d->m_deviceDescriptor;
 }
 
-void QUsbEventsThread::run()
+/*!
+    \brief Returns the active configuration descriptor, with all its interfaces and endpoints.
+
+    \sa deviceDescriptor()
+ */
+QUsbDevice::ConfigDescriptor QUsbDevice::configDescriptor() const
 {
-    timeval t = { 0, 100000 };
-    while (!this->isInterruptionRequested()) {
-        if (libusb_event_handling_ok(m_ctx) == 0) {
-            break;
+    Q_D(const QUsbDevice);
+    return d->m_configDescriptor;
+}
+
+/*!
+    \brief Returns the endpoints of \a interface in its \a alternate setting.
+
+    \sa deviceDescriptor()
+ */
+QList<QUsbDevice::EndpointDescriptor> QUsbDevice::endpoints(quint8 interface, quint8 alternate) const
+{
+    Q_D(const QUsbDevice);
+    for (const InterfaceDescriptor &i : d->m_configDescriptor.interfaces) {
+        if (i.number == interface && i.alternate == alternate)
+            return i.endpoints;
+    }
+    return QList<EndpointDescriptor>();
+}
+
+/*!
+    \brief Returns the descriptor of the endpoint at \a address.
+
+    The claimed interface and alternate setting from config() are searched first.
+    The returned address is \c 0 if there is no such endpoint.
+    \sa deviceDescriptor()
+ */
+QUsbDevice::EndpointDescriptor QUsbDevice::findEndpoint(quint8 address) const
+{
+    Q_D(const QUsbDevice);
+    EndpointDescriptor found;
+
+    for (const InterfaceDescriptor &i : d->m_configDescriptor.interfaces) {
+        const bool claimed = i.number == m_config.interface && i.alternate == m_config.alternate;
+        for (const EndpointDescriptor &e : i.endpoints) {
+            if (e.address != address)
+                continue;
+            if (claimed)
+                return e;
+            if (found.address == 0)
+                found = e;
         }
-        if (libusb_handle_events_timeout_completed(m_ctx, &t, Q_NULLPTR) != 0) {
-            break;
+    }
+    return found;
+}
+
+/*!
+    \brief Allocate \a count USB 3 bulk streams on each of the bulk \a endpoints.
+
+    Streams are numbered from 1, each one can be used by its own streamEndpoint
+    QUsbEndpoint with QUsbEndpoint::setStreamId(). The device must be open.
+    Returns the number of streams allocated, which may be less than requested,
+    or a negative libusb error code.
+ */
+qint32 QUsbDevice::allocStreams(quint32 count, const QList<quint8> &endpoints)
+{
+    DbgPrintFuncName();
+    Q_D(QUsbDevice);
+
+    if (!d->m_devHandle || !m_connected)
+        return -1;
+
+    QByteArray eps(reinterpret_cast<const char *>(endpoints.constData()), endpoints.size());
+    int rc = d->m_transport->allocStreams(d->m_devHandle, count, reinterpret_cast<uchar *>(eps.data()), eps.size());
+    if (rc < 0) {
+        if (m_log_level >= QUsb::logWarning)
+            qWarning("Could not allocate %u streams, error %d", count, rc);
+        handleUsbError(rc);
+    }
+    return rc;
+}
+
+/*!
+    \brief Free the bulk streams allocated on \a endpoints.
+
+    Returns \c 0 on success, or a negative libusb error code.
+ */
+qint32 QUsbDevice::freeStreams(const QList<quint8> &endpoints)
+{
+    DbgPrintFuncName();
+    Q_D(QUsbDevice);
+
+    if (!d->m_devHandle || !m_connected)
+        return -1;
+
+    QByteArray eps(reinterpret_cast<const char *>(endpoints.constData()), endpoints.size());
+    int rc = d->m_transport->freeStreams(d->m_devHandle, reinterpret_cast<uchar *>(eps.data()), eps.size());
+    if (rc < 0)
+        handleUsbError(rc);
+    return rc;
+}
+
+/*!
+    \brief Submit the control \a request, without waiting for it to complete.
+
+    The direction follows bit 7 of bmRequestType. IN requests read up to wLength bytes,
+    OUT requests send data, at most 65535 bytes or the request fails with statusInvalidParam.
+    Several requests can be queued, they complete in order.
+    Transfers and their buffers come from a pool filled when the device is opened.
+
+    Returns a future holding the status and the received payload once the transfer completes.
+ */
+QFuture<QUsbDevice::ControlResult> QUsbDevice::controlTransfer(const ControlRequest &request)
+{
+    DbgPrintFuncName();
+    Q_D(QUsbDevice);
+
+    if (!d->m_devHandle || !m_connected) {
+        QPromise<ControlResult> promise;
+        ControlResult result;
+        result.status = statusNoSuchDevice;
+        promise.start();
+        promise.addResult(result);
+        promise.finish();
+        return promise.future();
+    }
+
+    d->m_controlMutex.lock();
+    QUsbControlTransfer *t = d->takeControlTransfer();
+    d->m_controlMutex.unlock();
+
+    t->m_promise = QPromise<ControlResult>();
+    t->m_promise.start();
+    QFuture<ControlResult> future = t->m_promise.future();
+
+    int rc = LIBUSB_ERROR_INVALID_PARAM;
+    if (d->prepareControlTransfer(t, request)) {
+        d->m_controlMutex.lock();
+        rc = d->submitControlTransfer(t);
+        d->m_controlMutex.unlock();
+    }
+
+    if (rc != LIBUSB_SUCCESS) {
+        if (m_log_level >= QUsb::logWarning)
+            qWarning("Could not submit control transfer, error %d", rc);
+        handleUsbError(rc);
+
+        ControlResult result;
+        result.status = static_cast<DeviceStatus>(rc);
+        t->m_promise.addResult(result);
+        t->m_promise.finish();
+
+        d->m_controlMutex.lock();
+        d->m_controlFree.append(t);
+        d->m_controlMutex.unlock();
+    }
+    return future;
+}
+
+/*!
+    \brief Run the control \a requests in order, keeping up to \a depth of them submitted at once.
+
+    Requests are resubmitted directly from the libusb event thread as earlier ones complete,
+    there is no event loop round trip between them. The batch stops at the first request
+    that fails, typically a stall, and requests queued behind it are canceled. With a \a depth
+    larger than 1 the device may still have received some of them, use \c 1 when that matters.
+
+    Returns a future holding one result per request up to the failed one, and its index.
+ */
+QFuture<QUsbDevice::ControlBatchResult> QUsbDevice::controlTransferBatch(const QList<ControlRequest> &requests, int depth)
+{
+    DbgPrintFuncName();
+    Q_D(QUsbDevice);
+
+    QUsbControlBatch *b = new QUsbControlBatch;
+    b->m_requests = requests;
+    b->m_results.resize(requests.size());
+    b->m_depth = qMax(1, depth);
+    b->m_promise.start();
+    QFuture<ControlBatchResult> future = b->m_promise.future();
+
+    if (!d->m_devHandle || !m_connected) {
+        if (!requests.isEmpty()) {
+            b->m_results[0].status = statusNoSuchDevice;
+            b->m_failed = 0;
         }
+        d->finishControlBatch(b);
+        return future;
     }
+
+    d->m_controlMutex.lock();
+    const bool done = d->fillControlBatch(b);
+    d->m_controlMutex.unlock();
+
+    if (done)
+        d->finishControlBatch(b);
+    return future;
+}
+
+/*!
+    \brief Submit a control request made of \a bmRequestType, \a bRequest, \a wValue and \a wIndex.
+
+    OUT requests send \a data, IN requests read up to \a wLength bytes.
+    \sa controlTransfer()
+ */
+QFuture<QUsbDevice::ControlResult> QUsbDevice::controlTransfer(quint8 bmRequestType, quint8 bRequest, quint16 wValue,
+                                                               quint16 wIndex, const QByteArray &data, quint16 wLength)
+{
+    ControlRequest request;
+    request.bmRequestType = bmRequestType;
+    request.bRequest = bRequest;
+    request.wValue = wValue;
+    request.wIndex = wIndex;
+    request.wLength = wLength;
+    request.data = data;
+    return controlTransfer(request);
+}
+
+/*!
+    \brief Wait up to \a msecs milliseconds for the \a future of a controlTransfer() to finish, \c -1 waits forever.
+
+    Use it instead of QFuture::waitForFinished() from the thread set with QUsb::setEventThread(),
+    which has to handle the completion itself. Returns \c true if the future is finished.
+ */
+bool QUsbDevice::waitForControlTransfer(const QFuture<ControlResult> &future, int msecs)
+{
+    Q_D(QUsbDevice);
+    QDeadlineTimer deadline(msecs);
+
+    // Futures are finished before their completion wakes m_controlCond
+    QMutexLocker locker(&d->m_controlMutex);
+    while (!future.isFinished()) {
+        if (!d->m_transport->wait(&d->m_controlCond, &d->m_controlMutex, deadline))
+            return future.isFinished();
+    }
+    return true;
+}
+
+/*!
+    \brief Enable or disable device memory for transfer buffers with \a enable.
+
+    When enabled, endpoint buffers are allocated with libusb_dev_mem_alloc(), which maps
+    kernel memory into userspace and saves a copy on each transfer. This is only supported
+    by some backends (Linux usbfs), others fall back to heap memory aligned on
+    \c BufferAlignment bytes.
+    Only buffers allocated after this call are affected. Disabled by default.
+ */
+void QUsbDevice::setDeviceMemory(bool enable)
+{
+    Q_D(QUsbDevice);
+    QMutexLocker locker(&d->m_devMemMutex);
+    d->m_devMem = enable;
+}
+
+/*!
+    \brief Returns \c true if transfer buffers are allocated from device memory when possible.
+ */
+bool QUsbDevice::deviceMemory() const
+{
+    Q_D(const QUsbDevice);
+    return d->m_devMem;
+}
+
+/*!
+    \brief Starts recording every transfer of this device to \a fileName.
+
+    Submissions and completions of endpoint and control transfers are written as
+    a pcapng file using the usbmon link type (LINKTYPE_USB_LINUX_MMAPPED), which
+    Wireshark decodes like a usbmon capture, without needing root or capturing the whole bus.
+    Records go through a lock-free ring and are written by a background thread, so
+    capturing can stay enabled at full bulk rate. Payloads are truncated to
+    QUsbCapture::SnapLength bytes, records are dropped if the ring overflows.
+    The capture may be started before open(). Returns \c false if the file can't be
+    created or a capture is already running.
+ */
+bool QUsbDevice::startCapture(const QString &fileName)
+{
+    Q_D(QUsbDevice);
+    DbgPrintFuncName();
+    const bool started = d->m_capture.start(fileName);
+    if (!started && m_log_level >= QUsb::logWarning)
+        qWarning("QUsbDevice: Cannot start capture to %s", qPrintable(fileName));
+    return started;
+}
+
+/*!
+    \brief Stops the capture, records still queued are written before the file is closed.
+ */
+void QUsbDevice::stopCapture()
+{
+    Q_D(QUsbDevice);
+    DbgPrintFuncName();
+    d->m_capture.stop();
+    const quint64 dropped = d->m_capture.dropped();
+    if (dropped && m_log_level >= QUsb::logWarning)
+        qWarning("QUsbDevice: Capture dropped %llu records", dropped);
+}
+
+/*!
+    \brief Returns \c true while transfers are being captured.
+ */
+bool QUsbDevice::isCapturing() const
+{
+    Q_D(const QUsbDevice);
+    return d->m_capture.isActive();
+}
+
+/*!
+    \brief Returns the device \c speed.
+ */
+QUsbDevice::DeviceSpeed QUsbDevice::speed() const
+{
+    return m_spd;
 }
@@ -5,6 +5,7 @@
 #include "qusb.h"
 #include <QByteArray>
 #include <QDebug>
+#include <QFuture>
 #include <QString>
 
 QT_BEGIN_NAMESPACE
@@ -23,6 +24,7 @@ class Q_USB_EXPORT QUsbDevice : public QObject
 
 public:
     static const quint16 DefaultTimeout = 250;
+    static const int BufferAlignment = 4096;
 
     enum DeviceSpeed : qint8 {
         unknownSpeed = -1,
@@ -52,12 +54,70 @@ public:
     };
     Q_ENUM(DeviceStatus)
 
+    struct DeviceDescriptor {
+        quint16 bcdUSB = 0;
+        quint8 deviceClass = 0;
+        quint8 deviceSubClass = 0;
+        quint8 deviceProtocol = 0;
+        quint8 maxPacketSize0 = 0;
+        quint16 vid = 0;
+        quint16 pid = 0;
+        quint16 bcdDevice = 0;
+        quint8 numConfigurations = 0;
+    };
+
+    struct EndpointDescriptor {
+        quint8 address = 0;
+        quint8 attributes = 0; // Transfer type in bits 1:0
+        quint16 maxPacketSize = 0; // Without the mult bits
+        quint8 interval = 0;
+        quint8 mult = 0; // Extra transactions per service interval
+        quint8 maxBurst = 0; // Extra packets per burst, SuperSpeed only
+        quint16 bytesPerInterval = 0; // SuperSpeed periodic endpoints only
+    };
+
+    struct InterfaceDescriptor {
+        quint8 number = 0;
+        quint8 alternate = 0;
+        quint8 interfaceClass = 0;
+        quint8 interfaceSubClass = 0;
+        quint8 interfaceProtocol = 0;
+        QList<EndpointDescriptor> endpoints;
+    };
+
+    struct ConfigDescriptor {
+        quint8 value = 0;
+        quint8 attributes = 0;
+        quint8 maxPower = 0;
+        QList<InterfaceDescriptor> interfaces;
+    };
+
+    struct ControlRequest {
+        quint8 bmRequestType = 0;
+        quint8 bRequest = 0;
+        quint16 wValue = 0;
+        quint16 wIndex = 0;
+        quint16 wLength = 0; // Bytes to read for IN requests
+        QByteArray data; // Payload for OUT requests
+    };
+
+    struct ControlResult {
+        DeviceStatus status = statusOK;
+        QByteArray data; // Payload received by IN requests
+    };
+
+    struct ControlBatchResult {
+        QList<ControlResult> results; // One per request, up to the one that failed
+        int failedIndex = -1; // First request that failed, -1 if all succeeded
+    };
+
     Q_PROPERTY(QUsb::LogLevel logLevel READ logLevel WRITE setLogLevel)
     Q_PROPERTY(QUsb::Id id READ id WRITE setId)
     Q_PROPERTY(QUsb::Config config READ config WRITE setConfig)
     Q_PROPERTY(quint16 pid READ pid)
     Q_PROPERTY(quint16 vid READ vid)
     Q_PROPERTY(quint16 timeout READ timeout WRITE setTimeout)
+    Q_PROPERTY(bool deviceMemory READ deviceMemory WRITE setDeviceMemory)
     Q_PROPERTY(DeviceSpeed speed READ speed)
     Q_PROPERTY(DeviceStatus status READ status NOTIFY statusChanged)
     Q_PROPERTY(bool connected READ isConnected NOTIFY connectionChanged)
@@ -67,12 +127,15 @@ public:
 
     void setLogLevel(QUsb::LogLevel level);
     void setId(const QUsb::Id &id);
+    void setPortPath(const QList<quint8> &path);
     void setConfig(const QUsb::Config &config);
     void setTimeout(quint16 timeout);
+    void setDeviceMemory(bool enable);
     bool isConnected() const;
     quint16 pid() const;
     quint16 vid() const;
     quint16 timeout() const;
+    bool deviceMemory() const;
     QUsb::LogLevel logLevel() const;
     DeviceSpeed speed() const;
     QByteArray speedString() const;
@@ -80,8 +143,28 @@ public:
     QByteArray statusString() const;
 
     QUsb::Id id() const;
+    QList<quint8> portPath() const;
     QUsb::Config config() const;
 
+    DeviceDescriptor deviceDescriptor() const;
+    ConfigDescriptor configDescriptor() const;
+    QList<EndpointDescriptor> endpoints(quint8 interface, quint8 alternate = 0) const;
+    EndpointDescriptor findEndpoint(quint8 address) const;
+
+    qint32 allocStreams(quint32 count, const QList<quint8> &endpoints);
+    qint32 freeStreams(const QList<quint8> &endpoints);
+
+    QFuture<ControlResult> controlTransfer(const ControlRequest &request);
+    QFuture<ControlResult> controlTransfer(quint8 bmRequestType, quint8 bRequest, quint16 wValue,
+                                           quint16 wIndex, const QByteArray &data = QByteArray(),
+                                           quint16 wLength = 0);
+    QFuture<ControlBatchResult> controlTransferBatch(const QList<ControlRequest> &requests, int depth = 8);
+    bool waitForControlTransfer(const QFuture<ControlResult> &future, int msecs = -1);
+
+    bool startCapture(const QString &fileName);
+    void stopCapture();
+    bool isCapturing() const;
+
 private:
     void handleUsbError(int error_code);
 
@@ -13,54 +13,96 @@
 //
 
 #include "qusbdevice.h"
+#include "qusbcapture_p.h"
+#include "qusbtransport_p.h"
 #include <private/qobject_p.h>
-#include <QThread>
-
-#if defined(Q_OS_MACOS)
-  #include <libusb.h>
-#elif defined(Q_OS_UNIX)
-  #include <libusb-1.0/libusb.h>
-#else
-  #include <libusb/libusb.h>
-#endif
+#include <QHash>
+#include <QMutex>
+#include <QPromise>
+#include <QWaitCondition>
 
 QT_BEGIN_NAMESPACE
 
-class QUsbEventsThread : public QThread
+class QUsbTransferPrivate;
+class QUsbDevicePrivate;
+
+class QUsbControlBatch
 {
 public:
-    void run() override;
-
-    libusb_context *m_ctx;
+    QList<QUsbDevice::ControlRequest> m_requests;
+    QList<QUsbDevice::ControlResult> m_results;
+    int m_depth = 1;
+    int m_next = 0; // Next request to submit
+    int m_inflight = 0;
+    int m_failed = -1;
+    QPromise<QUsbDevice::ControlBatchResult> m_promise;
 };
 
-class QUsbTransferPrivate;
+class QUsbControlTransfer
+{
+public:
+    QUsbControlTransfer(QUsbDevicePrivate *dev);
+    ~QUsbControlTransfer();
 
-typedef struct {
-    QUsbDevicePrivate *priv;
-    QUsbDevice *pub;
-} qusbdevice_classes_t;
+    QUsbDevicePrivate *m_dev;
+    libusb_transfer *m_transfer;
+    QByteArray m_buf; // Setup packet followed by the data stage
+    QPromise<QUsbDevice::ControlResult> m_promise; // Single requests only
+    QUsbControlBatch *m_batch;
+    int m_index; // Position in m_batch
+};
 
-class QUsbDevicePrivate : public QObjectPrivate
+class Q_USB_EXPORT QUsbDevicePrivate : public QObjectPrivate
 {
     Q_DECLARE_PUBLIC(QUsbDevice)
     friend QUsbTransferPrivate;
 
 public:
     QUsbDevicePrivate();
-    void registerDisconnectCallback(int vid, int pid);
-    void deregisterDisconnectCallback();
     ~QUsbDevicePrivate();
 
-    libusb_device **m_devs;
+    void setTransport(QUsbTransport *transport);
+
+    char *allocBuffer(qint64 size, libusb_device_handle **handle);
+    void freeBuffer(char *buffer, qint64 size, libusb_device_handle *handle);
+
+    void parseDescriptors();
+
+    static QUsbDevice::DeviceStatus transferStatus(libusb_transfer_status status);
+    void reserveControlTransfers();
+    QUsbControlTransfer *takeControlTransfer();
+    bool prepareControlTransfer(QUsbControlTransfer *t, const QUsbDevice::ControlRequest &request);
+    int submitControlTransfer(QUsbControlTransfer *t);
+    void completeControlTransfer(QUsbControlTransfer *t);
+    bool fillControlBatch(QUsbControlBatch *b);
+    void finishControlBatch(QUsbControlBatch *b);
+    void cancelControlTransfers();
+    bool waitForControlTransfers();
+
+    QUsbTransport *m_transport; // Owned, libusb unless replaced while closed
     libusb_device_handle *m_devHandle;
-    libusb_context *m_ctx;
-    libusb_hotplug_callback_handle m_callbackHandle;
-    qusbdevice_classes_t m_classes;
+    QList<quint8> m_portPath; // Set by the user, matched on open if not empty
+    QList<quint8> m_devicePath; // Of the device opened, until it is closed
+
+    bool m_devMem;
+
+    // Parsed once in open(), read only until close()
+    QUsbDevice::DeviceDescriptor m_deviceDescriptor;
+    QUsbDevice::ConfigDescriptor m_configDescriptor;
+
+    QHash<libusb_device_handle *, int> m_devMemBuffers; // Mapped buffers still in use, per handle
+    QList<libusb_device_handle *> m_closingHandles; // Closed, waiting for their buffers to be freed
+    QMutex m_devMemMutex;
 
-    bool m_hasHotplug;
+    static const int ControlPoolSize = 16;
+    static const int ControlBufferSize = 256;
+    static const int ControlWaitMargin = 1000; // Past the device timeout, in close()
+    QList<QUsbControlTransfer *> m_controlFree;
+    QList<QUsbControlTransfer *> m_controlPending; // Submitted, waiting for their callback
+    QMutex m_controlMutex;
+    QWaitCondition m_controlCond; // m_controlPending shrank, goes with m_controlMutex
 
-    QUsbEventsThread *m_events;
+    QUsbCapture m_capture;
 };
 
 QT_END_NAMESPACE
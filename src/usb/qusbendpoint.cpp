@@ -1,7 +1,11 @@
 #include "qusbendpoint_p.h"
 #include "qusbdevice_p.h"
 
-#include <QElapsedTimer>
+#include <QDeadlineTimer>
+#include <limits>
+
+// Time a transfer is given to complete past its own timeout
+static const int PendingTransferMargin = 1000;
 
 #define DbgPrintError() qWarning("In %s, at %s:%d", Q_FUNC_INFO, __FILE__, __LINE__)
 #define DbgPrintFuncName()                     \
@@ -15,19 +19,12 @@
     qDebug() << "***[" << Q_FUNC_INFO << "]***"
 
 /* Write callback */
-static void LIBUSB_CALL cb_out(struct libusb_transfer *transfer)
+void LIBUSB_CALL QUsbEndpointPrivate::cb_out(struct libusb_transfer *transfer)
 {
-    QUsbEndpointPrivate *endpoint = reinterpret_cast<QUsbEndpointPrivate *>(transfer->user_data);
+    QUsbEndpointTransfer *t = reinterpret_cast<QUsbEndpointTransfer *>(transfer->user_data);
+    QUsbEndpointPrivate *endpoint = t->m_endpoint;
     DbgPrintCB(endpoint);
 
-    libusb_transfer_status s = transfer->status;
-    int sent = transfer->actual_length;
-    const int total = transfer->length;
-    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
-        sent += LIBUSB_CONTROL_SETUP_SIZE;
-    }
-    endpoint->setStatus(static_cast<QUsbEndpoint::Status>(s));
-
     if (endpoint->logLevel() >= QUsb::logDebug)
         qDebug("OUT: status = %d, timeout = %d, endpoint = %x, actual_length = %d, length = %d",
                transfer->status,
@@ -36,40 +33,44 @@ static void LIBUSB_CALL cb_out(struct libusb_transfer *transfer)
                transfer->actual_length,
                transfer->length);
 
-    if (sent > 0) {
-        endpoint->m_buf = endpoint->m_buf.mid(0, total - sent); // Remove what was sent
-    }
-
-    // Send remaining data
-    if (total > sent) {
-        transfer->buffer = reinterpret_cast<uchar *>(endpoint->m_buf.data()); // New data pointer
-        transfer->length = endpoint->m_buf.size(); // New size
-        libusb_submit_transfer(transfer);
-        return;
+    const int sent = transfer->actual_length;
+
+    endpoint->m_capture->complete(transfer);
+
+    // Send remaining data. A short control transfer is complete as it is, resubmitting
+    // it would send payload as a setup packet, and isochronous packets are never retried.
+    const bool resumable = transfer->type == LIBUSB_TRANSFER_TYPE_BULK
+            || transfer->type == LIBUSB_TRANSFER_TYPE_INTERRUPT
+            || transfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED && resumable && sent > 0 && transfer->length > sent) {
+        transfer->buffer += sent;
+        transfer->length -= sent;
+        endpoint->m_capture->submit(transfer);
+        const int rc = endpoint->transport()->submit(transfer);
+        if (rc == LIBUSB_SUCCESS)
+            return;
+        endpoint->m_capture->submitFailed(transfer, rc);
+        transfer->status = LIBUSB_TRANSFER_ERROR;
     }
 
-    libusb_free_transfer(transfer);
-    endpoint->m_transfer = Q_NULLPTR;
+    endpoint->m_stats.record(false, QUsbEndpointPrivate::transferredBytes(t),
+                             static_cast<QUsbEndpoint::Status>(transfer->status), t->m_submitted);
 
-    endpoint->m_buf_mutex.unlock();
+    endpoint->m_transfer_mutex.lock();
+    t->m_completed = true;
+    endpoint->m_transfer_mutex.unlock();
 
-    if (s != LIBUSB_TRANSFER_COMPLETED) {
-        endpoint->error(static_cast<QUsbEndpoint::Status>(s));
-    }
-    if (sent > 0) {
-        endpoint->bytesWritten(sent);
-    }
+    // Several transfers may be in flight, account for them in submission order.
+    endpoint->completeWriteTransfers();
 }
 
 /* Read callback */
-static void LIBUSB_CALL cb_in(struct libusb_transfer *transfer)
+void LIBUSB_CALL QUsbEndpointPrivate::cb_in(struct libusb_transfer *transfer)
 {
-    QUsbEndpointPrivate *endpoint = reinterpret_cast<QUsbEndpointPrivate *>(transfer->user_data);
+    QUsbEndpointTransfer *t = reinterpret_cast<QUsbEndpointTransfer *>(transfer->user_data);
+    QUsbEndpointPrivate *endpoint = t->m_endpoint;
     DbgPrintCB(endpoint);
 
-    libusb_transfer_status s = transfer->status;
-    const int received = transfer->actual_length;
-
     if (endpoint->logLevel() >= QUsb::logDebug)
         qDebug("IN: status = %d, timeout = %d, endpoint = %x, actual_length = %d, length = %d",
                transfer->status,
@@ -78,35 +79,106 @@ static void LIBUSB_CALL cb_in(struct libusb_transfer *transfer)
                transfer->actual_length,
                transfer->length);
 
-    endpoint->setStatus(static_cast<QUsbEndpoint::Status>(s));
-    if (s != LIBUSB_TRANSFER_COMPLETED) {
-        endpoint->error(static_cast<QUsbEndpoint::Status>(s));
-    } else {
-        endpoint->m_buf_mutex.lock();
-        const int previous_size = endpoint->m_buf.size();
-        endpoint->m_buf.resize(previous_size + received);
-        memcpy(endpoint->m_buf.data() + previous_size, transfer->buffer, static_cast<ulong>(received));
-        endpoint->m_buf_mutex.unlock();
-    }
-
-    libusb_free_transfer(transfer);
-    endpoint->m_transfer = Q_NULLPTR;
+    endpoint->m_capture->complete(transfer);
+    endpoint->m_stats.record(true, QUsbEndpointPrivate::transferredBytes(t),
+                             static_cast<QUsbEndpoint::Status>(transfer->status), t->m_submitted);
 
-    endpoint->m_transfer_buf.clear(); // it's in fact transfer->buffer
+    endpoint->m_transfer_mutex.lock();
+    t->m_completed = true;
     endpoint->m_transfer_mutex.unlock();
 
-    if (received)
-        endpoint->readyRead();
+    // Several transfers may be in flight, hand them over in submission order.
+    endpoint->completeReadTransfers();
+}
 
-    // Start transfer over if polling is enabled
-    if (endpoint->m_poll) {
-        endpoint->readUsb(endpoint->m_poll_size);
+QUsbEndpointTransfer::QUsbEndpointTransfer(QUsbEndpointPrivate *endpoint)
+    : m_endpoint(endpoint), m_transfer(Q_NULLPTR), m_data(Q_NULLPTR), m_size(0), m_capacity(0),
+      m_dev_mem(Q_NULLPTR), m_submitted(0), m_iso_capacity(0), m_refs(0), m_completed(false)
+{
+}
+
+QUsbEndpointTransfer::~QUsbEndpointTransfer()
+{
+    if (m_transfer != Q_NULLPTR)
+        libusb_free_transfer(m_transfer);
+    m_endpoint->freeBuffer(this);
+}
+
+QUsbEndpointStats::QUsbEndpointStats()
+{
+    m_clock.start();
+}
+
+void QUsbEndpointStats::record(bool in, qint64 bytes, QUsbEndpoint::Status status, qint64 submitted)
+{
+    // Log-linear buckets: the power of two, then the next two bits
+    const quint64 us = static_cast<quint64>(qMax(Q_INT64_C(0), now() - submitted)) / 1000;
+    int bucket = 0;
+    if (us > 0) {
+        const int log = 63 - static_cast<int>(qCountLeadingZeroBits(us));
+        bucket = qMin(LatencyBuckets - 1, log * 4 + static_cast<int>(((us << 2) >> log) & 3));
     }
+
+    if (in) {
+        m_bytes_in.fetchAndAddRelaxed(static_cast<quint64>(bytes));
+        m_transfers_in.fetchAndAddRelaxed(1);
+    } else {
+        m_bytes_out.fetchAndAddRelaxed(static_cast<quint64>(bytes));
+        m_transfers_out.fetchAndAddRelaxed(1);
+    }
+    if (status <= QUsbEndpoint::transferOverflow)
+        m_status[status].fetchAndAddRelaxed(1);
+    m_latency[bucket].fetchAndAddRelaxed(1);
+    m_in_flight.fetchAndSubRelaxed(1);
+}
+
+void QUsbEndpointStats::reset()
+{
+    // Transfers in flight are still in flight
+    m_bytes_in.storeRelaxed(0);
+    m_bytes_out.storeRelaxed(0);
+    m_transfers_in.storeRelaxed(0);
+    m_transfers_out.storeRelaxed(0);
+    m_dropped.storeRelaxed(0);
+    for (QAtomicInteger<quint64> &c : m_status)
+        c.storeRelaxed(0);
+    for (QAtomicInteger<quint64> &c : m_latency)
+        c.storeRelaxed(0);
+}
+
+QUsbEndpoint::Stats QUsbEndpointStats::snapshot() const
+{
+    QUsbEndpoint::Stats stats;
+    stats.bytesRead = m_bytes_in.loadRelaxed();
+    stats.bytesWritten = m_bytes_out.loadRelaxed();
+    stats.transfersIn = m_transfers_in.loadRelaxed();
+    stats.transfersOut = m_transfers_out.loadRelaxed();
+    stats.bytesDropped = m_dropped.loadRelaxed();
+    stats.inFlight = m_in_flight.loadRelaxed();
+    stats.statusCount.reserve(QUsbEndpoint::transferOverflow + 1);
+    for (const QAtomicInteger<quint64> &c : m_status)
+        stats.statusCount.append(c.loadRelaxed());
+    stats.latency.reserve(LatencyBuckets);
+    for (const QAtomicInteger<quint64> &c : m_latency)
+        stats.latency.append(c.loadRelaxed());
+    return stats;
+}
+
+static void releaseReadTransfer(void *tag, void *context)
+{
+    QUsbEndpointPrivate *endpoint = reinterpret_cast<QUsbEndpointPrivate *>(context);
+    endpoint->releaseReadTransfer(reinterpret_cast<QUsbEndpointTransfer *>(tag));
 }
 
 QUsbEndpointPrivate::QUsbEndpointPrivate()
-    : m_poll(false), m_poll_size(1024), m_transfer(Q_NULLPTR)
+    : m_poll(false), m_poll_size(1024), m_queue_depth(1),
+      m_read_buffer_size(QUsbEndpoint::DefaultReadBufferSize), m_read_reserved(0), m_bytes_to_write(0),
+      m_write_completions(0), m_write_chunk_size(QUsbEndpoint::DefaultWriteChunkSize), m_max_packet_size(64),
+      m_allocations(0), m_iso_packets(QUsbEndpoint::DefaultIsoPacketsPerTransfer), m_iso_packet_size(0),
+      m_iso_offset(0), m_stream_id(1), m_max_burst(0), m_mult(0), m_read_transfer_size(0),
+      m_capture(Q_NULLPTR)
 {
+    m_buf.setReleaseFunction(::releaseReadTransfer, this);
 }
 
 void QUsbEndpointPrivate::readyRead()
@@ -175,8 +247,14 @@ bool QUsbEndpointPrivate::prepareTransfer(libusb_transfer **tr, libusb_transfer_
     auto handle = q->m_dev->d_func()->m_devHandle;
     auto timeout = q->m_dev->timeout();
 
+    // Pooled transfers keep their libusb_transfer, only the fields below change.
+    if (*tr == Q_NULLPTR) {
+        if (this->logLevel() >= QUsb::logWarning)
+            qWarning("QUsbEndpoint: Transfer buffer allocation failed");
+        return false;
+    }
+
     if (q->m_type == QUsbEndpoint::bulkEndpoint) {
-        *tr = libusb_alloc_transfer(0);
         libusb_fill_bulk_transfer(*tr,
                                   handle,
                                   ep,
@@ -185,8 +263,17 @@ bool QUsbEndpointPrivate::prepareTransfer(libusb_transfer **tr, libusb_transfer_
                                   cb,
                                   this,
                                   timeout);
+    } else if (q->m_type == QUsbEndpoint::streamEndpoint) {
+        libusb_fill_bulk_stream_transfer(*tr,
+                                         handle,
+                                         ep,
+                                         m_stream_id,
+                                         buf,
+                                         maxSize,
+                                         cb,
+                                         this,
+                                         timeout);
     } else if (q->m_type == QUsbEndpoint::interruptEndpoint) {
-        *tr = libusb_alloc_transfer(0);
         libusb_fill_interrupt_transfer(*tr,
                                        handle,
                                        ep,
@@ -196,44 +283,193 @@ bool QUsbEndpointPrivate::prepareTransfer(libusb_transfer **tr, libusb_transfer_
                                        this,
                                        timeout);
     } else if (q->m_type == QUsbEndpoint::controlEndpoint) {
-        *tr = libusb_alloc_transfer(0);
         libusb_fill_control_transfer(*tr,
                                      handle,
                                      buf,
                                      cb,
                                      this,
                                      timeout);
-    } else if (q->m_type == QUsbEndpoint::isochronousEndpoint) { // Todo: Proper handling
-        *tr = libusb_alloc_transfer(1);
+    } else if (q->m_type == QUsbEndpoint::isochronousEndpoint) {
+        // One packet per service interval, the last one may be short on OUT
+        const int packet_size = qMax(1, m_iso_packet_size);
+        const int packets = (maxSize + packet_size - 1) / packet_size;
+        if (packets > m_iso_packets) {
+            if (this->logLevel() >= QUsb::logWarning)
+                qWarning("QUsbEndpoint: Too many iso packets for transfer");
+            return false;
+        }
         libusb_fill_iso_transfer(*tr,
                                  handle,
                                  ep,
                                  buf,
                                  maxSize,
-                                 1,
+                                 packets,
                                  cb,
                                  this,
                                  timeout);
+        for (int i = 0; i < packets; i++)
+            (*tr)->iso_packet_desc[i].length = static_cast<unsigned int>(qMin(packet_size, maxSize - i * packet_size));
     } else {
         return false;
     }
 
-    if (tr == Q_NULLPTR) {
+    return true;
+}
+
+void QUsbEndpointPrivate::stopTransfer(QIODevice::OpenMode mode)
+{
+    DbgPrivPrintFuncName();
+    QList<QUsbEndpointTransfer *> dropped;
+
+    // HINT: cancelling is async, callback function is called, dont close device first on deconstruction...
+    m_transfer_mutex.lock();
+    if (mode & QIODevice::ReadOnly) {
+        for (QUsbEndpointTransfer *t : std::as_const(m_read_queue)) {
+            if (!t->m_completed)
+                transport()->cancel(t->m_transfer);
+        }
+    }
+    if (mode & QIODevice::WriteOnly) {
+        for (QUsbEndpointTransfer *t : std::as_const(m_write_queue)) {
+            if (!t->m_completed)
+                transport()->cancel(t->m_transfer);
+        }
+        // Writes that never made it to the bus are simply dropped
+        for (QUsbEndpointTransfer *t : std::as_const(m_write_pending))
+            m_bytes_to_write -= t->m_size;
+        dropped.swap(m_write_pending);
+        m_transfer_cond.wakeAll();
+    }
+    m_transfer_mutex.unlock();
+
+    QMutexLocker locker(&m_buf_mutex);
+    m_free_transfers.append(dropped);
+}
+
+bool QUsbEndpointPrivate::hasPendingTransfers()
+{
+    QMutexLocker locker(&m_transfer_mutex);
+    return !m_read_queue.isEmpty() || !m_write_queue.isEmpty() || !m_write_pending.isEmpty();
+}
+
+bool QUsbEndpointPrivate::waitForPendingTransfers()
+{
+    DbgPrivPrintFuncName();
+    QMutexLocker locker(&m_transfer_mutex);
+
+    // From a callback, the others only complete once it returns
+    if ((!m_read_queue.isEmpty() || !m_write_queue.isEmpty() || !m_write_pending.isEmpty())
+        && transport()->isEventThread()) {
+        if (this->logLevel() >= QUsb::logWarning)
+            qWarning("QUsbEndpoint: Can't wait for pending transfers from a transfer callback");
+        return false;
+    }
+
+    // Completions wake us up, canceled transfers complete too
+    while (!m_read_queue.isEmpty() || !m_write_queue.isEmpty() || !m_write_pending.isEmpty()) {
+        // Each transfer ends within its timeout, 0 means it never times out
+        qint64 timeout = 0;
+        for (const QList<QUsbEndpointTransfer *> *queue : { &m_read_queue, &m_write_queue }) {
+            for (QUsbEndpointTransfer *t : *queue) {
+                if (t->m_transfer->timeout == 0)
+                    timeout = -1;
+                else if (timeout >= 0)
+                    timeout = qMax(timeout, static_cast<qint64>(t->m_transfer->timeout));
+            }
+        }
+        const QDeadlineTimer deadline(timeout < 0 ? -1 : timeout + PendingTransferMargin);
+
+        // Nothing completed for that long, libusb events are probably not being handled.
+        if (!transport()->wait(&m_transfer_cond, &m_transfer_mutex, deadline)) {
+            if (m_read_queue.isEmpty() && m_write_queue.isEmpty() && m_write_pending.isEmpty())
+                break;
+            if (this->logLevel() >= QUsb::logWarning)
+                qWarning("QUsbEndpoint: Timed out waiting for pending transfers");
+            return false;
+        }
+    }
+    return true;
+}
+
+QUsbEndpointTransfer *QUsbEndpointPrivate::allocTransfer()
+{
+    Q_Q(QUsbEndpoint);
+
+    QUsbEndpointTransfer *t = new QUsbEndpointTransfer(this);
+    t->m_iso_capacity = q->m_type == QUsbEndpoint::isochronousEndpoint ? m_iso_packets : 0;
+    t->m_transfer = libusb_alloc_transfer(t->m_iso_capacity);
+    ++m_allocations;
+    return t;
+}
+
+QUsbEndpointTransfer *QUsbEndpointPrivate::takeFreeTransfer(qint64 size)
+{
+    // m_buf_mutex must be held
+    QUsbEndpointTransfer *t = m_free_transfers.isEmpty() ? allocTransfer() : m_free_transfers.takeLast();
+
+    // Packet descriptors live inside the libusb transfer, more packets need a new one.
+    if (t->m_iso_capacity < m_iso_packets && t->m_iso_capacity > 0) {
+        libusb_free_transfer(t->m_transfer);
+        t->m_iso_capacity = m_iso_packets;
+        t->m_transfer = libusb_alloc_transfer(t->m_iso_capacity);
+        ++m_allocations;
+    }
+
+    // Smaller transfers keep their buffer, recycled buffers only grow once.
+    if (size > t->m_capacity && !reserveBuffer(t, size)) {
+        m_free_transfers.append(t);
+        return Q_NULLPTR;
+    }
+    t->m_size = size;
+    t->m_refs = 1;
+    return t;
+}
+
+bool QUsbEndpointPrivate::reserveBuffer(QUsbEndpointTransfer *t, qint64 size)
+{
+    Q_Q(QUsbEndpoint);
+
+    // Contents are overwritten by the next transfer, nothing to copy over.
+    freeBuffer(t);
+    QUsbDevicePrivate *dev = const_cast<QUsbDevicePrivate *>(q->m_dev->d_func());
+    t->m_data = dev->allocBuffer(size, &t->m_dev_mem);
+    if (!t->m_data) {
         if (this->logLevel() >= QUsb::logWarning)
             qWarning("QUsbEndpoint: Transfer buffer allocation failed");
         return false;
     }
-
+    t->m_capacity = size;
+    ++m_allocations;
     return true;
 }
 
-void QUsbEndpointPrivate::stopTransfer()
+void QUsbEndpointPrivate::freeBuffer(QUsbEndpointTransfer *t)
+{
+    Q_Q(QUsbEndpoint);
+
+    if (t->m_dev_mem) {
+        QUsbDevicePrivate *dev = const_cast<QUsbDevicePrivate *>(q->m_dev->d_func());
+        dev->freeBuffer(t->m_data, t->m_capacity, t->m_dev_mem);
+    } else if (t->m_data) {
+        qFreeAligned(t->m_data);
+    }
+    t->m_data = Q_NULLPTR;
+    t->m_dev_mem = Q_NULLPTR;
+    t->m_capacity = 0;
+    t->m_size = 0;
+}
+
+void QUsbEndpointPrivate::reserveTransfers(int count, qint64 size)
 {
     DbgPrivPrintFuncName();
-    // TODO: check if struct it not already freed
-    // HINT: libusb_cancel_transfer is async, callback function is called, dont close device first on deconstruction...
-    if (m_transfer != Q_NULLPTR)
-        libusb_cancel_transfer(m_transfer);
+    QMutexLocker locker(&m_buf_mutex);
+
+    while (m_free_transfers.size() < count)
+        m_free_transfers.append(allocTransfer());
+    for (QUsbEndpointTransfer *t : std::as_const(m_free_transfers)) {
+        if (t->m_capacity < size)
+            reserveBuffer(t, size);
+    }
 }
 
 int QUsbEndpointPrivate::readUsb(qint64 maxSize)
@@ -249,54 +485,427 @@ int QUsbEndpointPrivate::readUsb(qint64 maxSize)
     if (maxSize == 0)
         return 0;
 
-    m_transfer_mutex.lock();
-    m_transfer_buf.resize(static_cast<int>(maxSize));
-    if (!prepareTransfer(&m_transfer, cb_in, m_transfer_buf.data(), maxSize, q->m_ep))
+    // Only read what the buffer can take, polling resumes once data is consumed.
+    m_buf_mutex.lock();
+    if (m_read_reserved + maxSize > readBufferLimit()) {
+        m_buf_mutex.unlock();
+        if (this->logLevel() >= QUsb::logDebug)
+            qDebug("QUsbEndpoint: Read buffer full, deferring transfer");
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    QUsbEndpointTransfer *t = takeFreeTransfer(maxSize);
+    if (!t) {
+        m_buf_mutex.unlock();
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    m_read_reserved += maxSize;
+    m_buf_mutex.unlock();
+
+    if (!prepareTransfer(&t->m_transfer, cb_in, t->m_data, maxSize, q->m_ep)) {
+        QMutexLocker locker(&m_buf_mutex);
+        releaseReadTransfer(t);
         return -1;
-    rc = libusb_submit_transfer(m_transfer);
+    }
+    t->m_transfer->user_data = t; // cb_in needs to know which transfer completed
+    t->m_completed = false;
 
-    if (rc != LIBUSB_SUCCESS) {
-        setStatus(QUsbEndpoint::transferError);
-        error(QUsbEndpoint::transferError);
-        // TODO: Check if QUsbEndpoint::QUsbDevice must be const...
-        QUsbDevice *dev = const_cast<QUsbDevice *>(q->m_dev);
-        dev->handleUsbError(rc);
-        libusb_free_transfer(m_transfer);
-        m_transfer = Q_NULLPTR;
+    // Queue the transfer while holding the lock, so its callback can't overtake us.
+    m_transfer_mutex.lock();
+    t->m_submitted = m_stats.now();
+    m_stats.m_in_flight.fetchAndAddRelaxed(1);
+    m_capture->submit(t->m_transfer);
+    rc = transport()->submit(t->m_transfer);
+    if (rc == LIBUSB_SUCCESS) {
+        m_read_queue.append(t);
         m_transfer_mutex.unlock();
         return rc;
     }
+    m_capture->submitFailed(t->m_transfer, rc);
+    m_stats.m_in_flight.fetchAndSubRelaxed(1);
+    m_transfer_mutex.unlock();
+
+    m_buf_mutex.lock();
+    releaseReadTransfer(t);
+    m_buf_mutex.unlock();
+
+    setStatus(QUsbEndpoint::transferError);
+    error(QUsbEndpoint::transferError);
+    // TODO: Check if QUsbEndpoint::QUsbDevice must be const...
+    QUsbDevice *dev = const_cast<QUsbDevice *>(q->m_dev);
+    dev->handleUsbError(rc);
 
     return rc;
 }
 
+int QUsbEndpointPrivate::fillReadQueue()
+{
+    DbgPrivPrintFuncName();
+    int rc = 0;
+
+    if (m_poll_size <= 0)
+        return -1;
+
+    forever {
+        m_transfer_mutex.lock();
+        const bool full = m_read_queue.size() >= m_queue_depth;
+        m_transfer_mutex.unlock();
+        if (full)
+            break;
+
+        rc = readUsb(m_poll_size);
+        if (rc != LIBUSB_SUCCESS)
+            break;
+    }
+    return rc;
+}
+
+void QUsbEndpointPrivate::completeReadTransfers()
+{
+    DbgPrivPrintFuncName();
+    QList<QUsbEndpointTransfer *> completed;
+    qint64 received = 0;
+
+    // Only take transfers from the head of the queue, a completed transfer
+    // has to wait for all the ones submitted before it.
+    m_transfer_mutex.lock();
+    while (!m_read_queue.isEmpty() && m_read_queue.first()->m_completed)
+        completed.append(m_read_queue.takeFirst());
+    m_transfer_cond.wakeAll();
+    m_transfer_mutex.unlock();
+
+    for (QUsbEndpointTransfer *t : std::as_const(completed)) {
+        libusb_transfer_status s = t->m_transfer->status;
+        const int length = t->m_transfer->actual_length;
+
+        // The transfer buffer itself is queued, it is recycled once the data has been consumed.
+        m_buf_mutex.lock();
+        if (t->m_transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+            const qint64 before = m_buf.size();
+            if (s == LIBUSB_TRANSFER_COMPLETED)
+                queueIsoPackets(t);
+            received += m_buf.size() - before;
+        } else if (s == LIBUSB_TRANSFER_COMPLETED && length > 0) {
+            if (m_buf.append(reinterpret_cast<const char *>(t->m_transfer->buffer), length, t)) {
+                received += length;
+                t->m_refs++;
+            } else {
+                // No segment left, resizeReadBuffer() should have made room for every transfer
+                dropReadData(length);
+                s = LIBUSB_TRANSFER_OVERFLOW;
+            }
+        }
+        releaseReadTransfer(t); // Drop the in flight reference
+        m_read_cond.wakeAll();
+        m_buf_mutex.unlock();
+
+        setStatus(static_cast<QUsbEndpoint::Status>(s));
+        if (s != LIBUSB_TRANSFER_COMPLETED)
+            error(static_cast<QUsbEndpoint::Status>(s));
+    }
+
+    if (received)
+        readyRead();
+
+    // Start transfers over if polling is enabled
+    if (m_poll)
+        fillReadQueue();
+}
+
 int QUsbEndpointPrivate::writeUsb(const char *data, qint64 maxSize)
 {
     Q_Q(QUsbEndpoint);
     DbgPrivPrintFuncName();
-    int rc;
+
+    if (maxSize == 0)
+        return 0;
+
+    // Control packets carry their setup header, they can't be split.
+    qint64 chunk = maxSize;
+    if (q->m_type == QUsbEndpoint::bulkEndpoint || q->m_type == QUsbEndpoint::interruptEndpoint
+        || q->m_type == QUsbEndpoint::streamEndpoint)
+        chunk = writeChunkLimit();
+    else if (q->m_type == QUsbEndpoint::isochronousEndpoint)
+        chunk = static_cast<qint64>(qMax(1, m_iso_packet_size)) * m_iso_packets;
+    QList<QUsbEndpointTransfer *> chunks;
+
+    for (qint64 offset = 0; offset < maxSize; offset += chunk) {
+        const qint64 size = qMin(chunk, maxSize - offset);
+
+        m_buf_mutex.lock();
+        QUsbEndpointTransfer *t = takeFreeTransfer(size);
+        if (!t) {
+            m_free_transfers.append(chunks);
+            m_buf_mutex.unlock();
+            return -1;
+        }
+        m_buf_mutex.unlock();
+
+        memcpy(t->m_data, data + offset, static_cast<ulong>(size));
+
+        if (!prepareTransfer(&t->m_transfer, cb_out, t->m_data, size, q->m_ep)) {
+            QMutexLocker locker(&m_buf_mutex);
+            m_free_transfers.append(t);
+            m_free_transfers.append(chunks);
+            return -1;
+        }
+        t->m_transfer->user_data = t; // cb_out needs to know which transfer completed
+        chunks.append(t);
+    }
+
+    // Queue all chunks at once so they stay contiguous
+    m_transfer_mutex.lock();
+    m_write_pending.append(chunks);
+    m_bytes_to_write += maxSize;
+    m_transfer_mutex.unlock();
+
+    return submitWrites();
+}
+
+int QUsbEndpointPrivate::submitWrites()
+{
+    Q_Q(QUsbEndpoint);
+    DbgPrivPrintFuncName();
+    QList<QUsbEndpointTransfer *> dropped;
+    int rc = LIBUSB_SUCCESS;
+
+    m_transfer_mutex.lock();
+    while (!m_write_pending.isEmpty() && m_write_queue.size() < m_queue_depth) {
+        QUsbEndpointTransfer *t = m_write_pending.first();
+        t->m_completed = false;
+        t->m_submitted = m_stats.now();
+        m_stats.m_in_flight.fetchAndAddRelaxed(1);
+        m_capture->submit(t->m_transfer);
+        rc = transport()->submit(t->m_transfer);
+        if (rc != LIBUSB_SUCCESS) {
+            m_capture->submitFailed(t->m_transfer, rc);
+            m_stats.m_in_flight.fetchAndSubRelaxed(1);
+            // The stream is broken, drop everything that was queued after this point.
+            for (QUsbEndpointTransfer *p : std::as_const(m_write_pending))
+                m_bytes_to_write -= p->m_size;
+            dropped.swap(m_write_pending);
+            m_transfer_cond.wakeAll();
+            break;
+        }
+        m_write_queue.append(m_write_pending.takeFirst());
+    }
+    m_transfer_mutex.unlock();
+
+    if (rc == LIBUSB_SUCCESS)
+        return rc;
 
     m_buf_mutex.lock();
-    m_buf.resize(static_cast<int>(maxSize));
-    memcpy(m_buf.data(), data, static_cast<ulong>(maxSize));
+    m_free_transfers.append(dropped);
+    m_buf_mutex.unlock();
 
-    if (!prepareTransfer(&m_transfer, cb_out, m_buf.data(), maxSize, q->m_ep))
-        return -1;
-    rc = libusb_submit_transfer(m_transfer);
+    setStatus(QUsbEndpoint::transferError);
+    error(QUsbEndpoint::transferError);
+    // TODO: Check if QUsbEndpoint::QUsbDevice must be const...
+    QUsbDevice *dev = const_cast<QUsbDevice *>(q->m_dev);
+    dev->handleUsbError(rc);
 
-    if (rc != LIBUSB_SUCCESS) {
-        setStatus(QUsbEndpoint::transferError);
-        error(QUsbEndpoint::transferError);
-        // TODO: Check if QUsbEndpoint::QUsbDevice must be const...
-        QUsbDevice *dev = const_cast<QUsbDevice *>(q->m_dev);
-        dev->handleUsbError(rc);
-        libusb_free_transfer(m_transfer);
-        m_transfer = Q_NULLPTR;
+    return rc;
+}
+
+void QUsbEndpointPrivate::completeWriteTransfers()
+{
+    DbgPrivPrintFuncName();
+    QList<QUsbEndpointTransfer *> completed;
+
+    // Only take transfers from the head of the queue, bytes are reported in stream order.
+    m_transfer_mutex.lock();
+    while (!m_write_queue.isEmpty() && m_write_queue.first()->m_completed) {
+        QUsbEndpointTransfer *t = m_write_queue.takeFirst();
+        m_bytes_to_write -= t->m_size;
+        m_write_completions++;
+        completed.append(t);
+    }
+    m_transfer_cond.wakeAll();
+    m_transfer_mutex.unlock();
+
+    for (QUsbEndpointTransfer *t : std::as_const(completed)) {
+        const libusb_transfer_status s = t->m_transfer->status;
+
+        const qint64 sent = transferredBytes(t);
+
+        setStatus(static_cast<QUsbEndpoint::Status>(s));
+        if (s != LIBUSB_TRANSFER_COMPLETED)
+            error(static_cast<QUsbEndpoint::Status>(s));
+        if (sent > 0)
+            bytesWritten(sent);
+
+        m_buf_mutex.lock();
+        m_free_transfers.append(t);
         m_buf_mutex.unlock();
-        return rc;
     }
 
-    return rc;
+    submitWrites();
+}
+
+bool QUsbEndpointPrivate::readEndpointDescriptor()
+{
+    Q_Q(QUsbEndpoint);
+    DbgPrivPrintFuncName();
+
+    // Parsed by the device when it was opened, no descriptor requests here
+    const QUsbDevice::EndpointDescriptor desc = q->m_dev->findEndpoint(q->m_ep);
+    if (desc.address == 0 || desc.maxPacketSize == 0)
+        return false;
+
+    m_max_packet_size = desc.maxPacketSize;
+    m_max_burst = desc.maxBurst;
+    m_mult = desc.mult;
+    return true;
+}
+
+void QUsbEndpointPrivate::updateTransferSizes()
+{
+    Q_Q(QUsbEndpoint);
+
+    // Everything the endpoint can move in one service interval (or burst)
+    const int packet = qMax(1, m_max_packet_size);
+    const qint64 interval = static_cast<qint64>(packet) * (m_max_burst + 1) * (m_mult + 1);
+
+    switch (q->m_type) {
+    case QUsbEndpoint::isochronousEndpoint:
+        m_iso_packet_size = static_cast<int>(interval);
+        m_poll_size = m_iso_packet_size * m_iso_packets;
+        return;
+    case QUsbEndpoint::interruptEndpoint:
+        m_poll_size = static_cast<int>(interval);
+        break;
+    default:
+        m_poll_size = static_cast<int>(qMax(interval, QUsbEndpoint::DefaultReadTransferSize / interval * interval));
+    }
+
+    // IN transfers must be whole packets, or the last one may overflow
+    if (m_read_transfer_size > 0)
+        m_poll_size = static_cast<int>((m_read_transfer_size + packet - 1) / packet * packet);
+}
+
+qint64 QUsbEndpointPrivate::transferredBytes(QUsbEndpointTransfer *t)
+{
+    libusb_transfer *tr = t->m_transfer;
+
+    // Each isochronous packet reports its own length, the transfer total is not meaningful
+    if (tr->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        qint64 bytes = 0;
+        for (int i = 0; i < tr->num_iso_packets; i++)
+            bytes += tr->iso_packet_desc[i].actual_length;
+        return bytes;
+    }
+
+    // A control transfer is never resubmitted, its short count includes the setup packet
+    if (tr->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+        return tr->actual_length > 0 ? tr->actual_length + LIBUSB_CONTROL_SETUP_SIZE : 0;
+
+    // Earlier partial completions moved the buffer pointer forward
+    const qint64 offset = tr->buffer - reinterpret_cast<uchar *>(t->m_data);
+    return offset + tr->actual_length;
+}
+
+qint64 QUsbEndpointPrivate::writeChunkLimit() const
+{
+    // Whole packets only, so a chunk never ends the transfer with a short packet.
+    const qint64 packet = qMax(1, m_max_packet_size);
+    return qMax(packet, m_write_chunk_size / packet * packet);
+}
+
+qint64 QUsbEndpointPrivate::readBufferLimit() const
+{
+    // Never go below what a full queue needs
+    return qMax(m_read_buffer_size, static_cast<qint64>(m_poll_size) * m_queue_depth);
+}
+
+void QUsbEndpointPrivate::resizeReadBuffer()
+{
+    DbgPrivPrintFuncName();
+    Q_Q(QUsbEndpoint);
+    const bool iso = q->m_type == QUsbEndpoint::isochronousEndpoint;
+
+    // Both locks, so no transfer moves from the queue to the buffer while counting.
+    QMutexLocker transfers(&m_transfer_mutex);
+    QMutexLocker locker(&m_buf_mutex);
+
+    // Transfers held may have been submitted with an older size, they keep their own slots.
+    int held = m_buf.segmentCount();
+    for (QUsbEndpointTransfer *t : std::as_const(m_read_queue))
+        held += iso ? t->m_transfer->num_iso_packets : 1;
+
+    // Enough slots for every transfer the limit allows on top of those, iso transfers take one per packet.
+    const int segments = iso ? m_iso_packets : 1;
+    const int admitted = static_cast<int>(readBufferLimit() / qMax(1, m_poll_size)) + 1;
+    m_buf.setCapacity(admitted * segments + held);
+}
+
+void QUsbEndpointPrivate::dropReadData(qint64 size)
+{
+    // m_buf_mutex must be held
+    m_stats.m_dropped.fetchAndAddRelaxed(static_cast<quint64>(size));
+    if (this->logLevel() >= QUsb::logWarning)
+        qWarning("QUsbEndpoint: Read buffer overflow, %lld bytes dropped", size);
+}
+
+void QUsbEndpointPrivate::releaseReadTransfer(QUsbEndpointTransfer *t)
+{
+    // Iso transfers are queued as one segment per packet
+    if (--t->m_refs > 0)
+        return;
+    m_read_reserved -= t->m_size;
+    m_free_transfers.append(t);
+}
+
+void QUsbEndpointPrivate::queueIsoPackets(QUsbEndpointTransfer *t)
+{
+    // m_buf_mutex must be held
+    libusb_transfer *tr = t->m_transfer;
+
+    for (int i = 0; i < tr->num_iso_packets; i++) {
+        const libusb_iso_packet_descriptor &desc = tr->iso_packet_desc[i];
+        QUsbIsoPacketInfo packet = { 0, static_cast<QUsbEndpoint::Status>(desc.status) };
+
+        // Failed and empty packets are kept as gaps so packet readers see them
+        if (desc.status == LIBUSB_TRANSFER_COMPLETED && desc.actual_length > 0) {
+            const char *data = reinterpret_cast<const char *>(libusb_get_iso_packet_buffer_simple(tr, static_cast<unsigned int>(i)));
+            if (m_buf.append(data, desc.actual_length, t)) {
+                packet.size = desc.actual_length;
+                t->m_refs++;
+            } else {
+                dropReadData(desc.actual_length);
+                packet.status = QUsbEndpoint::transferOverflow;
+            }
+        }
+        m_iso_queue.append(packet);
+    }
+
+    // Gaps take no buffer space, don't let them pile up if nobody reads packets.
+    while (m_iso_queue.size() > m_buf.capacity() && m_iso_queue.first().size == 0)
+        m_iso_queue.removeFirst();
+}
+
+void QUsbEndpointPrivate::skipIsoPackets(qint64 size)
+{
+    // m_buf_mutex must be held, stream reads go through packets as bytes are consumed.
+    while (size > 0 && !m_iso_queue.isEmpty()) {
+        const qint64 left = m_iso_queue.first().size - m_iso_offset;
+        if (left > size) {
+            m_iso_offset += size;
+            return;
+        }
+        size -= left;
+        m_iso_offset = 0;
+        m_iso_queue.removeFirst();
+    }
+}
+
+void QUsbEndpointPrivate::clearReadBuffer()
+{
+    DbgPrivPrintFuncName();
+    QMutexLocker locker(&m_buf_mutex);
+    m_buf.clear();
+    m_iso_queue.clear();
+    m_iso_offset = 0;
+    qDeleteAll(m_free_transfers);
+    m_free_transfers.clear();
 }
 
 void QUsbEndpointPrivate::setPolling(bool enable)
@@ -308,8 +917,8 @@ void QUsbEndpointPrivate::setPolling(bool enable)
     if (enable) {
         // Start polling loop on IN if requirements are met
         if (q->openMode() & QIODevice::ReadOnly) {
-            // Read once, loop will continue on its own as long as polling is enabled.
-            this->readUsb(m_poll_size);
+            // Fill the queue once, loop will continue on its own as long as polling is enabled.
+            this->fillReadQueue();
         }
     }
 }
@@ -320,6 +929,12 @@ QUsb::LogLevel QUsbEndpointPrivate::logLevel()
     return q->m_dev->logLevel();
 }
 
+QUsbTransport *QUsbEndpointPrivate::transport() const
+{
+    Q_Q(const QUsbEndpoint);
+    return q->m_dev->d_func()->m_transport;
+}
+
 /*!
     \class QUsbEndpoint
 
@@ -415,6 +1030,36 @@ QUsb::LogLevel QUsbEndpointPrivate::logLevel()
     \brief polling status.
  */
 
+/*!
+    \property QUsbEndpoint::queueDepth
+    \brief number of transfers kept in flight.
+ */
+
+/*!
+    \property QUsbEndpoint::isoPacketsPerTransfer
+    \brief number of packets in each isochronous transfer.
+ */
+
+/*!
+    \property QUsbEndpoint::streamId
+    \brief bulk stream used by a streamEndpoint.
+ */
+
+/*!
+    \property QUsbEndpoint::readBufferSize
+    \brief capacity of the internal read buffer.
+ */
+
+/*!
+    \property QUsbEndpoint::readTransferSize
+    \brief size of IN transfers.
+ */
+
+/*!
+    \property QUsbEndpoint::writeChunkSize
+    \brief maximum size of a single OUT transfer.
+ */
+
 /*!
     \brief QUsbEndpoint constructor.
 
@@ -431,17 +1076,25 @@ QUsbEndpoint::QUsbEndpoint(QUsbDevice *dev, QUsbEndpoint::Type type, quint8 ep)
     Q_D(QUsbEndpoint);
     DbgPrintFuncName();
 
+    d->m_capture = &dev->d_func()->m_capture;
     setParent(dev);
 }
 
 /*!
     \brief Will cancel all transfers on exit.
+
+    Waits for the canceled transfers to complete, their callbacks still use the endpoint.
+    Closing the device already did, so a device deleting its endpoints doesn't wait for them.
  */
 QUsbEndpoint::~QUsbEndpoint()
 {
     Q_D(QUsbEndpoint);
     DbgPrintFuncName();
     cancelTransfer();
+    d->waitForPendingTransfers();
+
+    // Device memory goes back through m_dev, the pool can't outlive the endpoint
+    d->clearReadBuffer();
 }
 
 /*!
@@ -467,22 +1120,27 @@ bool QUsbEndpoint::open(QIODevice::OpenMode mode)
 
     bool b = QIODevice::open(mode);
 
-    // Reset possible unclean mutex states.
-    d->m_buf_mutex.tryLock();
-    d->m_buf_mutex.unlock();
-    d->m_buf_mutex.tryLock();
-    d->m_buf_mutex.unlock();
-    d->m_transfer_mutex.tryLock();
-    d->m_transfer_mutex.unlock();
-
-    // Set polling size to max packet size
-    switch (m_type) {
-    case bulkEndpoint:
-        if (m_dev->speed() >= QUsbDevice::highSpeed)
-            d->m_poll_size = 512;
-        break;
-    default:
-        d->m_poll_size = 64;
+    // Size transfers from the endpoint descriptor, guess when the device isn't open yet.
+    if (!d->readEndpointDescriptor()) {
+        d->m_max_burst = 0;
+        d->m_mult = 0;
+        if (m_type == streamEndpoint) // Streams are SuperSpeed only
+            d->m_max_packet_size = 1024;
+        else if (m_type == bulkEndpoint && m_dev->speed() >= QUsbDevice::highSpeed)
+            d->m_max_packet_size = 512;
+        else
+            d->m_max_packet_size = 64;
+    }
+    d->updateTransferSizes();
+
+    // Fill the transfer pool up front, nothing is allocated while streaming
+    if (openMode() == ReadOnly) {
+        d->resizeReadBuffer();
+        d->reserveTransfers(d->m_queue_depth, d->m_poll_size);
+    } else if (m_type == bulkEndpoint || m_type == interruptEndpoint || m_type == streamEndpoint) {
+        d->reserveTransfers(d->m_queue_depth, d->writeChunkLimit());
+    } else if (m_type == isochronousEndpoint) {
+        d->reserveTransfers(d->m_queue_depth, d->m_poll_size);
     }
 
     if ((openMode() == ReadOnly && m_type == interruptEndpoint) || d->m_poll) {
@@ -494,18 +1152,25 @@ bool QUsbEndpoint::open(QIODevice::OpenMode mode)
 /*!
     \brief Close the transfer.
 
-    This will cancel any ongoing transfers.
+    This will cancel any ongoing IN transfers, queued writes are sent first.
  */
 void QUsbEndpoint::close()
 {
     Q_D(QUsbEndpoint);
     DbgPrintFuncName();
     setPolling(false);
+    d->stopTransfer(ReadOnly);
     QIODevice::close();
 
+    // Release threads blocked in waitForReadyRead()
+    d->m_buf_mutex.lock();
+    d->m_read_cond.wakeAll();
+    d->m_buf_mutex.unlock();
+
     // Wait for (canceled) transfers to finish
-    while (d_func()->m_transfer != Q_NULLPTR)
-        QThread::msleep(10);
+    d->waitForPendingTransfers();
+
+    d->clearReadBuffer();
 }
 
 /*!
@@ -545,7 +1210,9 @@ QUsbEndpoint::Status QUsbEndpoint::status() const
  */
 qint64 QUsbEndpoint::bytesAvailable() const
 {
-    return d_func()->m_buf.size() + QIODevice::bytesAvailable();
+    Q_D(const QUsbEndpoint);
+    QMutexLocker locker(&d->m_buf_mutex);
+    return d->m_buf.size() + QIODevice::bytesAvailable();
 }
 
 /*!
@@ -553,45 +1220,143 @@ qint64 QUsbEndpoint::bytesAvailable() const
  */
 qint64 QUsbEndpoint::bytesToWrite() const
 {
-    return d_func()->m_buf.size() + QIODevice::bytesToWrite();
+    Q_D(const QUsbEndpoint);
+    QMutexLocker locker(&d->m_transfer_mutex);
+    return d->m_bytes_to_write + QIODevice::bytesToWrite();
 }
 
 /*!
-    \brief Wait for at least one byte to be written for \a msecs milliseconds.
+    \brief Wait for an OUT transfer to complete for \a msecs milliseconds.
 
-    Returns \c true if any data was written before timeout.
+    The calling thread sleeps until the next OUT transfer completes, \c -1 waits forever.
+    Call it in a loop, or check bytesToWrite(), to wait for all queued data.
+    Returns \c true if a transfer completed before timeout, or if no data was left to write.
  */
 bool QUsbEndpoint::waitForBytesWritten(int msecs)
 {
     Q_D(QUsbEndpoint);
     DbgPrintFuncName();
-    QElapsedTimer timer;
-    timer.start();
-
-    do {
-        if (!this->bytesToWrite())
-            return true;
-    } while (timer.elapsed() < msecs);
-    return false;
+    QDeadlineTimer deadline(msecs);
+
+    // Write completions wake us up, no need to poll
+    QMutexLocker locker(&d->m_transfer_mutex);
+    const quint64 completions = d->m_write_completions;
+    while (d->m_bytes_to_write > 0 && d->m_write_completions == completions) {
+        if (!d->transport()->wait(&d->m_transfer_cond, &d->m_transfer_mutex, deadline))
+            return d->m_write_completions != completions || d->m_bytes_to_write == 0;
+    }
+    return true;
 }
 
 /*!
     \brief Wait for at least one byte to be available for \a msecs milliseconds.
 
+    The calling thread sleeps until an IN transfer completes, \c -1 waits forever.
     Returns \c true if any data was read before timeout.
  */
 bool QUsbEndpoint::waitForReadyRead(int msecs)
 {
     Q_D(QUsbEndpoint);
     DbgPrintFuncName();
-    QElapsedTimer timer;
-    timer.start();
+    QDeadlineTimer deadline(msecs);
+
+    if (QIODevice::bytesAvailable())
+        return true;
+
+    // Read completions wake us up, no need to poll
+    QMutexLocker locker(&d->m_buf_mutex);
+    while (d->m_buf.isEmpty()) {
+        if (!isOpen())
+            return false;
+        if (!d->transport()->wait(&d->m_read_cond, &d->m_buf_mutex, deadline))
+            return !d->m_buf.isEmpty();
+    }
+    return true;
+}
+
+/*!
+    \brief Transfer \a size bytes to or from \a data, blocking the calling thread for up to \a timeout milliseconds.
+
+    The direction follows the endpoint address. Data goes straight between the bus and \a data,
+    bypassing the read buffer, the transfer queue and signals. It is meant for worker threads
+    running request/response protocols, don't mix it with polling or write() on the same endpoint.
+    Only bulk and interrupt endpoints are supported. A \a timeout of \c -1 uses the device timeout,
+    \c 0 waits forever.
+
+    Returns the number of bytes transferred, or \c -1 on error. status() is updated either way.
+ */
+qint64 QUsbEndpoint::transferSync(char *data, qint64 size, int timeout)
+{
+    Q_D(QUsbEndpoint);
+    DbgPrintFuncName();
+    Q_CHECK_PTR(data);
+
+    if (!d->isValid())
+        return -1;
+
+    if (m_type != bulkEndpoint && m_type != interruptEndpoint) {
+        if (d->logLevel() >= QUsb::logWarning)
+            qWarning("QUsbEndpoint: Synchronous transfers need a bulk or interrupt endpoint");
+        return -1;
+    }
+
+    auto handle = m_dev->d_func()->m_devHandle;
+    auto buf = reinterpret_cast<uchar *>(data);
+    auto length = static_cast<int>(size);
+    auto t = static_cast<unsigned int>(timeout < 0 ? m_dev->timeout() : timeout);
+    int transferred = 0;
+    int rc;
+
+    // There is no transfer to report, the buffer identifies the request instead.
+    const quint64 id = reinterpret_cast<quintptr>(data);
+    const quint8 xferType = QUsbCapture::xferType(m_type == bulkEndpoint ? LIBUSB_TRANSFER_TYPE_BULK : LIBUSB_TRANSFER_TYPE_INTERRUPT);
+    const bool in = m_ep & LIBUSB_ENDPOINT_IN;
+    if (d->m_capture->isActive())
+        d->m_capture->record(QUsbCapture::Submit, id, xferType, m_ep, QUsbCapture::InProgress, static_cast<quint32>(length),
+                             in ? Q_NULLPTR : data, in ? 0 : static_cast<quint32>(length));
+
+    const qint64 submitted = d->m_stats.now();
+    d->m_stats.m_in_flight.fetchAndAddRelaxed(1);
+    rc = d->transport()->syncTransfer(handle, m_type == bulkEndpoint ? LIBUSB_TRANSFER_TYPE_BULK : LIBUSB_TRANSFER_TYPE_INTERRUPT,
+                                      m_ep, buf, length, &transferred, t);
+
+    Status s;
+    switch (rc) {
+    case LIBUSB_SUCCESS:
+        s = transferCompleted;
+        break;
+    case LIBUSB_ERROR_TIMEOUT:
+        s = transferTimeout;
+        break;
+    case LIBUSB_ERROR_PIPE:
+        s = transferStall;
+        break;
+    case LIBUSB_ERROR_NO_DEVICE:
+        s = transferNoDevice;
+        break;
+    case LIBUSB_ERROR_OVERFLOW:
+        s = transferOverflow;
+        break;
+    default:
+        s = transferError;
+    }
+    d->setStatus(s);
+    d->m_stats.record(in, transferred, s, submitted);
+    if (d->m_capture->isActive())
+        d->m_capture->record(QUsbCapture::Complete, id, xferType, m_ep, QUsbCapture::errorErrno(rc),
+                             static_cast<quint32>(transferred), in ? data : Q_NULLPTR,
+                             in ? static_cast<quint32>(transferred) : 0);
+
+    if (rc != LIBUSB_SUCCESS) {
+        d->error(s);
+        QUsbDevice *dev = const_cast<QUsbDevice *>(m_dev);
+        dev->handleUsbError(rc);
+        // A timeout may still have moved part of the data
+        if (transferred <= 0)
+            return -1;
+    }
 
-    do {
-        if (this->bytesAvailable())
-            return true;
-    } while (timer.elapsed() < msecs);
-    return false;
+    return transferred;
 }
 
 /*!
@@ -627,6 +1392,343 @@ bool QUsbEndpoint::polling()
     return d->polling();
 }
 
+/*!
+    \brief Set the number of transfers kept in flight to \a depth.
+
+    Keeping several transfers submitted prevents the bus from idling between completions.
+    This applies to IN transfers while polling, and to queued writes.
+    Data is always handed over in submission order.
+    Default is 1.
+ */
+void QUsbEndpoint::setQueueDepth(int depth)
+{
+    Q_D(QUsbEndpoint);
+    DbgPrintFuncName();
+
+    d->m_transfer_mutex.lock();
+    d->m_queue_depth = qMax(1, depth);
+    d->m_transfer_mutex.unlock();
+
+    if (openMode() & ReadOnly) {
+        d->resizeReadBuffer();
+        if (d->m_poll)
+            d->fillReadQueue();
+    } else if (openMode() & WriteOnly) {
+        d->submitWrites();
+    }
+}
+
+/*!
+    \brief Returns the number of transfers kept in flight.
+ */
+int QUsbEndpoint::queueDepth() const
+{
+    return d_func()->m_queue_depth;
+}
+
+/*!
+    \brief Set the size of IN transfers to \a size bytes, \c 0 picks it from the endpoint descriptor.
+
+    The size is rounded up to a multiple of wMaxPacketSize, transfers of several megabytes are fine.
+    By default, interrupt endpoints read one service interval, that is wMaxPacketSize times the
+    transactions per microframe, or the burst size on SuperSpeed. Bulk endpoints read
+    \c DefaultReadTransferSize bytes rounded to a whole burst. Isochronous transfers are sized with
+    setIsoPacketsPerTransfer() instead.
+    It can change while polling, transfers already submitted keep their size.
+ */
+void QUsbEndpoint::setReadTransferSize(qint64 size)
+{
+    Q_D(QUsbEndpoint);
+    DbgPrintFuncName();
+
+    if (size > std::numeric_limits<int>::max()) {
+        if (d->logLevel() >= QUsb::logWarning)
+            qWarning("QUsbEndpoint: Read transfer size too large. Ignoring.");
+        return;
+    }
+
+    d->m_transfer_mutex.lock();
+    d->m_read_transfer_size = qMax(Q_INT64_C(0), size);
+    d->updateTransferSizes();
+    d->m_transfer_mutex.unlock();
+
+    if (openMode() & ReadOnly)
+        d->resizeReadBuffer();
+}
+
+/*!
+    \brief Returns the size of IN transfers.
+
+    This is only final once the endpoint is open and its descriptor is known.
+ */
+qint64 QUsbEndpoint::readTransferSize() const
+{
+    return d_func()->m_poll_size;
+}
+
+/*!
+    \brief Set the maximum size of a single OUT transfer to \a size bytes.
+
+    Larger writes are split into several transfers, up to queueDepth() of them are in flight at once.
+    The size is rounded down to a multiple of the endpoint's wMaxPacketSize.
+    Only applies to bulk and interrupt endpoints.
+    Default is \c DefaultWriteChunkSize.
+ */
+void QUsbEndpoint::setWriteChunkSize(qint64 size)
+{
+    Q_D(QUsbEndpoint);
+    DbgPrintFuncName();
+    d->m_write_chunk_size = qMax(Q_INT64_C(1), size);
+}
+
+/*!
+    \brief Returns the maximum size of a single OUT transfer.
+ */
+qint64 QUsbEndpoint::writeChunkSize() const
+{
+    return d_func()->m_write_chunk_size;
+}
+
+/*!
+    \brief Set the number of packets in each isochronous transfer to \a packets.
+
+    Each packet covers one service interval. Larger transfers mean fewer callbacks,
+    at the cost of latency. Takes effect the next time the endpoint is opened.
+    Default is \c DefaultIsoPacketsPerTransfer.
+ */
+void QUsbEndpoint::setIsoPacketsPerTransfer(int packets)
+{
+    Q_D(QUsbEndpoint);
+    DbgPrintFuncName();
+
+    if (isOpen()) {
+        if (d->logLevel() >= QUsb::logWarning)
+            qWarning("QUsbEndpoint: Iso packets can't be changed while open. Ignoring.");
+        return;
+    }
+    d->m_iso_packets = qMax(1, packets);
+}
+
+/*!
+    \brief Returns the number of packets in each isochronous transfer.
+ */
+int QUsbEndpoint::isoPacketsPerTransfer() const
+{
+    return d_func()->m_iso_packets;
+}
+
+/*!
+    \brief Returns the size of an isochronous packet in bytes.
+
+    This is wMaxPacketSize times the number of transactions per microframe (mult),
+    it is known once the endpoint has been opened.
+ */
+int QUsbEndpoint::isoPacketSize() const
+{
+    return d_func()->m_iso_packet_size;
+}
+
+/*!
+    \brief Returns the number of isochronous packets waiting to be read, gaps included.
+ */
+int QUsbEndpoint::packetsAvailable() const
+{
+    Q_D(const QUsbEndpoint);
+    QMutexLocker locker(&d->m_buf_mutex);
+    return d->m_iso_queue.size();
+}
+
+/*!
+    \brief Reads up to \a maxPackets isochronous packets, or all of them if \a maxPackets is negative.
+
+    Packets are returned in the order they were received. Packets that failed or
+    carried no data are kept, with their status and an empty payload, so gaps in
+    the stream can be detected. read() returns the same data with gaps removed.
+ */
+QList<QUsbEndpoint::IsoPacket> QUsbEndpoint::readPackets(int maxPackets)
+{
+    Q_D(QUsbEndpoint);
+    DbgPrintFuncName();
+    QList<IsoPacket> packets;
+
+    QMutexLocker locker(&d->m_buf_mutex);
+    while (!d->m_iso_queue.isEmpty() && (maxPackets < 0 || packets.size() < maxPackets)) {
+        const QUsbIsoPacketInfo info = d->m_iso_queue.takeFirst();
+        IsoPacket packet = { info.status, QByteArray() };
+
+        packet.data.resize(static_cast<int>(info.size - d->m_iso_offset));
+        d->m_buf.read(packet.data.data(), packet.data.size());
+        d->m_iso_offset = 0;
+        packets.append(packet);
+    }
+    locker.unlock();
+
+    // Polling may have been held back by a full buffer
+    if (d->m_poll)
+        d->fillReadQueue();
+
+    return packets;
+}
+
+/*!
+    \brief Set the bulk stream used by a streamEndpoint to \a id.
+
+    Streams must be allocated first with QUsbDevice::allocStreams(), they are numbered from 1.
+    Use one QUsbEndpoint per stream, each one keeps its own transfers in flight.
+    Takes effect for transfers submitted after this call.
+    Default is \c 1.
+ */
+void QUsbEndpoint::setStreamId(quint32 id)
+{
+    Q_D(QUsbEndpoint);
+    DbgPrintFuncName();
+    d->m_stream_id = id;
+}
+
+/*!
+    \brief Returns the bulk stream used by a streamEndpoint.
+ */
+quint32 QUsbEndpoint::streamId() const
+{
+    return d_func()->m_stream_id;
+}
+
+/*!
+    \brief Set the capacity of the internal read buffer to \a size bytes.
+
+    This bounds the memory held by received transfer buffers that have not been read yet,
+    it is never smaller than what queueDepth() transfers need. When it is full, polling
+    pauses until data is read, so nothing is dropped.
+    Default is \c DefaultReadBufferSize.
+ */
+void QUsbEndpoint::setReadBufferSize(qint64 size)
+{
+    Q_D(QUsbEndpoint);
+    DbgPrintFuncName();
+
+    d->m_read_buffer_size = size;
+    if (openMode() & ReadOnly) {
+        d->resizeReadBuffer();
+        if (d->m_poll)
+            d->fillReadQueue();
+    }
+}
+
+/*!
+    \brief Returns the requested capacity of the internal read buffer.
+ */
+qint64 QUsbEndpoint::readBufferSize() const
+{
+    return d_func()->m_read_buffer_size;
+}
+
+/*!
+    \brief Returns the number of transfer and buffer allocations made by this endpoint.
+
+    Transfers are pooled, open() allocates queueDepth() of them and they are recycled
+    on completion. This counter stays constant once the endpoint is streaming.
+ */
+qint64 QUsbEndpoint::transferAllocations() const
+{
+    Q_D(const QUsbEndpoint);
+    QMutexLocker locker(&d->m_buf_mutex);
+    return d->m_allocations;
+}
+
+/*!
+    \brief Returns a snapshot of the transfer statistics.
+
+    Counters are updated without locking from the completion callbacks, so this is cheap
+    enough to call from a monitoring timer. Counters may be a few transfers apart from each
+    other while transfers complete.
+ */
+QUsbEndpoint::Stats QUsbEndpoint::stats() const
+{
+    return d_func()->m_stats.snapshot();
+}
+
+/*!
+    \brief Clears the transfer statistics.
+ */
+void QUsbEndpoint::resetStats()
+{
+    Q_D(QUsbEndpoint);
+    d->m_stats.reset();
+}
+
+/*!
+    \brief Returns the upper limit in microseconds of latency histogram \a bucket.
+
+    Buckets split every power of two into four, so the error is below 25%.
+ */
+qint64 QUsbEndpoint::latencyBucketLimit(int bucket)
+{
+    bucket = qBound(0, bucket, QUsbEndpointStats::LatencyBuckets - 1);
+    const int log = bucket / 4;
+    return ((Q_INT64_C(5) + bucket % 4) << log) >> 2;
+}
+
+/*!
+    \brief Returns the latency in microseconds under which \a percentile percent of the transfers in \a stats completed.
+ */
+qint64 QUsbEndpoint::latencyPercentile(const Stats &stats, double percentile)
+{
+    quint64 total = 0;
+    for (quint64 c : stats.latency)
+        total += c;
+    if (total == 0)
+        return 0;
+
+    const double target = total * qBound(0.0, percentile, 100.0) / 100.0;
+    quint64 count = 0;
+    for (int i = 0; i < stats.latency.size(); i++) {
+        count += stats.latency.at(i);
+        if (count >= target && count > 0)
+            return latencyBucketLimit(i);
+    }
+    return latencyBucketLimit(static_cast<int>(stats.latency.size()) - 1);
+}
+
+/*!
+    \brief Returns read-only views on the received data, oldest first.
+
+    The views point straight into the completed transfer buffers, no data is copied.
+    They stay valid until the bytes they cover are released with consume() or read().
+    Data already moved into QIODevice's own buffer by read() is not included,
+    so the two APIs should not be mixed.
+ */
+QList<QByteArrayView> QUsbEndpoint::peekSpans() const
+{
+    Q_D(const QUsbEndpoint);
+    QMutexLocker locker(&d->m_buf_mutex);
+    return d->m_buf.spans();
+}
+
+/*!
+    \brief Releases the first \a size bytes returned by peekSpans().
+
+    Fully consumed transfer buffers are given back to the endpoint for new transfers.
+    Returns the number of bytes released.
+ */
+qint64 QUsbEndpoint::consume(qint64 size)
+{
+    if (this->openMode() != ReadOnly)
+        return -1;
+
+    Q_D(QUsbEndpoint);
+    DbgPrintFuncName();
+
+    QMutexLocker locker(&d->m_buf_mutex);
+    const qint64 consumed = d->m_buf.skip(size);
+    d->skipIsoPackets(consumed);
+    locker.unlock();
+
+    if (consumed && d->m_poll)
+        d->fillReadQueue();
+
+    return consumed;
+}
+
 /*!
     \brief Manual IN (read) polling.
 
@@ -661,7 +1763,7 @@ bool QUsbEndpoint::poll()
 }
 
 /*!
-
+    \brief Cancel all ongoing transfers, and drop queued writes.
  */
 void QUsbEndpoint::cancelTransfer()
 {
@@ -689,24 +1791,27 @@ qint64 QUsbEndpoint::readData(char *data, qint64 maxSize)
         return 0;
 
     QMutexLocker locker(&d->m_buf_mutex);
-    qint64 read_size = d->m_buf.size();
-    if (read_size == 0)
+    if (d->m_buf.isEmpty())
         return 0;
     if (!isOpen())
         return -1;
-    if (read_size > maxSize)
-        read_size = maxSize;
 
-    memcpy(data, d->m_buf.data(), static_cast<ulong>(read_size));
-    d->m_buf = d->m_buf.mid(static_cast<int>(read_size));
+    const qint64 read_size = d->m_buf.read(data, maxSize);
+    d->skipIsoPackets(read_size);
+    locker.unlock();
+
+    // Polling may have been held back by a full buffer
+    if (d->m_poll)
+        d->fillReadQueue();
 
     return read_size;
 }
 
 /*!
-    \brief Copies \a maxSize bytes from \a data to the internal write buffer and schedules an OUT transfer.
+    \brief Copies \a maxSize bytes from \a data to a new OUT transfer and queues it.
 
-    Returns \c bytes written to the buffer.
+    This never waits for the bus, up to queueDepth() transfers are sent at once.
+    Returns \c bytes written to the queue.
  */
 qint64 QUsbEndpoint::writeData(const char *data, qint64 maxSize)
 {
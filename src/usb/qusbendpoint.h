@@ -3,6 +3,7 @@
 
 #include "qusbdevice.h"
 #include "qusb.h"
+#include <QByteArrayView>
 #include <QIODevice>
 #include <QObject>
 
@@ -16,6 +17,11 @@ class Q_USB_EXPORT QUsbEndpoint : public QIODevice
     Q_DECLARE_PRIVATE(QUsbEndpoint)
 
 public:
+    static const qint64 DefaultReadBufferSize = 64 * 1024;
+    static const qint64 DefaultWriteChunkSize = 64 * 1024;
+    static const qint64 DefaultReadTransferSize = 16 * 1024;
+    static const int DefaultIsoPacketsPerTransfer = 8;
+
     enum Type : quint8 {
         controlEndpoint = 0,
         isochronousEndpoint,
@@ -36,6 +42,22 @@ public:
     };
     Q_ENUM(Status)
 
+    struct Stats {
+        quint64 bytesRead = 0;
+        quint64 bytesWritten = 0;
+        quint64 transfersIn = 0;
+        quint64 transfersOut = 0;
+        quint64 bytesDropped = 0; // Received while the read buffer was full
+        QList<quint64> statusCount; // Completed transfers, indexed by Status
+        int inFlight = 0; // Transfers submitted and not completed yet
+        QList<quint64> latency; // Submit to completion histogram, see latencyBucketLimit()
+    };
+
+    struct IsoPacket {
+        Status status;
+        QByteArray data;
+    };
+
     enum bmRequestType : quint8 {
         requestStandard = (0x00 << 5),
         requestClass = (0x01 << 5),
@@ -68,6 +90,12 @@ public:
     Q_PROPERTY(Type type READ type)
     Q_PROPERTY(quint8 endpoint READ endpoint)
     Q_PROPERTY(bool polling READ polling WRITE setPolling)
+    Q_PROPERTY(int queueDepth READ queueDepth WRITE setQueueDepth)
+    Q_PROPERTY(qint64 readBufferSize READ readBufferSize WRITE setReadBufferSize)
+    Q_PROPERTY(qint64 readTransferSize READ readTransferSize WRITE setReadTransferSize)
+    Q_PROPERTY(qint64 writeChunkSize READ writeChunkSize WRITE setWriteChunkSize)
+    Q_PROPERTY(int isoPacketsPerTransfer READ isoPacketsPerTransfer WRITE setIsoPacketsPerTransfer)
+    Q_PROPERTY(quint32 streamId READ streamId WRITE setStreamId)
 
     explicit QUsbEndpoint(QUsbDevice *dev, Type type, quint8 ep);
     ~QUsbEndpoint();
@@ -85,6 +113,8 @@ public:
     bool waitForBytesWritten(int msecs) override;
     bool waitForReadyRead(int msecs) override;
 
+    qint64 transferSync(char *data, qint64 size, int timeout = -1);
+
     void makeControlPacket(char *buffer,
                            QUsbEndpoint::bmRequestType bmRequestType,
                            QUsbEndpoint::bRequest bRequest, quint16 wValue,
@@ -94,6 +124,37 @@ public:
     bool polling();
     bool poll();
 
+    void setQueueDepth(int depth);
+    int queueDepth() const;
+
+    void setReadBufferSize(qint64 size);
+    qint64 readBufferSize() const;
+
+    void setReadTransferSize(qint64 size);
+    qint64 readTransferSize() const;
+
+    void setWriteChunkSize(qint64 size);
+    qint64 writeChunkSize() const;
+
+    void setIsoPacketsPerTransfer(int packets);
+    int isoPacketsPerTransfer() const;
+    int isoPacketSize() const;
+    int packetsAvailable() const;
+    QList<IsoPacket> readPackets(int maxPackets = -1);
+
+    void setStreamId(quint32 id);
+    quint32 streamId() const;
+
+    qint64 transferAllocations() const;
+
+    Stats stats() const;
+    void resetStats();
+    static qint64 latencyBucketLimit(int bucket);
+    static qint64 latencyPercentile(const Stats &stats, double percentile);
+
+    QList<QByteArrayView> peekSpans() const;
+    qint64 consume(qint64 size);
+
 public Q_SLOTS:
     void cancelTransfer();
 
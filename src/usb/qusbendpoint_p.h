@@ -13,7 +13,12 @@
 //
 
 #include "qusbendpoint.h"
+#include "qusbcapture_p.h"
+#include "qusbringbuffer_p.h"
+#include <QAtomicInteger>
+#include <QElapsedTimer>
 #include <QMutexLocker>
+#include <QWaitCondition>
 #include <private/qiodevice_p.h>
 
 #if defined(Q_OS_MACOS)
@@ -26,7 +31,54 @@
 
 QT_BEGIN_NAMESPACE
 
-class QUsbEndpointPrivate : public QIODevicePrivate
+class QUsbEndpointPrivate;
+class QUsbTransport;
+
+class QUsbEndpointTransfer
+{
+public:
+    QUsbEndpointTransfer(QUsbEndpointPrivate *endpoint);
+    ~QUsbEndpointTransfer();
+
+    QUsbEndpointPrivate *m_endpoint;
+    libusb_transfer *m_transfer;
+    char *m_data;
+    qint64 m_size;
+    qint64 m_capacity;
+    libusb_device_handle *m_dev_mem; // Handle m_data is mapped from, null for heap memory
+    qint64 m_submitted; // Submit time, in QUsbEndpointStats clock nanoseconds
+    int m_iso_capacity; // Iso packet descriptors allocated with m_transfer
+    int m_refs; // Ring buffer segments still pointing to m_data, plus one while in flight
+    bool m_completed;
+};
+
+class QUsbEndpointStats
+{
+public:
+    static const int LatencyBuckets = 128; // 4 per power of two microseconds
+
+    QUsbEndpointStats();
+    qint64 now() const { return m_clock.nsecsElapsed(); }
+    void record(bool in, qint64 bytes, QUsbEndpoint::Status status, qint64 submitted);
+    void reset();
+    QUsbEndpoint::Stats snapshot() const;
+
+    QElapsedTimer m_clock;
+    QAtomicInteger<quint64> m_bytes_in, m_bytes_out;
+    QAtomicInteger<quint64> m_transfers_in, m_transfers_out;
+    QAtomicInteger<quint64> m_dropped;
+    QAtomicInteger<quint64> m_status[QUsbEndpoint::transferOverflow + 1];
+    QAtomicInteger<quint64> m_latency[LatencyBuckets];
+    QAtomicInteger<int> m_in_flight;
+};
+
+struct QUsbIsoPacketInfo
+{
+    qint64 size;
+    QUsbEndpoint::Status status;
+};
+
+class Q_USB_EXPORT QUsbEndpointPrivate : public QIODevicePrivate
 {
     Q_DECLARE_PUBLIC(QUsbEndpoint)
 
@@ -41,22 +93,71 @@ public:
 
     bool prepareTransfer(libusb_transfer **tr, libusb_transfer_cb_fn cb,
                          char *data, qint64 size, quint8 ep);
-    void stopTransfer();
+    void stopTransfer(QIODevice::OpenMode mode = QIODevice::ReadWrite);
+    bool hasPendingTransfers();
+    bool waitForPendingTransfers();
+    QUsbEndpointTransfer *allocTransfer();
+    QUsbEndpointTransfer *takeFreeTransfer(qint64 size);
+    bool reserveBuffer(QUsbEndpointTransfer *t, qint64 size);
+    void freeBuffer(QUsbEndpointTransfer *t);
+    void reserveTransfers(int count, qint64 size);
 
     int readUsb(qint64 maxSize);
+    int fillReadQueue();
+    void completeReadTransfers();
+    qint64 readBufferLimit() const;
+    void resizeReadBuffer();
+    void dropReadData(qint64 size);
+    void releaseReadTransfer(QUsbEndpointTransfer *t);
+    void queueIsoPackets(QUsbEndpointTransfer *t);
+    void skipIsoPackets(qint64 size);
+    void clearReadBuffer();
     int writeUsb(const char *data, qint64 maxSize);
+    qint64 writeChunkLimit() const;
+    bool readEndpointDescriptor();
+    void updateTransferSizes();
+    int submitWrites();
+    void completeWriteTransfers();
 
     void setPolling(bool enable);
     bool polling() { return m_poll; }
 
     QUsb::LogLevel logLevel();
+    QUsbTransport *transport() const;
+
+    static qint64 transferredBytes(QUsbEndpointTransfer *t);
+    static void LIBUSB_CALL cb_in(struct libusb_transfer *transfer);
+    static void LIBUSB_CALL cb_out(struct libusb_transfer *transfer);
 
     bool m_poll;
     int m_poll_size;
+    int m_queue_depth;
 
-    libusb_transfer *m_transfer;
-    QByteArray m_buf, m_transfer_buf;
-    QMutex m_transfer_mutex, m_buf_mutex;
+    QList<QUsbEndpointTransfer *> m_read_queue; // IN transfers in flight, in submission order
+    QUsbRingBuffer m_buf; // Completed IN transfers, referenced until consumed
+    QList<QUsbEndpointTransfer *> m_free_transfers; // Consumed or sent transfers, ready for reuse
+    qint64 m_read_buffer_size;
+    qint64 m_read_reserved; // Buffer bytes held by IN transfers, in flight or unread
+    QList<QUsbEndpointTransfer *> m_write_queue; // OUT transfers in flight, in submission order
+    QList<QUsbEndpointTransfer *> m_write_pending; // OUT transfers waiting for a free slot
+    qint64 m_bytes_to_write;
+    quint64 m_write_completions; // OUT transfers taken off m_write_queue, guarded by m_transfer_mutex
+    qint64 m_write_chunk_size;
+    int m_max_packet_size;
+    qint64 m_allocations; // Transfers and buffers allocated, guarded by m_buf_mutex
+    int m_iso_packets;
+    int m_iso_packet_size;
+    QList<QUsbIsoPacketInfo> m_iso_queue; // Received iso packets, gaps included
+    qint64 m_iso_offset; // Bytes already read from the first packet in m_iso_queue
+    quint32 m_stream_id;
+    int m_max_burst; // Extra packets per burst, SuperSpeed only
+    int m_mult; // Extra transactions per service interval
+    qint64 m_read_transfer_size; // Requested by the user, 0 when automatic
+    QUsbEndpointStats m_stats; // Lock free, updated from the callbacks
+    QUsbCapture *m_capture; // Owned by the device
+    mutable QMutex m_transfer_mutex, m_buf_mutex;
+    QWaitCondition m_transfer_cond; // Transfers left a queue, goes with m_transfer_mutex
+    QWaitCondition m_read_cond; // Data was received, goes with m_buf_mutex
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,703 @@
+#include "qusbfaketransport_p.h"
+
+#include <QDeadlineTimer>
+#include <chrono>
+
+void QUsbFakeTransportThread::run()
+{
+    m_transport->run();
+}
+
+QUsbFakeTransport::QUsbFakeTransport()
+    : m_dispatcher(Q_NULLPTR), m_dispatchQueued(false), m_dispatching(false), m_speed(QUsbDevice::highSpeed),
+      m_latency(0), m_config(1), m_paused(false), m_open(false), m_unplugged(false), m_left(false), m_quit(false),
+      m_busy(false)
+{
+    m_id = QUsb::Id(0x0001, 0x0001, 1, 1);
+    m_deviceDescriptor.bcdUSB = 0x0200;
+    m_deviceDescriptor.maxPacketSize0 = 64;
+    m_deviceDescriptor.vid = m_id.vid;
+    m_deviceDescriptor.pid = m_id.pid;
+    m_deviceDescriptor.numConfigurations = 1;
+    m_configDescriptor.value = 1;
+
+    m_clock.start();
+    m_thread = new QUsbFakeTransportThread();
+    m_thread->m_transport = this;
+    m_thread->start();
+}
+
+QUsbFakeTransport::~QUsbFakeTransport()
+{
+    m_mutex.lock();
+    m_quit = true;
+    m_cond.wakeAll();
+    m_mutex.unlock();
+
+    m_thread->wait();
+    delete m_thread;
+    delete m_dispatcher;
+}
+
+/*!
+    \brief Set the \a id the device answers to, bus and port included.
+ */
+void QUsbFakeTransport::setId(const QUsb::Id &id)
+{
+    QMutexLocker locker(&m_mutex);
+    m_id = id;
+    m_deviceDescriptor.vid = id.vid;
+    m_deviceDescriptor.pid = id.pid;
+    m_deviceDescriptor.deviceClass = id.dClass;
+    m_deviceDescriptor.deviceSubClass = id.dSubClass;
+}
+
+/*!
+    \brief Set the port numbers leading to the device from its root hub, \a path.
+ */
+void QUsbFakeTransport::setPortPath(const QList<quint8> &path)
+{
+    QMutexLocker locker(&m_mutex);
+    m_portPath = path;
+}
+
+void QUsbFakeTransport::setSpeed(QUsbDevice::DeviceSpeed speed)
+{
+    QMutexLocker locker(&m_mutex);
+    m_speed = speed;
+}
+
+void QUsbFakeTransport::setDeviceDescriptor(const QUsbDevice::DeviceDescriptor &descriptor)
+{
+    QMutexLocker locker(&m_mutex);
+    m_deviceDescriptor = descriptor;
+    m_id.vid = descriptor.vid;
+    m_id.pid = descriptor.pid;
+    m_id.dClass = descriptor.deviceClass;
+    m_id.dSubClass = descriptor.deviceSubClass;
+}
+
+/*!
+    \brief Set the active configuration \a descriptor, endpoint sizes are taken from it on open.
+ */
+void QUsbFakeTransport::setConfigDescriptor(const QUsbDevice::ConfigDescriptor &descriptor)
+{
+    QMutexLocker locker(&m_mutex);
+    m_configDescriptor = descriptor;
+}
+
+/*!
+    \brief Set the \a handler answering control transfers.
+
+    It is called from the completion thread, with the transport locked, so it must not
+    call back into the transport. Without a handler, OUT requests succeed and IN requests
+    return wLength zero bytes.
+ */
+void QUsbFakeTransport::setControlHandler(const ControlHandler &handler)
+{
+    QMutexLocker locker(&m_mutex);
+    m_control = handler;
+}
+
+/*!
+    \brief Data written to the \a out endpoint becomes readable on the \a in endpoint.
+ */
+void QUsbFakeTransport::setLoopback(quint8 out, quint8 in)
+{
+    QMutexLocker locker(&m_mutex);
+    m_endpoints[out].m_loopback = in;
+}
+
+/*!
+    \brief Delay every completion by \a usecs after its submission.
+ */
+void QUsbFakeTransport::setLatency(qint64 usecs)
+{
+    QMutexLocker locker(&m_mutex);
+    m_latency = qMax(Q_INT64_C(0), usecs) * 1000;
+}
+
+/*!
+    \brief Hold completions back while \a paused, canceled transfers still complete.
+ */
+void QUsbFakeTransport::setPaused(bool paused)
+{
+    QMutexLocker locker(&m_mutex);
+    m_paused = paused;
+    m_cond.wakeAll();
+}
+
+/*!
+    \brief Run the callbacks from the event loop of \a thread, or from the completion thread if \c nullptr.
+
+    Like libusb with an event thread set, \a thread also runs them while it waits for
+    a transfer. Only while no transfer is pending.
+ */
+void QUsbFakeTransport::setDispatchThread(QThread *thread)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_ASSERT(m_pending.isEmpty() && m_completed.isEmpty());
+    delete m_dispatcher;
+    m_dispatcher = Q_NULLPTR;
+    m_dispatchQueued = false;
+    if (thread) {
+        m_dispatcher = new QObject();
+        m_dispatcher->moveToThread(thread);
+    }
+}
+
+/*!
+    \brief Queue \a data for the IN \a endpoint, as if the device had produced it.
+ */
+void QUsbFakeTransport::injectData(quint8 endpoint, const QByteArray &data)
+{
+    QMutexLocker locker(&m_mutex);
+    m_endpoints[endpoint].m_data.append(data);
+    m_cond.wakeAll();
+}
+
+/*!
+    \brief The next \a count transfers on \a endpoint complete with \a status and no data.
+
+    Use LIBUSB_TRANSFER_STALL for stalls, endpoint 0 covers control transfers.
+ */
+void QUsbFakeTransport::injectStatus(quint8 endpoint, libusb_transfer_status status, int count)
+{
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < count; i++)
+        m_endpoints[endpoint].m_status.append(status);
+    m_cond.wakeAll();
+}
+
+/*!
+    \brief Returns and clears what was written to the OUT \a endpoint.
+ */
+QByteArray QUsbFakeTransport::takeWritten(quint8 endpoint)
+{
+    QMutexLocker locker(&m_mutex);
+    QByteArray data;
+    data.swap(m_endpoints[endpoint].m_written);
+    return data;
+}
+
+int QUsbFakeTransport::pendingTransfers() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_pending.size() + m_completed.size();
+}
+
+/*!
+    \brief Wait up to \a msecs until nothing can complete anymore.
+
+    Transfers left pending are IN transfers waiting for data, or any transfer while paused.
+    Returns \c false on timeout.
+ */
+bool QUsbFakeTransport::waitForIdle(int msecs)
+{
+    QDeadlineTimer deadline(msecs);
+    QMutexLocker locker(&m_mutex);
+    forever {
+        const qint64 now = m_clock.nsecsElapsed();
+        bool busy = m_busy || !m_completed.isEmpty();
+        for (const Pending &p : std::as_const(m_pending))
+            busy = busy || p.m_cancelled || m_unplugged || (!m_paused && isReady(p, now + m_latency));
+        if (!busy)
+            return true;
+        if (!m_idle.wait(&m_mutex, deadline))
+            return false;
+    }
+}
+
+/*!
+    \brief Simulate a disconnection.
+
+    Pending transfers complete with LIBUSB_TRANSFER_NO_DEVICE and new ones are refused.
+    Like a hotplug event, the completion thread reports it, and the device closes from
+    the event loop of its thread.
+ */
+void QUsbFakeTransport::unplug()
+{
+    QMutexLocker locker(&m_mutex);
+    m_unplugged = true;
+    m_cond.wakeAll();
+}
+
+int QUsbFakeTransport::open(QUsb::Id *id, QList<quint8> *path, libusb_device_handle **handle)
+{
+    QMutexLocker locker(&m_mutex);
+    *handle = Q_NULLPTR;
+    if (m_unplugged)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    QUsb::Id tmp_id(*id);
+    if (tmp_id.pid == 0)
+        tmp_id.pid = m_id.pid;
+    if (tmp_id.vid == 0)
+        tmp_id.vid = m_id.vid;
+    if (tmp_id.bus == QUsb::busAny)
+        tmp_id.bus = m_id.bus;
+    if (tmp_id.port == QUsb::portAny)
+        tmp_id.port = m_id.port;
+    if (tmp_id.dClass == 0)
+        tmp_id.dClass = m_id.dClass;
+    if (tmp_id.dSubClass == 0)
+        tmp_id.dSubClass = m_id.dSubClass;
+    if (!(tmp_id == m_id) || (!path->isEmpty() && *path != m_portPath))
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    *id = tmp_id;
+    *path = m_portPath;
+    m_open = true;
+    // Never dereferenced, it only has to be unique and non null
+    *handle = reinterpret_cast<libusb_device_handle *>(this);
+    return LIBUSB_SUCCESS;
+}
+
+void QUsbFakeTransport::close(libusb_device_handle *handle)
+{
+    Q_UNUSED(handle);
+    QMutexLocker locker(&m_mutex);
+    // libusb warns about this too, the callbacks would use a closed handle
+    if (!m_pending.isEmpty() || !m_completed.isEmpty())
+        qWarning("QUsbFakeTransport: Device closed with %d transfers pending", int(m_pending.size() + m_completed.size()));
+    m_open = false;
+}
+
+void QUsbFakeTransport::stop()
+{
+}
+
+int QUsbFakeTransport::detachKernelDriver(libusb_device_handle *handle, int interface)
+{
+    Q_UNUSED(handle);
+    Q_UNUSED(interface);
+    return LIBUSB_SUCCESS;
+}
+
+int QUsbFakeTransport::configuration(libusb_device_handle *handle, int *config)
+{
+    Q_UNUSED(handle);
+    QMutexLocker locker(&m_mutex);
+    *config = m_config;
+    return LIBUSB_SUCCESS;
+}
+
+int QUsbFakeTransport::setConfiguration(libusb_device_handle *handle, int config)
+{
+    Q_UNUSED(handle);
+    QMutexLocker locker(&m_mutex);
+    m_config = config;
+    return LIBUSB_SUCCESS;
+}
+
+int QUsbFakeTransport::claimInterface(libusb_device_handle *handle, int interface)
+{
+    Q_UNUSED(handle);
+    Q_UNUSED(interface);
+    return m_unplugged ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_SUCCESS;
+}
+
+int QUsbFakeTransport::releaseInterface(libusb_device_handle *handle, int interface)
+{
+    Q_UNUSED(handle);
+    Q_UNUSED(interface);
+    return LIBUSB_SUCCESS;
+}
+
+QUsbDevice::DeviceSpeed QUsbFakeTransport::speed(libusb_device_handle *handle)
+{
+    Q_UNUSED(handle);
+    QMutexLocker locker(&m_mutex);
+    return m_speed;
+}
+
+void QUsbFakeTransport::address(libusb_device_handle *handle, quint8 *bus, quint8 *address)
+{
+    Q_UNUSED(handle);
+    QMutexLocker locker(&m_mutex);
+    *bus = m_id.bus;
+    *address = m_id.port;
+}
+
+void QUsbFakeTransport::descriptors(libusb_device_handle *handle, QUsbDevice::DeviceDescriptor *device,
+                                    QUsbDevice::ConfigDescriptor *config)
+{
+    Q_UNUSED(handle);
+    QMutexLocker locker(&m_mutex);
+    *device = m_deviceDescriptor;
+    *config = m_configDescriptor;
+}
+
+uchar *QUsbFakeTransport::allocDeviceMemory(libusb_device_handle *handle, qint64 size)
+{
+    // Like backends without mapped memory, callers fall back to the heap
+    Q_UNUSED(handle);
+    Q_UNUSED(size);
+    return Q_NULLPTR;
+}
+
+void QUsbFakeTransport::freeDeviceMemory(libusb_device_handle *handle, uchar *buffer, qint64 size)
+{
+    Q_UNUSED(handle);
+    Q_UNUSED(buffer);
+    Q_UNUSED(size);
+}
+
+int QUsbFakeTransport::allocStreams(libusb_device_handle *handle, quint32 count, uchar *endpoints, int size)
+{
+    Q_UNUSED(handle);
+    Q_UNUSED(endpoints);
+    Q_UNUSED(size);
+    return static_cast<int>(count);
+}
+
+int QUsbFakeTransport::freeStreams(libusb_device_handle *handle, uchar *endpoints, int size)
+{
+    Q_UNUSED(handle);
+    Q_UNUSED(endpoints);
+    Q_UNUSED(size);
+    return LIBUSB_SUCCESS;
+}
+
+int QUsbFakeTransport::submit(libusb_transfer *transfer)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_unplugged)
+        return LIBUSB_ERROR_NO_DEVICE;
+    for (const Pending &p : std::as_const(m_pending)) {
+        if (p.m_transfer == transfer)
+            return LIBUSB_ERROR_BUSY;
+    }
+
+    // Never completed from here, callers submit with their own locks held.
+    const qint64 now = m_clock.nsecsElapsed();
+    Pending p;
+    p.m_transfer = transfer;
+    p.m_ready = now + m_latency;
+    p.m_deadline = transfer->timeout ? p.m_ready + static_cast<qint64>(transfer->timeout) * 1000000 : 0;
+    p.m_cancelled = false;
+    m_pending.append(p);
+    m_cond.wakeAll();
+    return LIBUSB_SUCCESS;
+}
+
+int QUsbFakeTransport::cancel(libusb_transfer *transfer)
+{
+    QMutexLocker locker(&m_mutex);
+    for (Pending &p : m_pending) {
+        if (p.m_transfer == transfer && !p.m_cancelled) {
+            p.m_cancelled = true;
+            m_cond.wakeAll();
+            return LIBUSB_SUCCESS;
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+struct QUsbFakeSyncTransfer {
+    QMutex m_mutex;
+    QWaitCondition m_cond;
+    bool m_done = false;
+};
+
+static void LIBUSB_CALL cb_sync(struct libusb_transfer *transfer)
+{
+    QUsbFakeSyncTransfer *sync = reinterpret_cast<QUsbFakeSyncTransfer *>(transfer->user_data);
+    QMutexLocker locker(&sync->m_mutex);
+    sync->m_done = true;
+    sync->m_cond.wakeAll();
+}
+
+int QUsbFakeTransport::syncTransfer(libusb_device_handle *handle, quint8 type, quint8 endpoint, uchar *data,
+                                   int length, int *transferred, uint timeout)
+{
+    QUsbFakeSyncTransfer sync;
+    libusb_transfer *tr = libusb_alloc_transfer(0);
+    if (type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+        libusb_fill_interrupt_transfer(tr, handle, endpoint, data, length, cb_sync, &sync, timeout);
+    else
+        libusb_fill_bulk_transfer(tr, handle, endpoint, data, length, cb_sync, &sync, timeout);
+
+    int rc = submit(tr);
+    if (rc == LIBUSB_SUCCESS) {
+        QMutexLocker locker(&sync.m_mutex);
+        while (!sync.m_done)
+            wait(&sync.m_cond, &sync.m_mutex, QDeadlineTimer(QDeadlineTimer::Forever));
+    }
+
+    *transferred = rc == LIBUSB_SUCCESS ? tr->actual_length : 0;
+    if (rc == LIBUSB_SUCCESS) {
+        switch (tr->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            rc = LIBUSB_ERROR_TIMEOUT;
+            break;
+        case LIBUSB_TRANSFER_STALL:
+            rc = LIBUSB_ERROR_PIPE;
+            break;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            rc = LIBUSB_ERROR_NO_DEVICE;
+            break;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            rc = LIBUSB_ERROR_OVERFLOW;
+            break;
+        default:
+            rc = LIBUSB_ERROR_IO;
+        }
+    }
+    libusb_free_transfer(tr);
+    return rc;
+}
+
+bool QUsbFakeTransport::isDispatchThread() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_dispatcher && m_dispatcher->thread() == QThread::currentThread() && !m_dispatching;
+}
+
+bool QUsbFakeTransport::isEventThread() const
+{
+    QMutexLocker locker(&m_mutex);
+    if (QThread::currentThread() == m_thread)
+        return true;
+    return m_dispatcher && m_dispatcher->thread() == QThread::currentThread() && m_dispatching;
+}
+
+void QUsbFakeTransport::handleEvents(QDeadlineTimer deadline)
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_completed.isEmpty()) {
+        if (!m_completedCond.wait(&m_mutex, deadline))
+            return;
+    }
+
+    // In completion order, they may submit again
+    QList<libusb_transfer *> completed;
+    completed.swap(m_completed);
+    m_dispatching = true;
+    m_busy = true;
+    locker.unlock();
+    for (libusb_transfer *tr : std::as_const(completed))
+        tr->callback(tr);
+    locker.relock();
+    m_busy = false;
+    m_dispatching = false;
+    m_cond.wakeAll();
+}
+
+bool QUsbFakeTransport::isReady(const Pending &p, qint64 now)
+{
+    // m_mutex must be held
+    if (p.m_ready > now)
+        return false;
+
+    const libusb_transfer *tr = p.m_transfer;
+    const quint8 ep = tr->type == LIBUSB_TRANSFER_TYPE_CONTROL ? 0 : tr->endpoint;
+    const auto it = m_endpoints.constFind(ep);
+    if (it != m_endpoints.constEnd() && !it->m_status.isEmpty())
+        return true;
+
+    // IN transfers wait for data, or until they time out
+    if (tr->type != LIBUSB_TRANSFER_TYPE_CONTROL && (tr->endpoint & LIBUSB_ENDPOINT_IN))
+        return (it != m_endpoints.constEnd() && !it->m_data.isEmpty()) || (p.m_deadline && p.m_deadline <= now);
+    return true;
+}
+
+void QUsbFakeTransport::complete(const Pending &p, qint64 now)
+{
+    // m_mutex must be held, fills in the transfer the way libusb would
+    libusb_transfer *tr = p.m_transfer;
+    tr->actual_length = 0;
+
+    if (m_unplugged) {
+        tr->status = LIBUSB_TRANSFER_NO_DEVICE;
+        return;
+    }
+    if (p.m_cancelled) {
+        tr->status = LIBUSB_TRANSFER_CANCELLED;
+        return;
+    }
+
+    Endpoint &e = m_endpoints[tr->type == LIBUSB_TRANSFER_TYPE_CONTROL ? 0 : tr->endpoint];
+    if (!e.m_status.isEmpty()) {
+        tr->status = e.m_status.takeFirst();
+        return;
+    }
+
+    tr->status = LIBUSB_TRANSFER_COMPLETED;
+    if (tr->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        completeControl(tr);
+        return;
+    }
+
+    const bool in = tr->endpoint & LIBUSB_ENDPOINT_IN;
+    if (tr->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        // Packets are filled one after the other, the rest stay empty
+        int offset = 0;
+        for (int i = 0; i < tr->num_iso_packets; i++) {
+            libusb_iso_packet_descriptor &packet = tr->iso_packet_desc[i];
+            int size = static_cast<int>(packet.length);
+            if (in) {
+                size = qMin(size, static_cast<int>(e.m_data.size()));
+                memcpy(tr->buffer + offset, e.m_data.constData(), size);
+                e.m_data.remove(0, size);
+            } else {
+                const QByteArray data(reinterpret_cast<const char *>(tr->buffer + offset), size);
+                if (e.m_loopback)
+                    m_endpoints[e.m_loopback].m_data.append(data);
+                else
+                    e.m_written.append(data);
+            }
+            packet.actual_length = static_cast<unsigned int>(size);
+            packet.status = LIBUSB_TRANSFER_COMPLETED;
+            offset += static_cast<int>(packet.length);
+            // Like libusb on Linux, the transfer also reports the sum of its packets
+            tr->actual_length += size;
+        }
+        return;
+    }
+
+    if (in) {
+        if (e.m_data.isEmpty()) {
+            Q_ASSERT(p.m_deadline && p.m_deadline <= now);
+            tr->status = LIBUSB_TRANSFER_TIMED_OUT;
+            return;
+        }
+        // A short packet ends the transfer, so whatever is available completes it.
+        const int size = qMin(tr->length, static_cast<int>(e.m_data.size()));
+        memcpy(tr->buffer, e.m_data.constData(), size);
+        e.m_data.remove(0, size);
+        tr->actual_length = size;
+    } else {
+        const QByteArray data(reinterpret_cast<const char *>(tr->buffer), tr->length);
+        if (e.m_loopback)
+            m_endpoints[e.m_loopback].m_data.append(data);
+        else
+            e.m_written.append(data);
+        tr->actual_length = tr->length;
+    }
+}
+
+void QUsbFakeTransport::completeControl(libusb_transfer *tr)
+{
+    // m_mutex must be held
+    const libusb_control_setup *setup = libusb_control_transfer_get_setup(tr);
+    QUsbDevice::ControlRequest request;
+    request.bmRequestType = setup->bmRequestType;
+    request.bRequest = setup->bRequest;
+    request.wValue = libusb_le16_to_cpu(setup->wValue);
+    request.wIndex = libusb_le16_to_cpu(setup->wIndex);
+    request.wLength = libusb_le16_to_cpu(setup->wLength);
+
+    const bool in = request.bmRequestType & LIBUSB_ENDPOINT_IN;
+    uchar *data = libusb_control_transfer_get_data(tr);
+    if (!in)
+        request.data = QByteArray(reinterpret_cast<const char *>(data), request.wLength);
+
+    QUsbDevice::ControlResult result;
+    if (m_control)
+        result = m_control(request);
+    else if (in)
+        result.data = QByteArray(request.wLength, '\0');
+
+    switch (result.status) {
+    case QUsbDevice::statusOK:
+        break;
+    case QUsbDevice::statusPipeError:
+        tr->status = LIBUSB_TRANSFER_STALL;
+        return;
+    case QUsbDevice::statusTimeout:
+        tr->status = LIBUSB_TRANSFER_TIMED_OUT;
+        return;
+    case QUsbDevice::statusNoSuchDevice:
+        tr->status = LIBUSB_TRANSFER_NO_DEVICE;
+        return;
+    default:
+        tr->status = LIBUSB_TRANSFER_ERROR;
+        return;
+    }
+
+    if (in) {
+        const int size = qMin(static_cast<int>(request.wLength), static_cast<int>(result.data.size()));
+        memcpy(data, result.data.constData(), size);
+        tr->actual_length = size;
+    } else {
+        tr->actual_length = request.wLength;
+    }
+}
+
+void QUsbFakeTransport::run()
+{
+    QMutexLocker locker(&m_mutex);
+    while (!m_quit) {
+        // Transfers may still be pending, as with a hotplug event
+        if (m_unplugged && !m_left) {
+            m_left = true;
+            if (m_open && m_device)
+                deviceLeft(reinterpret_cast<libusb_device_handle *>(this));
+        }
+
+        const qint64 now = m_clock.nsecsElapsed();
+        qint64 wake = -1;
+        int index = -1;
+
+        // Oldest transfer that can complete, later ones on the same endpoint have to wait for it.
+        QList<int> blocked;
+        for (int i = 0; i < m_pending.size(); i++) {
+            const Pending &p = m_pending.at(i);
+            const int ep = p.m_transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL ? 0 : p.m_transfer->endpoint;
+            if (p.m_cancelled || m_unplugged) {
+                index = i;
+                break;
+            }
+            if (blocked.contains(ep))
+                continue;
+            if (!m_paused && isReady(p, now)) {
+                index = i;
+                break;
+            }
+            if (!m_paused) {
+                const qint64 next = p.m_ready > now ? p.m_ready : p.m_deadline;
+                if (next > 0 && (wake < 0 || next < wake))
+                    wake = next;
+            }
+            blocked.append(ep);
+        }
+
+        if (index < 0) {
+            m_idle.wakeAll();
+            if (wake < 0)
+                m_cond.wait(&m_mutex);
+            else
+                m_cond.wait(&m_mutex, QDeadlineTimer(std::chrono::nanoseconds(wake - now), Qt::PreciseTimer));
+            continue;
+        }
+
+        const Pending p = m_pending.takeAt(index);
+        complete(p, now);
+
+        // Handed over to the dispatch thread, from its event loop unless it waits already
+        if (m_dispatcher) {
+            m_completed.append(p.m_transfer);
+            m_completedCond.wakeAll();
+            if (!m_dispatchQueued) {
+                m_dispatchQueued = true;
+                QMetaObject::invokeMethod(m_dispatcher, [this]() {
+                    m_mutex.lock();
+                    m_dispatchQueued = false;
+                    m_mutex.unlock();
+                    handleEvents(QDeadlineTimer(0));
+                }, Qt::QueuedConnection);
+            }
+            continue;
+        }
+
+        // The callback may submit again, don't hold the lock.
+        m_busy = true;
+        locker.unlock();
+        p.m_transfer->callback(p.m_transfer);
+        locker.relock();
+        m_busy = false;
+    }
+}
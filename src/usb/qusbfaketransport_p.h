@@ -0,0 +1,146 @@
+#ifndef QUSBFAKETRANSPORT_P_H
+#define QUSBFAKETRANSPORT_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include "qusbtransport_p.h"
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
+#include <functional>
+
+QT_BEGIN_NAMESPACE
+
+class QUsbFakeTransport;
+
+class QUsbFakeTransportThread : public QThread
+{
+public:
+    void run() override;
+
+    QUsbFakeTransport *m_transport;
+};
+
+// In-process device for tests and load tests, no hardware or libusb context involved.
+// Transfers complete from a single thread, in submission order on each endpoint, once
+// the configured latency has elapsed. IN transfers wait for data like a device NAKing
+// until their timeout expires. With a dispatch thread set, callbacks run from that
+// thread instead, like libusb events with QUsb::setEventThread().
+class Q_USB_EXPORT QUsbFakeTransport : public QUsbTransport
+{
+public:
+    typedef std::function<QUsbDevice::ControlResult(const QUsbDevice::ControlRequest &)> ControlHandler;
+
+    QUsbFakeTransport();
+    ~QUsbFakeTransport();
+
+    // Scripting, may be called at any time
+    void setId(const QUsb::Id &id);
+    void setPortPath(const QList<quint8> &path);
+    void setSpeed(QUsbDevice::DeviceSpeed speed);
+    void setDeviceDescriptor(const QUsbDevice::DeviceDescriptor &descriptor);
+    void setConfigDescriptor(const QUsbDevice::ConfigDescriptor &descriptor);
+    void setControlHandler(const ControlHandler &handler);
+    void setLoopback(quint8 out, quint8 in);
+    void setLatency(qint64 usecs);
+    void setPaused(bool paused);
+    void setDispatchThread(QThread *thread);
+
+    void injectData(quint8 endpoint, const QByteArray &data);
+    void injectStatus(quint8 endpoint, libusb_transfer_status status, int count = 1);
+    QByteArray takeWritten(quint8 endpoint);
+    int pendingTransfers() const;
+    bool waitForIdle(int msecs = 30000);
+    void unplug();
+
+    // QUsbTransport
+    int open(QUsb::Id *id, QList<quint8> *path, libusb_device_handle **handle) override;
+    void close(libusb_device_handle *handle) override;
+    void stop() override;
+
+    int detachKernelDriver(libusb_device_handle *handle, int interface) override;
+    int configuration(libusb_device_handle *handle, int *config) override;
+    int setConfiguration(libusb_device_handle *handle, int config) override;
+    int claimInterface(libusb_device_handle *handle, int interface) override;
+    int releaseInterface(libusb_device_handle *handle, int interface) override;
+    QUsbDevice::DeviceSpeed speed(libusb_device_handle *handle) override;
+    void address(libusb_device_handle *handle, quint8 *bus, quint8 *address) override;
+    void descriptors(libusb_device_handle *handle, QUsbDevice::DeviceDescriptor *device,
+                     QUsbDevice::ConfigDescriptor *config) override;
+
+    uchar *allocDeviceMemory(libusb_device_handle *handle, qint64 size) override;
+    void freeDeviceMemory(libusb_device_handle *handle, uchar *buffer, qint64 size) override;
+    int allocStreams(libusb_device_handle *handle, quint32 count, uchar *endpoints, int size) override;
+    int freeStreams(libusb_device_handle *handle, uchar *endpoints, int size) override;
+
+    int submit(libusb_transfer *transfer) override;
+    int cancel(libusb_transfer *transfer) override;
+    int syncTransfer(libusb_device_handle *handle, quint8 type, quint8 endpoint, uchar *data,
+                     int length, int *transferred, uint timeout) override;
+
+    bool isDispatchThread() const override;
+    bool isEventThread() const override;
+    void handleEvents(QDeadlineTimer deadline) override;
+
+    void run();
+
+private:
+    struct Pending {
+        libusb_transfer *m_transfer;
+        qint64 m_ready; // Latency elapsed, nanoseconds on m_clock
+        qint64 m_deadline; // Timeout, 0 for none
+        bool m_cancelled;
+    };
+
+    struct Endpoint {
+        QByteArray m_data; // Waiting to be read, IN endpoints
+        QByteArray m_written; // Received without a loopback, OUT endpoints
+        QList<libusb_transfer_status> m_status; // Injected results of the next transfers
+        quint8 m_loopback = 0; // IN endpoint fed by this OUT endpoint
+    };
+
+    bool isReady(const Pending &p, qint64 now);
+    void complete(const Pending &p, qint64 now);
+    void completeControl(libusb_transfer *tr);
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_cond; // Wakes the completion thread
+    QWaitCondition m_idle; // Nothing left to complete for now
+    QElapsedTimer m_clock;
+    QList<Pending> m_pending; // Submission order
+    QList<libusb_transfer *> m_completed; // Waiting for the dispatch thread to run their callback
+    QWaitCondition m_completedCond; // m_completed got a transfer
+    QObject *m_dispatcher; // Lives in the dispatch thread, if any
+    bool m_dispatchQueued; // A call to handleEvents() is posted to m_dispatcher
+    bool m_dispatching; // The dispatch thread runs callbacks, only touched from there
+    QHash<quint8, Endpoint> m_endpoints;
+    ControlHandler m_control;
+    QUsb::Id m_id;
+    QList<quint8> m_portPath;
+    QUsbDevice::DeviceSpeed m_speed;
+    QUsbDevice::DeviceDescriptor m_deviceDescriptor;
+    QUsbDevice::ConfigDescriptor m_configDescriptor;
+    qint64 m_latency; // Nanoseconds
+    int m_config;
+    bool m_paused;
+    bool m_open;
+    bool m_unplugged;
+    bool m_left; // The unplug was reported to the device
+    bool m_quit;
+    bool m_busy; // A callback is running
+    QUsbFakeTransportThread *m_thread;
+};
+
+QT_END_NAMESPACE
+
+#endif // QUSBFAKETRANSPORT_P_H
@@ -0,0 +1,177 @@
+#include "qusbringbuffer_p.h"
+
+/*
+    QUsbRingBuffer is a fixed capacity FIFO of buffer segments.
+
+    Segments are referenced, not copied: the memory handed to append() must stay
+    valid until the segment has been fully read or skipped, at which point the
+    release function is called with the segment's tag.
+    Storage for the segment slots is allocated once by setCapacity(), appending,
+    reading and skipping never allocate.
+    It is not thread safe, callers are expected to hold their own lock.
+ */
+
+QUsbRingBuffer::QUsbRingBuffer(int capacity)
+    : m_head(0), m_count(0), m_size(0), m_release(Q_NULLPTR), m_context(Q_NULLPTR)
+{
+    setCapacity(capacity);
+}
+
+QUsbRingBuffer::~QUsbRingBuffer()
+{
+    clear();
+}
+
+/*
+    Calls \a release with \a context whenever a segment has been consumed.
+ */
+void QUsbRingBuffer::setReleaseFunction(ReleaseFunction release, void *context)
+{
+    m_release = release;
+    m_context = context;
+}
+
+/*
+    Reallocates the slots to hold \a capacity segments.
+    Queued segments are kept, the capacity never drops below their count.
+ */
+void QUsbRingBuffer::setCapacity(int capacity)
+{
+    capacity = qMax(capacity, m_count);
+    if (capacity == m_segments.size())
+        return;
+
+    QList<Segment> segments(capacity);
+    for (int i = 0; i < m_count; i++)
+        segments[i] = m_segments.at((m_head + i) % m_segments.size());
+
+    m_segments.swap(segments);
+    m_head = 0;
+}
+
+/*
+    Releases all queued segments.
+ */
+void QUsbRingBuffer::clear()
+{
+    while (m_count)
+        releaseHead();
+    m_head = 0;
+    m_size = 0;
+}
+
+/*
+    Queues \a size bytes at \a data, identified by \a tag.
+    Returns \c false if the ring is full or the segment is empty.
+ */
+bool QUsbRingBuffer::append(const char *data, qint64 size, void *tag)
+{
+    if (size <= 0 || isFull())
+        return false;
+
+    Segment &s = m_segments[(m_head + m_count) % m_segments.size()];
+    s.data = data;
+    s.size = size;
+    s.tag = tag;
+    m_count++;
+    m_size += size;
+
+    return true;
+}
+
+/*
+    Moves up to \a maxSize bytes into \a data.
+    Returns the number of bytes read.
+ */
+qint64 QUsbRingBuffer::read(char *data, qint64 maxSize)
+{
+    qint64 read = 0;
+
+    while (m_count && read < maxSize) {
+        Segment &s = m_segments[m_head];
+        const qint64 len = qMin(s.size, maxSize - read);
+
+        memcpy(data + read, s.data, static_cast<size_t>(len));
+        s.data += len;
+        s.size -= len;
+        m_size -= len;
+        read += len;
+
+        if (s.size == 0)
+            releaseHead();
+    }
+
+    return read;
+}
+
+/*
+    Copies up to \a maxSize bytes into \a data without consuming them.
+    Returns the number of bytes copied.
+ */
+qint64 QUsbRingBuffer::peek(char *data, qint64 maxSize) const
+{
+    qint64 read = 0;
+
+    for (int i = 0; i < m_count && read < maxSize; i++) {
+        const Segment &s = m_segments.at((m_head + i) % m_segments.size());
+        const qint64 len = qMin(s.size, maxSize - read);
+
+        memcpy(data + read, s.data, static_cast<size_t>(len));
+        read += len;
+    }
+
+    return read;
+}
+
+/*
+    Drops up to \a size bytes from the front of the buffer.
+    Returns the number of bytes dropped.
+ */
+qint64 QUsbRingBuffer::skip(qint64 size)
+{
+    qint64 skipped = 0;
+
+    while (m_count && skipped < size) {
+        Segment &s = m_segments[m_head];
+        const qint64 len = qMin(s.size, size - skipped);
+
+        s.data += len;
+        s.size -= len;
+        m_size -= len;
+        skipped += len;
+
+        if (s.size == 0)
+            releaseHead();
+    }
+
+    return skipped;
+}
+
+/*
+    Returns views on the queued segments, oldest first.
+    They stay valid until the corresponding bytes are read or skipped.
+ */
+QList<QByteArrayView> QUsbRingBuffer::spans() const
+{
+    QList<QByteArrayView> spans;
+    spans.reserve(m_count);
+
+    for (int i = 0; i < m_count; i++) {
+        const Segment &s = m_segments.at((m_head + i) % m_segments.size());
+        spans.append(QByteArrayView(s.data, s.size));
+    }
+
+    return spans;
+}
+
+void QUsbRingBuffer::releaseHead()
+{
+    Segment &s = m_segments[m_head];
+    m_size -= s.size;
+    s.size = 0;
+    m_head = (m_head + 1) % m_segments.size();
+    m_count--;
+
+    if (m_release)
+        m_release(s.tag, m_context);
+}
@@ -0,0 +1,64 @@
+#ifndef QUSBRINGBUFFER_P_H
+#define QUSBRINGBUFFER_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include "qusbglobal.h"
+#include <QByteArrayView>
+#include <QList>
+
+QT_BEGIN_NAMESPACE
+
+class Q_USB_EXPORT QUsbRingBuffer
+{
+public:
+    typedef void (*ReleaseFunction)(void *tag, void *context);
+
+    explicit QUsbRingBuffer(int capacity = 0);
+    ~QUsbRingBuffer();
+
+    void setReleaseFunction(ReleaseFunction release, void *context);
+    void setCapacity(int capacity);
+    int capacity() const { return m_segments.size(); }
+    int segmentCount() const { return m_count; }
+    qint64 size() const { return m_size; }
+    bool isEmpty() const { return m_size == 0; }
+    bool isFull() const { return m_count == m_segments.size(); }
+    void clear();
+
+    bool append(const char *data, qint64 size, void *tag = Q_NULLPTR);
+    qint64 read(char *data, qint64 maxSize);
+    qint64 peek(char *data, qint64 maxSize) const;
+    qint64 skip(qint64 size);
+    QList<QByteArrayView> spans() const;
+
+private:
+    struct Segment
+    {
+        const char *data;
+        qint64 size;
+        void *tag;
+    };
+
+    void releaseHead();
+
+    QList<Segment> m_segments;
+    int m_head;
+    int m_count;
+    qint64 m_size;
+    ReleaseFunction m_release;
+    void *m_context;
+};
+
+QT_END_NAMESPACE
+
+#endif // QUSBRINGBUFFER_P_H
@@ -0,0 +1,419 @@
+#include "qusbtransport_p.h"
+#include "qusbdevice_p.h"
+
+#define DbgPrintPrivFuncName()                     \
+    if (m_log_level >= QUsb::logDebug) \
+    qDebug() << "***[" << Q_FUNC_INFO << "]***"
+
+static int LIBUSB_CALL DeviceLeftCallback(libusb_context *ctx,
+                                          libusb_device *device,
+                                          libusb_hotplug_event event,
+                                          void *user_data)
+{
+    QUsbLibusbTransport *transport = reinterpret_cast<QUsbLibusbTransport *>(user_data);
+    QUsbDevice *dev = transport->device();
+
+    if (dev->logLevel() >= QUsb::logDebug)
+        qDebug("DeviceLeftCallback");
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+        if (transport->m_ctx == ctx && transport->m_handle && libusb_get_device(transport->m_handle) == device)
+            transport->deviceLeft(transport->m_handle);
+    }
+    return 0;
+}
+
+QUsbTransport::QUsbTransport()
+    : m_device(Q_NULLPTR), m_log_level(QUsb::logInfo)
+{
+}
+
+QUsbTransport::~QUsbTransport()
+{
+}
+
+/*!
+    \brief Set the log \a level, the transport only logs what goes beyond it.
+ */
+void QUsbTransport::setLogLevel(QUsb::LogLevel level)
+{
+    m_log_level = level;
+}
+
+/*!
+    \brief Wait for \a cond, with \a mutex locked, until it is woken or \a deadline expires.
+
+    From the thread dispatching events nobody else would run the callbacks that wake \a cond,
+    so events are handled there instead, with \a mutex unlocked. Returns \c false once
+    \a deadline expired.
+ */
+bool QUsbTransport::wait(QWaitCondition *cond, QMutex *mutex, QDeadlineTimer deadline)
+{
+    if (!isDispatchThread())
+        return cond->wait(mutex, deadline);
+
+    mutex->unlock();
+    handleEvents(deadline);
+    mutex->lock();
+    return !deadline.hasExpired();
+}
+
+/*!
+    \brief Close the device, if \a handle is still the one it has open.
+
+    Reported from the event thread, where closing would wait for callbacks that can only
+    run once it returns, so the device closes from its own thread's event loop instead.
+ */
+void QUsbTransport::deviceLeft(libusb_device_handle *handle)
+{
+    QUsbDevice *dev = m_device;
+    QMetaObject::invokeMethod(dev, [dev, handle]() {
+        if (static_cast<QUsbDevicePrivate *>(QObjectPrivate::get(dev))->m_devHandle == handle)
+            dev->close();
+    }, Qt::QueuedConnection);
+}
+
+QUsbLibusbTransport::QUsbLibusbTransport()
+    : m_context(QUsbContext::acquire()), m_handle(Q_NULLPTR), m_callbackHandle(0)
+{
+    m_ctx = m_context->context();
+    m_hasHotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) != 0;
+}
+
+QUsbLibusbTransport::~QUsbLibusbTransport()
+{
+    DbgPrintPrivFuncName();
+    if (m_handle)
+        stop();
+    m_context->release(this);
+}
+
+void QUsbLibusbTransport::setLogLevel(QUsb::LogLevel level)
+{
+    QUsbTransport::setLogLevel(level);
+    m_context->setLogLevel(this, level >= QUsb::logDebugAll ? LIBUSB_LOG_LEVEL_DEBUG : LIBUSB_LOG_LEVEL_NONE);
+}
+
+void QUsbLibusbTransport::registerDisconnectCallback(int vid, int pid)
+{
+    DbgPrintPrivFuncName();
+    if (m_hasHotplug) {
+
+        int rc;
+        rc = libusb_hotplug_register_callback(m_ctx,
+                                              static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                                              LIBUSB_HOTPLUG_ENUMERATE,
+                                              vid,
+                                              pid,
+                                              LIBUSB_HOTPLUG_MATCH_ANY,
+                                              reinterpret_cast<libusb_hotplug_callback_fn>(DeviceLeftCallback),
+                                              reinterpret_cast<void *>(this),
+                                              &m_callbackHandle);
+        if (LIBUSB_SUCCESS != rc) {
+            qWarning("Error creating hotplug callback");
+            return;
+        }
+    }
+}
+
+void QUsbLibusbTransport::deregisterDisconnectCallback()
+{
+    DbgPrintPrivFuncName();
+    libusb_hotplug_deregister_callback(m_ctx, m_callbackHandle);
+    m_callbackHandle = 0;
+}
+
+int QUsbLibusbTransport::open(QUsb::Id *id, QList<quint8> *path, libusb_device_handle **handle)
+{
+    int rc = -5; // Not found by default
+
+    *handle = Q_NULLPTR;
+    // Opened before with this exact id, no need to look for it again
+    libusb_device *dev = m_context->cachedDevice(*id, path);
+    if (dev) {
+        rc = libusb_open(dev, handle);
+        if (rc != 0) {
+            // Unplugged without hotplug to tell us, or gone bad
+            m_context->uncacheDevice(dev);
+            *handle = Q_NULLPTR;
+        }
+        libusb_unref_device(dev);
+    }
+
+    if (*handle == Q_NULLPTR) {
+        rc = find(id, path, handle);
+        if (rc == 0)
+            m_context->cacheDevice(*id, *path, libusb_get_device(*handle));
+    }
+
+    if (rc != 0 || *handle == Q_NULLPTR)
+        return rc;
+
+    m_handle = *handle;
+    registerDisconnectCallback(id->vid, id->pid);
+    m_context->startEvents(); // shared with the other devices, runs while one of them is open
+
+    return 0;
+}
+
+int QUsbLibusbTransport::find(QUsb::Id *id, QList<quint8> *path, libusb_device_handle **handle)
+{
+    int rc = -5; // Not found by default
+    ssize_t cnt; // holding number of devices in list
+    libusb_device **devs;
+    uint8_t ports[MaxPortDepth];
+
+    cnt = libusb_get_device_list(m_ctx, &devs); // get the list of devices
+    if (cnt < 0) {
+        qCritical("libusb_get_device_list error");
+        libusb_free_device_list(devs, 1);
+        return -1;
+    }
+
+    for (int i = 0; i < cnt; i++) {
+        libusb_device *dev = devs[i];
+        quint8 bus = libusb_get_bus_number(dev);
+        quint8 port = libusb_get_port_number(dev);
+        libusb_device_descriptor desc;
+
+        // The topology is known without asking the device, check it first
+        const int depth = libusb_get_port_numbers(dev, ports, MaxPortDepth);
+        if (!path->isEmpty()
+            && (depth != path->size() || memcmp(ports, path->constData(), static_cast<size_t>(qMax(depth, 0))) != 0))
+            continue;
+
+        if (libusb_get_device_descriptor(dev, &desc) == 0) {
+            QUsb::Id tmp_id(*id);
+            // Assign default properties in order to match
+            if (tmp_id.pid == 0)
+                tmp_id.pid = desc.idProduct;
+            if (tmp_id.vid == 0)
+                tmp_id.vid = desc.idVendor;
+            if (tmp_id.bus == QUsb::busAny)
+                tmp_id.bus = bus;
+            if (tmp_id.port == QUsb::portAny)
+                tmp_id.port = port;
+            if (tmp_id.dClass == 0)
+                tmp_id.dClass = desc.bDeviceClass;
+            if (tmp_id.dSubClass == 0)
+                tmp_id.dSubClass = desc.bDeviceSubClass;
+
+            // Check all properties match. Defaults have been assigned above.
+            if (desc.idProduct == tmp_id.pid && desc.idVendor == tmp_id.vid
+                && bus == tmp_id.bus && port == tmp_id.port
+                && desc.bDeviceClass == tmp_id.dClass && desc.bDeviceSubClass == tmp_id.dSubClass) {
+                if (m_log_level >= QUsb::logInfo)
+                    qInfo("Found device");
+
+                rc = libusb_open(dev, handle);
+                if (rc == 0) {
+                    *id = tmp_id;
+                    if (path->isEmpty() && depth > 0)
+                        *path = QList<quint8>(ports, ports + depth);
+                    break;
+                }
+                else if (m_log_level >= QUsb::logWarning) {
+                    qWarning("Failed to open device: %s", libusb_strerror(static_cast<enum libusb_error>(rc)));
+                }
+            }
+        }
+    }
+    libusb_free_device_list(devs, 1); // free the list, unref the devices in it
+    return rc;
+}
+
+void QUsbLibusbTransport::close(libusb_device_handle *handle)
+{
+    libusb_close(handle);
+}
+
+void QUsbLibusbTransport::stop()
+{
+    if (m_hasHotplug && m_callbackHandle)
+        deregisterDisconnectCallback();
+    if (!m_handle)
+        return;
+    m_handle = Q_NULLPTR;
+
+    // Other devices keep the event thread busy, make sure none of our callbacks is still running.
+    m_context->syncEvents();
+    m_context->stopEvents();
+}
+
+int QUsbLibusbTransport::detachKernelDriver(libusb_device_handle *handle, int interface)
+{
+    if (libusb_kernel_driver_active(handle, interface) != 1) // find out if kernel driver is attached
+        return LIBUSB_SUCCESS;
+
+    if (m_log_level >= QUsb::logDebug)
+        qDebug("Kernel Driver Active");
+    int rc = libusb_detach_kernel_driver(handle, interface); // detach it
+    if (rc == 0 && m_log_level >= QUsb::logDebug)
+        qDebug("Kernel Driver Detached!");
+    return rc;
+}
+
+int QUsbLibusbTransport::configuration(libusb_device_handle *handle, int *config)
+{
+    return libusb_get_configuration(handle, config);
+}
+
+int QUsbLibusbTransport::setConfiguration(libusb_device_handle *handle, int config)
+{
+    return libusb_set_configuration(handle, config);
+}
+
+int QUsbLibusbTransport::claimInterface(libusb_device_handle *handle, int interface)
+{
+    return libusb_claim_interface(handle, interface);
+}
+
+int QUsbLibusbTransport::releaseInterface(libusb_device_handle *handle, int interface)
+{
+    return libusb_release_interface(handle, interface);
+}
+
+QUsbDevice::DeviceSpeed QUsbLibusbTransport::speed(libusb_device_handle *handle)
+{
+    switch (libusb_get_device_speed(libusb_get_device(handle))) {
+    case LIBUSB_SPEED_LOW:
+        return QUsbDevice::lowSpeed;
+    case LIBUSB_SPEED_FULL:
+        return QUsbDevice::fullSpeed;
+    case LIBUSB_SPEED_HIGH:
+        return QUsbDevice::highSpeed;
+    case LIBUSB_SPEED_SUPER:
+        return QUsbDevice::superSpeed;
+    default:
+        return QUsbDevice::unknownSpeed;
+    }
+}
+
+void QUsbLibusbTransport::address(libusb_device_handle *handle, quint8 *bus, quint8 *address)
+{
+    libusb_device *dev = libusb_get_device(handle);
+    *bus = libusb_get_bus_number(dev);
+    *address = libusb_get_device_address(dev);
+}
+
+void QUsbLibusbTransport::descriptors(libusb_device_handle *handle, QUsbDevice::DeviceDescriptor *device,
+                                      QUsbDevice::ConfigDescriptor *configuration)
+{
+    DbgPrintPrivFuncName();
+    libusb_device *dev = libusb_get_device(handle);
+    libusb_device_descriptor desc;
+    libusb_config_descriptor *config;
+
+    if (libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS) {
+        device->bcdUSB = desc.bcdUSB;
+        device->deviceClass = desc.bDeviceClass;
+        device->deviceSubClass = desc.bDeviceSubClass;
+        device->deviceProtocol = desc.bDeviceProtocol;
+        device->maxPacketSize0 = desc.bMaxPacketSize0;
+        device->vid = desc.idVendor;
+        device->pid = desc.idProduct;
+        device->bcdDevice = desc.bcdDevice;
+        device->numConfigurations = desc.bNumConfigurations;
+    }
+
+    if (libusb_get_active_config_descriptor(dev, &config) != LIBUSB_SUCCESS)
+        return;
+
+    configuration->value = config->bConfigurationValue;
+    configuration->attributes = config->bmAttributes;
+    configuration->maxPower = config->MaxPower;
+
+    for (int i = 0; i < config->bNumInterfaces; i++) {
+        const libusb_interface &iface = config->interface[i];
+        for (int a = 0; a < iface.num_altsetting; a++) {
+            const libusb_interface_descriptor &alt = iface.altsetting[a];
+            QUsbDevice::InterfaceDescriptor interface;
+            interface.number = alt.bInterfaceNumber;
+            interface.alternate = alt.bAlternateSetting;
+            interface.interfaceClass = alt.bInterfaceClass;
+            interface.interfaceSubClass = alt.bInterfaceSubClass;
+            interface.interfaceProtocol = alt.bInterfaceProtocol;
+
+            for (int e = 0; e < alt.bNumEndpoints; e++) {
+                const libusb_endpoint_descriptor &ep = alt.endpoint[e];
+                const quint8 type = ep.bmAttributes & 0x3;
+                const bool periodic = type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS || type == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+                QUsbDevice::EndpointDescriptor endpoint;
+                endpoint.address = ep.bEndpointAddress;
+                endpoint.attributes = ep.bmAttributes;
+                endpoint.maxPacketSize = ep.wMaxPacketSize & 0x7ff;
+                endpoint.interval = ep.bInterval;
+                // Bits 12:11 are additional transactions per microframe on high speed
+                endpoint.mult = periodic ? (ep.wMaxPacketSize >> 11) & 0x3 : 0;
+
+                libusb_ss_endpoint_companion_descriptor *companion;
+                if (libusb_get_ss_endpoint_companion_descriptor(m_ctx, &ep, &companion) == LIBUSB_SUCCESS) {
+                    endpoint.maxBurst = companion->bMaxBurst;
+                    endpoint.mult = type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ? companion->bmAttributes & 0x3 : 0;
+                    endpoint.bytesPerInterval = companion->wBytesPerInterval;
+                    libusb_free_ss_endpoint_companion_descriptor(companion);
+                }
+                interface.endpoints.append(endpoint);
+            }
+            configuration->interfaces.append(interface);
+        }
+    }
+
+    libusb_free_config_descriptor(config);
+}
+
+uchar *QUsbLibusbTransport::allocDeviceMemory(libusb_device_handle *handle, qint64 size)
+{
+    return libusb_dev_mem_alloc(handle, static_cast<size_t>(size));
+}
+
+void QUsbLibusbTransport::freeDeviceMemory(libusb_device_handle *handle, uchar *buffer, qint64 size)
+{
+    libusb_dev_mem_free(handle, buffer, static_cast<size_t>(size));
+}
+
+int QUsbLibusbTransport::allocStreams(libusb_device_handle *handle, quint32 count, uchar *endpoints, int size)
+{
+    return libusb_alloc_streams(handle, count, endpoints, size);
+}
+
+int QUsbLibusbTransport::freeStreams(libusb_device_handle *handle, uchar *endpoints, int size)
+{
+    return libusb_free_streams(handle, endpoints, size);
+}
+
+int QUsbLibusbTransport::submit(libusb_transfer *transfer)
+{
+    int rc = libusb_submit_transfer(transfer);
+    if (rc == LIBUSB_SUCCESS)
+        m_context->transferSubmitted();
+    return rc;
+}
+
+int QUsbLibusbTransport::cancel(libusb_transfer *transfer)
+{
+    return libusb_cancel_transfer(transfer);
+}
+
+bool QUsbLibusbTransport::isDispatchThread() const
+{
+    return m_context->isDispatchThread();
+}
+
+bool QUsbLibusbTransport::isEventThread() const
+{
+    return m_context->isEventThread();
+}
+
+void QUsbLibusbTransport::handleEvents(QDeadlineTimer deadline)
+{
+    m_context->handleEvents(deadline);
+}
+
+int QUsbLibusbTransport::syncTransfer(libusb_device_handle *handle, quint8 type, quint8 endpoint, uchar *data,
+                                      int length, int *transferred, uint timeout)
+{
+    if (type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+        return libusb_interrupt_transfer(handle, endpoint, data, length, transferred, timeout);
+    return libusb_bulk_transfer(handle, endpoint, data, length, transferred, timeout);
+}
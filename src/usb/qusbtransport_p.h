@@ -0,0 +1,131 @@
+#ifndef QUSBTRANSPORT_P_H
+#define QUSBTRANSPORT_P_H
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the Qt API.  It exists purely as an
+// implementation detail.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+#include "qusbdevice.h"
+#include "qusbcontext_p.h"
+#include <QDeadlineTimer>
+#include <QWaitCondition>
+
+QT_BEGIN_NAMESPACE
+
+// Everything QUsbDevice and QUsbEndpoint ask of the bus. Transfers stay libusb_transfer
+// structures whatever the transport, a transport completes them by calling their callback.
+// Handles are opaque to the callers, they only pass them back.
+class Q_USB_EXPORT QUsbTransport
+{
+public:
+    QUsbTransport();
+    virtual ~QUsbTransport();
+
+    void setDevice(QUsbDevice *device) { m_device = device; }
+    QUsbDevice *device() const { return m_device; }
+    virtual void setLogLevel(QUsb::LogLevel level);
+
+    // Opens the first device matching id, and path unless it is empty. The wildcards of id,
+    // and path if empty, are filled from the device found.
+    virtual int open(QUsb::Id *id, QList<quint8> *path, libusb_device_handle **handle) = 0;
+    virtual void close(libusb_device_handle *handle) = 0;
+    // The device was closed, disconnects are no longer reported.
+    virtual void stop() = 0;
+
+    virtual int detachKernelDriver(libusb_device_handle *handle, int interface) = 0;
+    virtual int configuration(libusb_device_handle *handle, int *config) = 0;
+    virtual int setConfiguration(libusb_device_handle *handle, int config) = 0;
+    virtual int claimInterface(libusb_device_handle *handle, int interface) = 0;
+    virtual int releaseInterface(libusb_device_handle *handle, int interface) = 0;
+    virtual QUsbDevice::DeviceSpeed speed(libusb_device_handle *handle) = 0;
+    virtual void address(libusb_device_handle *handle, quint8 *bus, quint8 *address) = 0;
+    virtual void descriptors(libusb_device_handle *handle, QUsbDevice::DeviceDescriptor *device,
+                             QUsbDevice::ConfigDescriptor *config) = 0;
+
+    virtual uchar *allocDeviceMemory(libusb_device_handle *handle, qint64 size) = 0;
+    virtual void freeDeviceMemory(libusb_device_handle *handle, uchar *buffer, qint64 size) = 0;
+    virtual int allocStreams(libusb_device_handle *handle, quint32 count, uchar *endpoints, int size) = 0;
+    virtual int freeStreams(libusb_device_handle *handle, uchar *endpoints, int size) = 0;
+
+    virtual int submit(libusb_transfer *transfer) = 0;
+    virtual int cancel(libusb_transfer *transfer) = 0;
+    virtual int syncTransfer(libusb_device_handle *handle, quint8 type, quint8 endpoint, uchar *data,
+                             int length, int *transferred, uint timeout) = 0;
+
+    // The calling thread is the one that should dispatch completions, from its event loop.
+    virtual bool isDispatchThread() const = 0;
+    // The calling thread runs completion callbacks, none can complete while it waits.
+    virtual bool isEventThread() const = 0;
+    // Run the callbacks of completed transfers, waiting for some until deadline.
+    virtual void handleEvents(QDeadlineTimer deadline) = 0;
+    // Waits for cond like QWaitCondition::wait(), callers check their condition again either way.
+    bool wait(QWaitCondition *cond, QMutex *mutex, QDeadlineTimer deadline);
+    // The device opened as handle is gone, from any thread.
+    void deviceLeft(libusb_device_handle *handle);
+
+protected:
+    QUsbDevice *m_device;
+    QUsb::LogLevel m_log_level;
+
+private:
+    Q_DISABLE_COPY(QUsbTransport)
+};
+
+class Q_USB_EXPORT QUsbLibusbTransport : public QUsbTransport
+{
+public:
+    static const int MaxPortDepth = 7; // USB 3.0 allows up to 7 tiers, the host included
+    QUsbLibusbTransport();
+    ~QUsbLibusbTransport();
+
+    void setLogLevel(QUsb::LogLevel level) override;
+
+    int open(QUsb::Id *id, QList<quint8> *path, libusb_device_handle **handle) override;
+    void close(libusb_device_handle *handle) override;
+    void stop() override;
+
+    int detachKernelDriver(libusb_device_handle *handle, int interface) override;
+    int configuration(libusb_device_handle *handle, int *config) override;
+    int setConfiguration(libusb_device_handle *handle, int config) override;
+    int claimInterface(libusb_device_handle *handle, int interface) override;
+    int releaseInterface(libusb_device_handle *handle, int interface) override;
+    QUsbDevice::DeviceSpeed speed(libusb_device_handle *handle) override;
+    void address(libusb_device_handle *handle, quint8 *bus, quint8 *address) override;
+    void descriptors(libusb_device_handle *handle, QUsbDevice::DeviceDescriptor *device,
+                     QUsbDevice::ConfigDescriptor *config) override;
+
+    uchar *allocDeviceMemory(libusb_device_handle *handle, qint64 size) override;
+    void freeDeviceMemory(libusb_device_handle *handle, uchar *buffer, qint64 size) override;
+    int allocStreams(libusb_device_handle *handle, quint32 count, uchar *endpoints, int size) override;
+    int freeStreams(libusb_device_handle *handle, uchar *endpoints, int size) override;
+
+    int submit(libusb_transfer *transfer) override;
+    int cancel(libusb_transfer *transfer) override;
+    int syncTransfer(libusb_device_handle *handle, quint8 type, quint8 endpoint, uchar *data,
+                     int length, int *transferred, uint timeout) override;
+
+    bool isDispatchThread() const override;
+    bool isEventThread() const override;
+    void handleEvents(QDeadlineTimer deadline) override;
+
+    int find(QUsb::Id *id, QList<quint8> *path, libusb_device_handle **handle);
+    void registerDisconnectCallback(int vid, int pid);
+    void deregisterDisconnectCallback();
+
+    QUsbContext *m_context;
+    libusb_context *m_ctx; // Shared by all the devices
+    libusb_device_handle *m_handle; // Watched for disconnection
+    libusb_hotplug_callback_handle m_callbackHandle;
+    bool m_hasHotplug;
+};
+
+QT_END_NAMESPACE
+
+#endif // QUSBTRANSPORT_P_H
@@ -9,10 +9,20 @@ private slots:
     void assignment();
     void features();
     void staticFunctions();
+    void deviceList();
+    void monitor();
 
 private:
 };
 
+// Exposes the diffing done on each refresh without hotplug support
+class TestUsb : public QUsb
+{
+public:
+    using QUsb::m_system_list;
+    using QUsb::monitorDevices;
+};
+
 void tst_QUsb::constructors()
 {
     QUsb usb;
@@ -42,5 +52,52 @@ void tst_QUsb::staticFunctions()
     QUsb::devices();
 }
 
+void tst_QUsb::deviceList()
+{
+    QUsb usb;
+    const QUsb::Id id(0x1234, 0xabcd);
+
+    QVERIFY(usb.addDevice(id));
+    QVERIFY(!usb.addDevice(id));
+    QVERIFY(usb.removeDevice(id));
+    QVERIFY(!usb.removeDevice(id));
+
+    QCOMPARE(qHash(QUsb::Id(0x1234, 0xabcd, 1, 2)), qHash(QUsb::Id(0x1234, 0xabcd, 1, 2)));
+    QVERIFY(qHash(QUsb::Id(0x1234, 0xabcd, 1, 2)) != qHash(QUsb::Id(0x1234, 0xabcd, 1, 3)));
+}
+
+void tst_QUsb::monitor()
+{
+    TestUsb usb;
+    QSignalSpy inserted(&usb, &QUsb::deviceInserted);
+    QSignalSpy removed(&usb, &QUsb::deviceRemoved);
+
+    // Two identical devices, like HID ones without bus and port
+    const QUsb::Id a(0x1234, 0xabcd, 0, 0);
+    const QUsb::Id b(0x5678, 0xabcd, 1, 4);
+    QUsb::IdList list = usb.m_system_list;
+
+    list << a << a << b;
+    usb.monitorDevices(list);
+    QCOMPARE(inserted.count(), 3);
+    QCOMPARE(removed.count(), 0);
+    QCOMPARE(usb.m_system_list, list);
+
+    // One of them leaves, the other one is still there
+    inserted.clear();
+    list.removeOne(a);
+    usb.monitorDevices(list);
+    QCOMPARE(inserted.count(), 0);
+    QCOMPARE(removed.count(), 1);
+    QCOMPARE(removed.at(0).at(0).value<QUsb::Id>(), a);
+
+    // Same devices in another order
+    removed.clear();
+    std::reverse(list.begin(), list.end());
+    usb.monitorDevices(list);
+    QCOMPARE(inserted.count(), 0);
+    QCOMPARE(removed.count(), 0);
+}
+
 QTEST_MAIN(tst_QUsb)
 #include "tst_qusb.moc"
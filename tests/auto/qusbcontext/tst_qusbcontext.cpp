@@ -0,0 +1,252 @@
+#include <QtTest/QtTest>
+#include <QtUsb/QUsb>
+#include <QtUsb/QUsbDevice>
+#include <QtUsb/QUsbEndpoint>
+#include <QtUsb/private/qusb_p.h>
+#include <QtUsb/private/qusbcontext_p.h>
+#include <QtUsb/private/qusbdevice_p.h>
+
+class tst_QUsbContext : public QObject
+{
+    Q_OBJECT
+private slots:
+    void shared();
+    void events();
+    void eventsInterrupted();
+    void eventThread();
+    void eventThreadWait();
+    void enumeration();
+    void deviceCache();
+    void monitor();
+
+private:
+};
+
+static libusb_context *deviceContext(QUsbDevice *dev)
+{
+    QUsbDevicePrivate *d = static_cast<QUsbDevicePrivate *>(QObjectPrivate::get(dev));
+    return static_cast<QUsbLibusbTransport *>(d->m_transport)->m_ctx;
+}
+
+void tst_QUsbContext::shared()
+{
+    QUsbContext *context = QUsbContext::acquire();
+    const int base = context->refCount();
+
+    {
+        QUsbDevice a;
+        QUsbDevice b;
+        QCOMPARE(context->refCount(), base + 2);
+        QCOMPARE(deviceContext(&a), context->context());
+        QCOMPARE(deviceContext(&b), context->context());
+
+        // Enumerating reuses it too
+        QUsb::devices();
+        QCOMPARE(context->refCount(), base + 2);
+        QCOMPARE(QUsbContext::acquire(), context);
+        context->release();
+    }
+
+    QCOMPARE(context->refCount(), base);
+    context->release();
+}
+
+void tst_QUsbContext::events()
+{
+    QUsbContext *context = QUsbContext::acquire();
+    QVERIFY(!context->eventsRunning());
+
+    // One thread, whatever the number of users
+    context->startEvents();
+    context->startEvents();
+    QVERIFY(context->eventsRunning());
+    QVERIFY(!context->isEventThread());
+
+    context->stopEvents();
+    QVERIFY(context->eventsRunning());
+    context->stopEvents();
+    QTRY_VERIFY(!context->eventsRunning());
+
+    // It can be started again right away
+    context->startEvents();
+    QVERIFY(context->eventsRunning());
+    context->syncEvents();
+    context->stopEvents();
+    context->release();
+}
+
+void tst_QUsbContext::eventsInterrupted()
+{
+    QUsbContext *context = QUsbContext::acquire();
+    context->startEvents();
+    QVERIFY(context->eventsRunning());
+
+    // An interruption only makes the thread check whether it is still needed
+    for (int i = 0; i < 3; i++) {
+        libusb_interrupt_event_handler(context->context());
+        QTest::qWait(10);
+        QVERIFY(context->eventsRunning());
+    }
+
+    context->stopEvents();
+    QTRY_VERIFY(!context->eventsRunning());
+    context->release();
+}
+
+void tst_QUsbContext::eventThread()
+{
+    QThread *current = QThread::currentThread();
+    QVERIFY(!QUsb::eventThread());
+    if (!QUsb::setEventThread(current))
+        QSKIP("No pollable descriptors on this platform");
+    QCOMPARE(QUsb::eventThread(), current);
+
+    // The event loop of this thread replaces the internal one
+    QUsbContext *context = QUsbContext::acquire();
+    context->startEvents();
+    QVERIFY(!context->eventsRunning());
+    QTest::qWait(10);
+    QVERIFY(!context->isEventThread());
+    context->syncEvents();
+
+    // Which takes over again when the event thread is unset
+    QVERIFY(QUsb::setEventThread(Q_NULLPTR));
+    QVERIFY(!QUsb::eventThread());
+    QVERIFY(context->eventsRunning());
+    context->stopEvents();
+    QTRY_VERIFY(!context->eventsRunning());
+    context->release();
+}
+
+void tst_QUsbContext::eventThreadWait()
+{
+    QThread *current = QThread::currentThread();
+    if (!QUsb::setEventThread(current))
+        QSKIP("No pollable descriptors on this platform");
+
+    // Waits made from the event thread handle events until their deadline instead of sleeping
+    QUsbDevice dev;
+    QUsbTransport *transport = static_cast<QUsbDevicePrivate *>(QObjectPrivate::get(&dev))->m_transport;
+    QVERIFY(transport->isDispatchThread());
+    QMutex mutex;
+    QWaitCondition cond;
+    QElapsedTimer timer;
+    timer.start();
+    mutex.lock();
+    while (transport->wait(&cond, &mutex, QDeadlineTimer(50))) { }
+    mutex.unlock();
+    QVERIFY(timer.elapsed() >= 40);
+    QVERIFY(timer.elapsed() < 5000);
+
+    // Opening and closing an endpoint doesn't block, nothing is open on the bus
+    QUsbEndpoint ep(&dev, QUsbEndpoint::bulkEndpoint, 0x81);
+    QVERIFY(ep.open(QIODevice::ReadOnly));
+    QVERIFY(!ep.waitForReadyRead(10));
+    ep.close();
+    QFuture<QUsbDevice::ControlResult> control = dev.controlTransfer(0xc0, 0x01, 0, 0, QByteArray(), 4);
+    QVERIFY(dev.waitForControlTransfer(control, 1000));
+    QCOMPARE(control.result().status, QUsbDevice::statusNoSuchDevice);
+
+    // Other threads keep sleeping
+    QThread other;
+    QObject worker;
+    worker.moveToThread(&other);
+    other.start();
+    bool otherDispatch = true;
+    QMetaObject::invokeMethod(&worker, [&]() { otherDispatch = transport->isDispatchThread(); },
+                              Qt::BlockingQueuedConnection);
+    other.quit();
+    other.wait();
+    QVERIFY(!otherDispatch);
+
+    QVERIFY(QUsb::setEventThread(Q_NULLPTR));
+    QVERIFY(!transport->isDispatchThread());
+}
+
+void tst_QUsbContext::enumeration()
+{
+    QUsbContext *context = QUsbContext::acquire();
+    bool ok;
+
+    // Devices already seen are not read again, the result stays the same
+    const QUsb::IdList first = context->enumerate(&ok);
+    QVERIFY(ok);
+    QCOMPARE(context->enumerate(&ok), first);
+
+    // Only cached while hotplug events are handled
+    const quint64 generation = QUsbContext::generation();
+    context->startEvents();
+    QVERIFY(QUsbContext::generation() != generation);
+    const QUsb::IdList devices = QUsb::devices();
+    QCOMPARE(QUsb::devices(), devices);
+    if (!context->hotplugWatched())
+        qWarning("No hotplug support, devices() is not cached");
+
+    context->stopEvents();
+    QTRY_VERIFY(!context->eventsRunning());
+    QVERIFY(!context->hotplugWatched());
+    context->release();
+}
+
+void tst_QUsbContext::deviceCache()
+{
+    QUsbContext *context = QUsbContext::acquire();
+    libusb_device **list;
+    const ssize_t count = libusb_get_device_list(context->context(), &list);
+    if (count <= 0) {
+        context->release();
+        QSKIP("No USB device to cache");
+    }
+    libusb_device *device = list[0];
+    const QUsb::Id id(0x1234, 0xabcd);
+    const QUsb::Id other(0x1235, 0xabcd);
+    QList<quint8> path;
+
+    context->cacheDevice(id, { 1, 4 }, device);
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        // Nothing would tell when it leaves, so it isn't kept
+        QVERIFY(!context->cachedDevice(id, &path));
+    } else {
+        // Found by id, the path is filled in when empty and has to match otherwise
+        libusb_device *cached = context->cachedDevice(id, &path);
+        QCOMPARE(cached, device);
+        libusb_unref_device(cached);
+        QCOMPARE(path, QList<quint8>({ 1, 4 }));
+        QVERIFY(!context->cachedDevice(other, &path));
+        path = { 1, 3 };
+        QVERIFY(!context->cachedDevice(id, &path));
+
+        // Forgotten when it leaves, whatever id it was cached with
+        context->cacheDevice(other, { 1, 4 }, device);
+        context->uncacheDevice(device);
+        path.clear();
+        QVERIFY(!context->cachedDevice(id, &path));
+        QVERIFY(!context->cachedDevice(other, &path));
+    }
+
+    libusb_free_device_list(list, 1);
+    context->release();
+}
+
+void tst_QUsbContext::monitor()
+{
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        QSKIP("No hotplug support, devices are polled");
+
+    QUsbContext *context = QUsbContext::acquire();
+    {
+        QUsb usb;
+        QUsbPrivate *d = static_cast<QUsbPrivate *>(QObjectPrivate::get(&usb));
+        QVERIFY(d->m_has_hotplug);
+
+        // No polling thread, hotplug events are handled by the shared one
+        QVERIFY(!d->m_refresh_timer);
+        QVERIFY(context->eventsRunning());
+        QVERIFY(context->hotplugWatched());
+    }
+    QTRY_VERIFY(!context->eventsRunning());
+    context->release();
+}
+
+QTEST_MAIN(tst_QUsbContext)
+#include "tst_qusbcontext.moc"
@@ -1,5 +1,6 @@
 #include <QtTest/QtTest>
 #include <QtUsb/QUsbDevice>
+#include <QtUsb/private/qusbdevice_p.h>
 
 class tst_QUsbDevice : public QObject
 {
@@ -9,6 +10,10 @@ private slots:
     void assignment();
     void states();
     void staticfuncs();
+    void controlTransfer();
+    void controlTransferBatch();
+    void descriptors();
+    void capture();
 
 private:
 };
@@ -25,6 +30,7 @@ void tst_QUsbDevice::constructors()
     QCOMPARE(dev.speedString(), QByteArray("Unknown speed"));
     QCOMPARE(dev.config(), c);
     QCOMPARE(static_cast<uint>(dev.timeout()), static_cast<uint>(timeout));
+    QVERIFY(!dev.deviceMemory());
 }
 
 void tst_QUsbDevice::assignment()
@@ -43,6 +49,9 @@ void tst_QUsbDevice::assignment()
     dev.setTimeout(timeout);
     QCOMPARE(dev.timeout(), timeout);
 
+    dev.setDeviceMemory(true);
+    QVERIFY(dev.deviceMemory());
+
     const QUsb::Config c2 = c;
     const QUsb::Config c3(c);
 
@@ -65,11 +74,135 @@ void tst_QUsbDevice::states()
 
     dev.setLogLevel(QUsb::logNone);
     QCOMPARE(dev.logLevel(), QUsb::logNone);
+
+    // Not connected
+    QVERIFY(dev.allocStreams(4, { 0x81, 0x02 }) < 0);
+    QVERIFY(dev.freeStreams({ 0x81, 0x02 }) < 0);
 }
 
 void tst_QUsbDevice::staticfuncs()
 {
 }
 
+void tst_QUsbDevice::controlTransfer()
+{
+    QUsbDevice dev;
+
+    // Not connected, the future is already finished
+    QFuture<QUsbDevice::ControlResult> future = dev.controlTransfer(0xC0, 0x01, 0, 0, QByteArray(), 4);
+    QVERIFY(future.isFinished());
+    QCOMPARE(future.result().status, QUsbDevice::statusNoSuchDevice);
+    QVERIFY(future.result().data.isEmpty());
+}
+
+void tst_QUsbDevice::controlTransferBatch()
+{
+    QUsbDevice dev;
+    QList<QUsbDevice::ControlRequest> requests(3);
+
+    QFuture<QUsbDevice::ControlBatchResult> empty = dev.controlTransferBatch({});
+    QVERIFY(empty.isFinished());
+    QCOMPARE(empty.result().failedIndex, -1);
+    QVERIFY(empty.result().results.isEmpty());
+
+    // Not connected, stops at the first request
+    QFuture<QUsbDevice::ControlBatchResult> future = dev.controlTransferBatch(requests);
+    QVERIFY(future.isFinished());
+    QCOMPARE(future.result().failedIndex, 0);
+    QCOMPARE(future.result().results.size(), 1);
+    QCOMPARE(future.result().results.first().status, QUsbDevice::statusNoSuchDevice);
+}
+
+void tst_QUsbDevice::descriptors()
+{
+    QUsbDevice dev;
+
+    // Only available once open
+    QCOMPARE(dev.deviceDescriptor().vid, quint16(0));
+    QCOMPARE(dev.deviceDescriptor().pid, quint16(0));
+    QVERIFY(dev.configDescriptor().interfaces.isEmpty());
+    QVERIFY(dev.endpoints(0).isEmpty());
+    QCOMPARE(dev.findEndpoint(0x81).address, quint8(0));
+}
+
+void tst_QUsbDevice::capture()
+{
+    QUsbDevice dev;
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.filePath("capture.pcapng");
+
+    QVERIFY(!dev.isCapturing());
+    QVERIFY(dev.startCapture(fileName));
+    QVERIFY(dev.isCapturing());
+    QVERIFY(!dev.startCapture(fileName));
+    dev.stopCapture();
+    QVERIFY(!dev.isCapturing());
+
+    // Section header and usbmon interface, no packets
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    const QByteArray data = file.readAll();
+    QCOMPARE(data.size(), qsizetype(48));
+    QCOMPARE(qFromUnaligned<quint32>(data.constData()), quint32(0x0A0D0D0A));
+    QCOMPARE(qFromUnaligned<quint32>(data.constData() + 8), quint32(0x1A2B3C4D));
+    QCOMPARE(qFromUnaligned<quint32>(data.constData() + 28), quint32(1));
+    QCOMPARE(qFromUnaligned<quint16>(data.constData() + 36), quint16(220));
+
+    // Capture can be restarted, records go after the same 48 bytes
+    QUsbCapture &capture = static_cast<QUsbDevicePrivate *>(QObjectPrivate::get(&dev))->m_capture;
+    capture.setDevice(3, 7);
+    QVERIFY(dev.startCapture(fileName));
+    capture.record(QUsbCapture::Submit, 42, QUsbCapture::xferType(LIBUSB_TRANSFER_TYPE_BULK), 0x01,
+                   QUsbCapture::InProgress, 5, "hello", 5);
+    capture.record(QUsbCapture::Complete, 42, QUsbCapture::xferType(LIBUSB_TRANSFER_TYPE_BULK), 0x81,
+                   0, 3, Q_NULLPTR, 0);
+    dev.stopCapture();
+
+    file.close();
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    const QByteArray records = file.readAll().mid(48);
+    QCOMPARE(records.size(), qsizetype(104 + 96));
+    QUsbCaptureHeader h;
+
+    // Submission, 5 payload bytes padded to 8
+    const char *epb = records.constData();
+    QCOMPARE(qFromUnaligned<quint32>(epb), quint32(6));
+    QCOMPARE(qFromUnaligned<quint32>(epb + 4), quint32(104));
+    QCOMPARE(qFromUnaligned<quint32>(epb + 20), quint32(64 + 5)); // Captured
+    QCOMPARE(qFromUnaligned<quint32>(epb + 24), quint32(64 + 5)); // Original
+    memcpy(&h, epb + 28, sizeof(h));
+    QCOMPARE(h.id, quint64(42));
+    QCOMPARE(h.type, quint8('S'));
+    QCOMPARE(h.xferType, quint8(3));
+    QCOMPARE(h.epnum, quint8(0x01));
+    QCOMPARE(h.devnum, quint8(7));
+    QCOMPARE(h.busnum, quint16(3));
+    QCOMPARE(h.flagSetup, '-');
+    QCOMPARE(h.flagData, '\0');
+    QCOMPARE(h.status, qint32(QUsbCapture::InProgress));
+    QCOMPARE(h.length, quint32(5));
+    QCOMPARE(h.lenCap, quint32(5));
+    QCOMPARE(QByteArray(epb + 92, 5), QByteArray("hello"));
+    QCOMPARE(QByteArray(epb + 97, 3), QByteArray(3, '\0'));
+    QCOMPARE(qFromUnaligned<quint32>(epb + 100), quint32(104));
+
+    // Completion without data, the original length doesn't count what wasn't captured
+    epb += 104;
+    QCOMPARE(qFromUnaligned<quint32>(epb), quint32(6));
+    QCOMPARE(qFromUnaligned<quint32>(epb + 4), quint32(96));
+    QCOMPARE(qFromUnaligned<quint32>(epb + 20), quint32(64));
+    QCOMPARE(qFromUnaligned<quint32>(epb + 24), quint32(64));
+    memcpy(&h, epb + 28, sizeof(h));
+    QCOMPARE(h.id, quint64(42));
+    QCOMPARE(h.type, quint8('C'));
+    QCOMPARE(h.epnum, quint8(0x81));
+    QCOMPARE(h.flagData, '<');
+    QCOMPARE(h.status, qint32(0));
+    QCOMPARE(h.length, quint32(3));
+    QCOMPARE(h.lenCap, quint32(0));
+    QCOMPARE(qFromUnaligned<quint32>(epb + 92), quint32(96));
+}
+
 QTEST_MAIN(tst_QUsbDevice)
 #include "tst_qusbdevice.moc"
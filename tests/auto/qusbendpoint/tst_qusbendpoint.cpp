@@ -1,5 +1,7 @@
 #include <QtTest/QtTest>
 #include <QtUsb/QUsbEndpoint>
+#include <QtUsb/private/qusbdevice_p.h>
+#include <QtUsb/private/qusbfaketransport_p.h>
 
 class tst_QUsbEndpoint : public QObject
 {
@@ -7,10 +9,51 @@ class tst_QUsbEndpoint : public QObject
 private slots:
     void constructors();
     void polling();
+    void queueDepth();
+    void readBufferSize();
+    void peekSpans();
+    void writeQueue();
+    void writeChunkSize();
+    void transferPool();
+    void isochronous();
+    void streams();
+    void waitFor();
+    void transferSync();
+    void readTransferSize();
+    void resizeWhileReading();
+    void stats();
 
 private:
 };
 
+static const quint8 FakeOut = 0x01;
+static const quint8 FakeIn = 0x81;
+
+// Replace the libusb transport of dev with a fake device, bulk endpoints looped back.
+static QUsbFakeTransport *attachFake(QUsbDevice *dev)
+{
+    QUsbFakeTransport *fake = new QUsbFakeTransport;
+    fake->setId(QUsb::Id(0x1234, 0xabcd, 1, 1));
+    fake->setLoopback(FakeOut, FakeIn);
+
+    QUsbDevice::InterfaceDescriptor interface;
+    for (quint8 address : { FakeOut, FakeIn }) {
+        QUsbDevice::EndpointDescriptor endpoint;
+        endpoint.address = address;
+        endpoint.attributes = LIBUSB_TRANSFER_TYPE_BULK;
+        endpoint.maxPacketSize = 512;
+        interface.endpoints.append(endpoint);
+    }
+    QUsbDevice::ConfigDescriptor config;
+    config.value = 1;
+    config.interfaces.append(interface);
+    fake->setConfigDescriptor(config);
+
+    static_cast<QUsbDevicePrivate *>(QObjectPrivate::get(dev))->setTransport(fake);
+    dev->setId(QUsb::Id(0x1234, 0xabcd));
+    return fake;
+}
+
 void tst_QUsbEndpoint::constructors()
 {
     QUsbDevice dev;
@@ -64,5 +107,277 @@ void tst_QUsbEndpoint::polling()
     QVERIFY(!handler2.isOpen());
 }
 
+void tst_QUsbEndpoint::queueDepth()
+{
+    QUsbDevice dev;
+    quint8 ep_in = 81;
+    QUsbEndpoint handler(&dev, QUsbEndpoint::bulkEndpoint, ep_in);
+
+    QCOMPARE(handler.queueDepth(), 1);
+    handler.setQueueDepth(8);
+    QCOMPARE(handler.queueDepth(), 8);
+    handler.setQueueDepth(0);
+    QCOMPARE(handler.queueDepth(), 1);
+
+    QVERIFY(handler.open(QIODevice::ReadOnly));
+    handler.setQueueDepth(4);
+    handler.setPolling(true);
+    QCOMPARE(handler.queueDepth(), 4);
+    handler.close();
+    QVERIFY(!handler.isOpen());
+}
+
+void tst_QUsbEndpoint::readBufferSize()
+{
+    QUsbDevice dev;
+    quint8 ep_in = 81;
+    QUsbEndpoint handler(&dev, QUsbEndpoint::bulkEndpoint, ep_in);
+
+    const qint64 size = QUsbEndpoint::DefaultReadBufferSize; // We can't use references with this var
+    QCOMPARE(handler.readBufferSize(), size);
+    handler.setReadBufferSize(1024 * 1024);
+    QCOMPARE(handler.readBufferSize(), qint64(1024 * 1024));
+
+    QVERIFY(handler.open(QIODevice::ReadOnly));
+    QCOMPARE(handler.bytesAvailable(), qint64(0));
+    char buf[16];
+    QCOMPARE(handler.read(buf, sizeof(buf)), qint64(0));
+    handler.close();
+}
+
+void tst_QUsbEndpoint::peekSpans()
+{
+    QUsbDevice dev;
+    quint8 ep_in = 81;
+    QUsbEndpoint handler(&dev, QUsbEndpoint::bulkEndpoint, ep_in);
+
+    QVERIFY(handler.peekSpans().isEmpty());
+    QCOMPARE(handler.consume(16), qint64(-1));
+
+    QVERIFY(handler.open(QIODevice::ReadOnly));
+    QVERIFY(handler.peekSpans().isEmpty());
+    QCOMPARE(handler.consume(16), qint64(0));
+    handler.close();
+}
+
+void tst_QUsbEndpoint::writeQueue()
+{
+    QUsbDevice dev;
+    quint8 ep_out = 2;
+    QUsbEndpoint handler(&dev, QUsbEndpoint::bulkEndpoint, ep_out);
+    const char buf[64] = {};
+
+    handler.setQueueDepth(4);
+    QVERIFY(handler.open(QIODevice::WriteOnly));
+    QCOMPARE(handler.bytesToWrite(), qint64(0));
+    // No device, nothing gets queued
+    QCOMPARE(handler.write(buf, sizeof(buf)), qint64(-1));
+    QCOMPARE(handler.bytesToWrite(), qint64(0));
+    handler.cancelTransfer();
+    handler.close();
+    QVERIFY(!handler.isOpen());
+}
+
+void tst_QUsbEndpoint::writeChunkSize()
+{
+    QUsbDevice dev;
+    quint8 ep_out = 2;
+    QUsbEndpoint handler(&dev, QUsbEndpoint::bulkEndpoint, ep_out);
+
+    // We can't use references with this var
+    const qint64 size = QUsbEndpoint::DefaultWriteChunkSize;
+    QCOMPARE(handler.writeChunkSize(), size);
+    handler.setWriteChunkSize(1024 * 1024);
+    QCOMPARE(handler.writeChunkSize(), qint64(1024 * 1024));
+    handler.setWriteChunkSize(0);
+    QCOMPARE(handler.writeChunkSize(), qint64(1));
+}
+
+void tst_QUsbEndpoint::transferPool()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint in(&dev, QUsbEndpoint::bulkEndpoint, FakeIn);
+    QUsbEndpoint out(&dev, QUsbEndpoint::bulkEndpoint, FakeOut);
+    QCOMPARE(in.transferAllocations(), qint64(0));
+    in.setQueueDepth(4);
+    out.setQueueDepth(4);
+    QVERIFY(in.open(QIODevice::ReadOnly));
+    QVERIFY(out.open(QIODevice::WriteOnly));
+    QVERIFY(in.transferAllocations() >= 4);
+    in.setPolling(true);
+
+    const QByteArray data(1000, 'x');
+    QByteArray received;
+    auto roundTrip = [&]() {
+        if (out.write(data) != data.size() || !out.waitForBytesWritten(5000))
+            return false;
+        received.clear();
+        while (received.size() < data.size() && in.waitForReadyRead(5000))
+            received.append(in.readAll());
+        return received == data;
+    };
+
+    // The first completions may still fill the pool up, after that transfers are only recycled.
+    for (int i = 0; i < 8; i++)
+        QVERIFY(roundTrip());
+    const qint64 inAllocations = in.transferAllocations();
+    const qint64 outAllocations = out.transferAllocations();
+
+    for (int i = 0; i < 500; i++)
+        QVERIFY(roundTrip());
+    QCOMPARE(in.transferAllocations(), inAllocations);
+    QCOMPARE(out.transferAllocations(), outAllocations);
+    QVERIFY(in.stats().transfersIn >= 508);
+
+    in.close();
+    out.close();
+    QVERIFY(fake->waitForIdle());
+}
+
+void tst_QUsbEndpoint::isochronous()
+{
+    QUsbDevice dev;
+    quint8 ep_in = 83;
+    QUsbEndpoint handler(&dev, QUsbEndpoint::isochronousEndpoint, ep_in);
+
+    // We can't use references with this var
+    const int packets = QUsbEndpoint::DefaultIsoPacketsPerTransfer;
+    QCOMPARE(handler.isoPacketsPerTransfer(), packets);
+    handler.setIsoPacketsPerTransfer(32);
+    QCOMPARE(handler.isoPacketsPerTransfer(), 32);
+    handler.setIsoPacketsPerTransfer(0);
+    QCOMPARE(handler.isoPacketsPerTransfer(), 1);
+    handler.setIsoPacketsPerTransfer(16);
+
+    QVERIFY(handler.open(QIODevice::ReadOnly));
+    QVERIFY(handler.isoPacketSize() > 0);
+    handler.setIsoPacketsPerTransfer(4);
+    QCOMPARE(handler.isoPacketsPerTransfer(), 16);
+    QCOMPARE(handler.packetsAvailable(), 0);
+    QVERIFY(handler.readPackets().isEmpty());
+    handler.close();
+}
+
+void tst_QUsbEndpoint::streams()
+{
+    QUsbDevice dev;
+    quint8 ep_in = 81;
+    QUsbEndpoint stream1(&dev, QUsbEndpoint::streamEndpoint, ep_in);
+    QUsbEndpoint stream2(&dev, QUsbEndpoint::streamEndpoint, ep_in);
+
+    QCOMPARE(stream1.streamId(), quint32(1));
+    stream2.setStreamId(2);
+    QCOMPARE(stream2.streamId(), quint32(2));
+
+    QVERIFY(stream1.open(QIODevice::ReadOnly));
+    QVERIFY(stream2.open(QIODevice::ReadOnly));
+    stream1.close();
+    stream2.close();
+}
+
+void tst_QUsbEndpoint::waitFor()
+{
+    QUsbDevice dev;
+    quint8 ep_in = 81, ep_out = 2;
+    QUsbEndpoint handler_in(&dev, QUsbEndpoint::bulkEndpoint, ep_in);
+    QUsbEndpoint handler_out(&dev, QUsbEndpoint::bulkEndpoint, ep_out);
+
+    QVERIFY(!handler_in.waitForReadyRead(10));
+    QVERIFY(handler_in.open(QIODevice::ReadOnly));
+    QVERIFY(!handler_in.waitForReadyRead(50));
+    handler_in.close();
+
+    QVERIFY(handler_out.open(QIODevice::WriteOnly));
+    QVERIFY(handler_out.waitForBytesWritten(50));
+    handler_out.close();
+}
+
+void tst_QUsbEndpoint::transferSync()
+{
+    QUsbDevice dev;
+    quint8 ep_in = 81;
+    QUsbEndpoint handler(&dev, QUsbEndpoint::bulkEndpoint, ep_in);
+    char buf[64];
+
+    // No device
+    QCOMPARE(handler.transferSync(buf, sizeof(buf), 10), qint64(-1));
+}
+
+void tst_QUsbEndpoint::readTransferSize()
+{
+    QUsbDevice dev;
+    quint8 ep_in = 81;
+    QUsbEndpoint handler(&dev, QUsbEndpoint::bulkEndpoint, ep_in);
+
+    // Rounded up to whole packets
+    handler.setReadTransferSize(1000);
+    QCOMPARE(handler.readTransferSize() % 64, qint64(0));
+    QVERIFY(handler.readTransferSize() >= 1000);
+
+    handler.setReadTransferSize(4 * 1024 * 1024);
+    QCOMPARE(handler.readTransferSize(), qint64(4 * 1024 * 1024));
+
+    // We can't use references with this var
+    const qint64 size = QUsbEndpoint::DefaultReadTransferSize;
+    handler.setReadTransferSize(0);
+    QVERIFY(handler.open(QIODevice::ReadOnly));
+    QCOMPARE(handler.readTransferSize(), size);
+    handler.close();
+}
+
+void tst_QUsbEndpoint::resizeWhileReading()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint in(&dev, QUsbEndpoint::bulkEndpoint, FakeIn);
+    in.setReadTransferSize(512);
+    in.setQueueDepth(4);
+    in.setReadBufferSize(4096);
+    QVERIFY(in.open(QIODevice::ReadOnly));
+    in.setPolling(true);
+
+    // Half the buffer unread, the other half in flight
+    fake->injectData(FakeIn, QByteArray(2048, 'a'));
+    QTRY_COMPARE(in.bytesAvailable(), qint64(2048));
+    QVERIFY(fake->waitForIdle());
+    QCOMPARE(fake->pendingTransfers(), 4);
+
+    // Larger transfers need fewer slots, but those already held keep theirs
+    in.setReadTransferSize(4096);
+    fake->injectData(FakeIn, QByteArray(2048, 'b'));
+    QTRY_COMPARE(in.bytesAvailable(), qint64(4096));
+    QCOMPARE(in.stats().bytesDropped, quint64(0));
+    QCOMPARE(in.readAll(), QByteArray(2048, 'a') + QByteArray(2048, 'b'));
+    in.close();
+}
+
+void tst_QUsbEndpoint::stats()
+{
+    QUsbDevice dev;
+    quint8 ep_in = 81;
+    QUsbEndpoint handler(&dev, QUsbEndpoint::bulkEndpoint, ep_in);
+
+    QUsbEndpoint::Stats stats = handler.stats();
+    QCOMPARE(stats.bytesRead, quint64(0));
+    QCOMPARE(stats.transfersIn, quint64(0));
+    QCOMPARE(stats.inFlight, 0);
+    QCOMPARE(stats.bytesDropped, quint64(0));
+    QCOMPARE(stats.statusCount.size(), QUsbEndpoint::transferOverflow + 1);
+    QVERIFY(!stats.latency.isEmpty());
+    QCOMPARE(QUsbEndpoint::latencyPercentile(stats, 99), qint64(0));
+
+    for (int i = 1; i < stats.latency.size(); i++)
+        QVERIFY(QUsbEndpoint::latencyBucketLimit(i) >= QUsbEndpoint::latencyBucketLimit(i - 1));
+
+    stats.latency[8] = 10;
+    QCOMPARE(QUsbEndpoint::latencyPercentile(stats, 50), QUsbEndpoint::latencyBucketLimit(8));
+    handler.resetStats();
+}
+
 QTEST_MAIN(tst_QUsbEndpoint)
 #include "tst_qusbendpoint.moc"
@@ -0,0 +1,493 @@
+#include <QtTest/QtTest>
+#include <QtUsb/QUsbDevice>
+#include <QtUsb/QUsbEndpoint>
+#include <QtUsb/private/qusbdevice_p.h>
+#include <QtUsb/private/qusbfaketransport_p.h>
+
+class tst_QUsbTransport : public QObject
+{
+    Q_OBJECT
+private slots:
+    void open();
+    void portPath();
+    void loopback();
+    void isoLoopback();
+    void writeProgress();
+    void stalledClose();
+    void controlTransfer();
+    void closePending();
+    void closeEndpoints();
+    void eventThread_data();
+    void eventThread();
+    void stall();
+    void timeout();
+    void unplug();
+    void unplugControl();
+
+private:
+};
+
+static const quint16 Pid = 0x1234;
+static const quint16 Vid = 0xabcd;
+static const quint8 OutEndpoint = 0x01;
+static const quint8 InEndpoint = 0x81;
+
+// Replace the libusb transport of dev with a fake device having a bulk endpoint pair.
+static QUsbFakeTransport *attachFake(QUsbDevice *dev)
+{
+    QUsbFakeTransport *fake = new QUsbFakeTransport;
+    fake->setId(QUsb::Id(Pid, Vid, 3, 2));
+    fake->setSpeed(QUsbDevice::superSpeed);
+
+    QUsbDevice::InterfaceDescriptor interface;
+    for (quint8 address : { OutEndpoint, InEndpoint }) {
+        QUsbDevice::EndpointDescriptor endpoint;
+        endpoint.address = address;
+        endpoint.attributes = LIBUSB_TRANSFER_TYPE_BULK;
+        endpoint.maxPacketSize = 1024;
+        interface.endpoints.append(endpoint);
+    }
+    QUsbDevice::ConfigDescriptor config;
+    config.value = 1;
+    config.interfaces.append(interface);
+    fake->setConfigDescriptor(config);
+
+    static_cast<QUsbDevicePrivate *>(QObjectPrivate::get(dev))->setTransport(fake);
+    dev->setId(QUsb::Id(Pid, Vid));
+    return fake;
+}
+
+void tst_QUsbTransport::open()
+{
+    QUsbDevice dev;
+    attachFake(&dev);
+
+    dev.setId(QUsb::Id(Pid + 1, Vid));
+    QCOMPARE(dev.open(), -5);
+    QVERIFY(!dev.isConnected());
+
+    dev.setId(QUsb::Id(Pid, Vid));
+    QCOMPARE(dev.open(), 0);
+    QVERIFY(dev.isConnected());
+    QCOMPARE(dev.speed(), QUsbDevice::superSpeed);
+    QCOMPARE(dev.id().bus, quint8(3));
+    QCOMPARE(dev.id().port, quint8(2));
+    QCOMPARE(dev.deviceDescriptor().pid, Pid);
+    QCOMPARE(dev.findEndpoint(InEndpoint).maxPacketSize, quint16(1024));
+
+    dev.close();
+    QVERIFY(!dev.isConnected());
+    QCOMPARE(dev.configDescriptor().interfaces.size(), 0);
+}
+
+void tst_QUsbTransport::portPath()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    fake->setPortPath({ 1, 4, 2 });
+
+    // Same last port, behind another hub
+    dev.setPortPath({ 1, 3, 2 });
+    QCOMPARE(dev.open(), -5);
+
+    // The bus and the path are enough
+    dev.setId(QUsb::Id(0, 0, 3));
+    dev.setPortPath({ 1, 4, 2 });
+    QCOMPARE(dev.open(), 0);
+    QCOMPARE(dev.id().pid, Pid);
+    QCOMPARE(dev.id().port, quint8(2));
+    dev.close();
+
+    // Filled when not set
+    dev.setId(QUsb::Id(Pid, Vid));
+    dev.setPortPath(QList<quint8>());
+    QCOMPARE(dev.open(), 0);
+    QCOMPARE(dev.portPath(), QList<quint8>({ 1, 4, 2 }));
+    dev.close();
+    QVERIFY(dev.portPath().isEmpty());
+
+    // The path found is not required by the next open(), the device may have moved
+    fake->setPortPath({ 1, 2 });
+    dev.setId(QUsb::Id(Pid, Vid));
+    QCOMPARE(dev.open(), 0);
+    QCOMPARE(dev.portPath(), QList<quint8>({ 1, 2 }));
+}
+
+void tst_QUsbTransport::loopback()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    fake->setLoopback(OutEndpoint, InEndpoint);
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint in(&dev, QUsbEndpoint::bulkEndpoint, InEndpoint);
+    QUsbEndpoint out(&dev, QUsbEndpoint::bulkEndpoint, OutEndpoint);
+    QVERIFY(in.open(QIODevice::ReadOnly));
+    in.setPolling(true);
+    QVERIFY(out.open(QIODevice::WriteOnly));
+
+    QByteArray data(100 * 1024, Qt::Uninitialized);
+    for (int i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i * 7);
+    QCOMPARE(out.write(data), qint64(data.size()));
+    QVERIFY(out.waitForBytesWritten(5000));
+
+    QByteArray received;
+    while (received.size() < data.size() && in.waitForReadyRead(5000))
+        received.append(in.readAll());
+    QCOMPARE(received, data);
+
+    in.close();
+    out.close();
+    QVERIFY(fake->waitForIdle());
+    QCOMPARE(fake->pendingTransfers(), 0);
+}
+
+void tst_QUsbTransport::isoLoopback()
+{
+    const quint8 isoOut = 0x02;
+    const quint8 isoIn = 0x82;
+    const int packetSize = 64;
+    const int packets = 8;
+
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    QUsbDevice::InterfaceDescriptor interface;
+    for (quint8 address : { isoOut, isoIn }) {
+        QUsbDevice::EndpointDescriptor endpoint;
+        endpoint.address = address;
+        endpoint.attributes = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+        endpoint.maxPacketSize = packetSize;
+        interface.endpoints.append(endpoint);
+    }
+    QUsbDevice::ConfigDescriptor config;
+    config.value = 1;
+    config.interfaces.append(interface);
+    fake->setConfigDescriptor(config);
+    fake->setLoopback(isoOut, isoIn);
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint in(&dev, QUsbEndpoint::isochronousEndpoint, isoIn);
+    QUsbEndpoint out(&dev, QUsbEndpoint::isochronousEndpoint, isoOut);
+    in.setIsoPacketsPerTransfer(packets);
+    out.setIsoPacketsPerTransfer(packets);
+    QVERIFY(in.open(QIODevice::ReadOnly));
+    in.setPolling(true);
+    QVERIFY(out.open(QIODevice::WriteOnly));
+    QCOMPARE(out.isoPacketSize(), packetSize);
+
+    // Four full transfers and a short one, so the last packet is short too
+    QByteArray data(packetSize * packets * 4 + packetSize * 2 + 10, Qt::Uninitialized);
+    for (int i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i * 3);
+    QCOMPARE(out.write(data), qint64(data.size()));
+    QTRY_COMPARE(out.bytesToWrite(), qint64(0));
+
+    QByteArray received;
+    while (received.size() < data.size() && in.waitForReadyRead(5000))
+        received.append(in.readAll());
+    QCOMPARE(received, data);
+
+    // Only the packets are counted, not the transfer length on top of them
+    QCOMPARE(out.stats().bytesWritten, quint64(data.size()));
+    QCOMPARE(in.stats().bytesRead, quint64(data.size()));
+
+    in.close();
+    out.close();
+    QVERIFY(fake->waitForIdle());
+    QCOMPARE(fake->pendingTransfers(), 0);
+}
+
+void tst_QUsbTransport::writeProgress()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    fake->setLatency(20000);
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint out(&dev, QUsbEndpoint::bulkEndpoint, OutEndpoint);
+    out.setWriteChunkSize(1024);
+    QVERIFY(out.open(QIODevice::WriteOnly));
+
+    // Eight transfers one after the other, each wait returns as soon as one is done
+    const QByteArray data(8 * 1024, 'w');
+    QSignalSpy spy(&out, &QUsbEndpoint::bytesWritten);
+    QCOMPARE(out.write(data), qint64(data.size()));
+    QVERIFY(out.waitForBytesWritten(5000));
+    QVERIFY(out.bytesToWrite() > 0);
+
+    int waits = 1;
+    while (out.bytesToWrite() > 0) {
+        QVERIFY(out.waitForBytesWritten(5000));
+        waits++;
+    }
+    QVERIFY(waits > 1);
+    QVERIFY(out.waitForBytesWritten(0));
+    QTRY_COMPARE(spy.count(), 8);
+    QCOMPARE(fake->takeWritten(OutEndpoint), data);
+
+    out.close();
+}
+
+void tst_QUsbTransport::stalledClose()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    dev.setTimeout(100);
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint out(&dev, QUsbEndpoint::bulkEndpoint, OutEndpoint);
+    QVERIFY(out.open(QIODevice::WriteOnly));
+
+    // Nothing completes while paused, close() gives up instead of blocking forever
+    fake->setPaused(true);
+    QCOMPARE(out.write(QByteArray(64, 'x')), qint64(64));
+    QTest::ignoreMessage(QtWarningMsg, "QUsbEndpoint: Timed out waiting for pending transfers");
+    QElapsedTimer timer;
+    timer.start();
+    out.close();
+    QVERIFY(timer.elapsed() < 5000);
+    QCOMPARE(fake->pendingTransfers(), 1);
+
+    // Canceled transfers complete even when paused, the destructor can wait for them
+    out.cancelTransfer();
+    QVERIFY(fake->waitForIdle());
+    QCOMPARE(fake->pendingTransfers(), 0);
+    fake->setPaused(false);
+}
+
+void tst_QUsbTransport::controlTransfer()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    fake->setControlHandler([](const QUsbDevice::ControlRequest &request) {
+        QUsbDevice::ControlResult result;
+        if (request.bRequest == 0x42)
+            result.status = QUsbDevice::statusPipeError;
+        else if (request.bmRequestType & LIBUSB_ENDPOINT_IN)
+            result.data = QByteArray("fake").left(request.wLength);
+        return result;
+    });
+    QCOMPARE(dev.open(), 0);
+
+    QFuture<QUsbDevice::ControlResult> in = dev.controlTransfer(0xc0, 0x01, 0, 0, QByteArray(), 64);
+    in.waitForFinished();
+    QCOMPARE(in.result().status, QUsbDevice::statusOK);
+    QCOMPARE(in.result().data, QByteArray("fake"));
+
+    QFuture<QUsbDevice::ControlResult> stall = dev.controlTransfer(0x40, 0x42, 0, 0, QByteArray("x"));
+    stall.waitForFinished();
+    QCOMPARE(stall.result().status, QUsbDevice::statusPipeError);
+
+    fake->injectStatus(0, LIBUSB_TRANSFER_NO_DEVICE);
+    QFuture<QUsbDevice::ControlResult> gone = dev.controlTransfer(0x40, 0x01, 0, 0, QByteArray("x"));
+    gone.waitForFinished();
+    QCOMPARE(gone.result().status, QUsbDevice::statusNoSuchDevice);
+
+    // wLength can't describe a longer data stage
+    QFuture<QUsbDevice::ControlResult> large = dev.controlTransfer(0x40, 0x01, 0, 0, QByteArray(70000, 'x'));
+    large.waitForFinished();
+    QCOMPARE(large.result().status, QUsbDevice::statusInvalidParam);
+}
+
+void tst_QUsbTransport::closePending()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    QCOMPARE(dev.open(), 0);
+
+    // close() cancels the request and waits for its callback before releasing the handle
+    fake->setPaused(true);
+    QFuture<QUsbDevice::ControlResult> future = dev.controlTransfer(0xc0, 0x01, 0, 0, QByteArray(), 64);
+    QCOMPARE(fake->pendingTransfers(), 1);
+    dev.close();
+    QVERIFY(future.isFinished());
+    QCOMPARE(future.result().status, QUsbDevice::statusInterrupted);
+    QCOMPARE(fake->pendingTransfers(), 0);
+}
+
+void tst_QUsbTransport::closeEndpoints()
+{
+    QUsbDevice *dev = new QUsbDevice;
+    QUsbFakeTransport *fake = attachFake(dev);
+    dev->setTimeout(0);
+    QCOMPARE(dev->open(), 0);
+
+    fake->setPaused(true);
+    QUsbEndpoint *in = new QUsbEndpoint(dev, QUsbEndpoint::bulkEndpoint, InEndpoint);
+    QVERIFY(in->open(QIODevice::ReadOnly));
+    in->setPolling(true);
+    QUsbEndpoint *out = new QUsbEndpoint(dev, QUsbEndpoint::bulkEndpoint, OutEndpoint);
+    QVERIFY(out->open(QIODevice::WriteOnly));
+    QCOMPARE(out->write(QByteArray(64, 'x')), qint64(64));
+    QVERIFY(fake->pendingTransfers() >= 2);
+
+    // Polling stops, and the endpoints have nothing left in flight
+    dev->close();
+    QCOMPARE(fake->pendingTransfers(), 0);
+    QCOMPARE(out->bytesToWrite(), qint64(0));
+
+    // The endpoints are deleted after the device closed, they must not wait for anything
+    QElapsedTimer timer;
+    timer.start();
+    delete dev;
+    QVERIFY(timer.elapsed() < 1000);
+}
+
+void tst_QUsbTransport::eventThread_data()
+{
+    QTest::addColumn<bool>("dispatch");
+    QTest::newRow("event thread") << true;
+    QTest::newRow("internal thread") << false;
+}
+
+// Blocking calls made from the thread that dispatches completions have to handle them
+void tst_QUsbTransport::eventThread()
+{
+    QFETCH(bool, dispatch);
+
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    fake->setLoopback(OutEndpoint, InEndpoint);
+    if (dispatch)
+        fake->setDispatchThread(QThread::currentThread());
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint in(&dev, QUsbEndpoint::bulkEndpoint, InEndpoint);
+    QUsbEndpoint out(&dev, QUsbEndpoint::bulkEndpoint, OutEndpoint);
+    QVERIFY(in.open(QIODevice::ReadOnly));
+    in.setPolling(true);
+    QVERIFY(out.open(QIODevice::WriteOnly));
+
+    const QByteArray data(4096, 'e');
+    QCOMPARE(out.write(data), qint64(data.size()));
+    QVERIFY(out.waitForBytesWritten(5000));
+    QByteArray received;
+    while (received.size() < data.size() && in.waitForReadyRead(5000))
+        received.append(in.readAll());
+    QCOMPARE(received, data);
+
+    // Completions also come through the event loop
+    fake->injectData(InEndpoint, QByteArray("loop"));
+    QTRY_COMPARE(in.bytesAvailable(), qint64(4));
+    QCOMPARE(in.readAll(), QByteArray("loop"));
+
+    QFuture<QUsbDevice::ControlResult> control = dev.controlTransfer(0xc0, 0x01, 0, 0, QByteArray(), 4);
+    QVERIFY(dev.waitForControlTransfer(control, 5000));
+    QCOMPARE(control.result().status, QUsbDevice::statusOK);
+
+    // Closing waits for the canceled IN transfers and for a control transfer held back by the device
+    QElapsedTimer timer;
+    timer.start();
+    in.close();
+    out.close();
+    fake->setPaused(true);
+    control = dev.controlTransfer(0xc0, 0x01, 0, 0, QByteArray(), 4);
+    dev.close();
+    QVERIFY(control.isFinished());
+    QCOMPARE(control.result().status, QUsbDevice::statusInterrupted);
+    QVERIFY(timer.elapsed() < 5000);
+    QCOMPARE(fake->pendingTransfers(), 0);
+}
+
+void tst_QUsbTransport::stall()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint in(&dev, QUsbEndpoint::bulkEndpoint, InEndpoint);
+    char buf[64];
+
+    fake->injectStatus(InEndpoint, LIBUSB_TRANSFER_STALL);
+    fake->injectData(InEndpoint, QByteArray("data"));
+    QCOMPARE(in.transferSync(buf, sizeof(buf)), qint64(-1));
+    QCOMPARE(in.status(), QUsbEndpoint::transferStall);
+
+    // Only the first transfer stalls, the data is still there
+    QCOMPARE(in.transferSync(buf, sizeof(buf)), qint64(4));
+    QCOMPARE(in.status(), QUsbEndpoint::transferCompleted);
+    QCOMPARE(QByteArray(buf, 4), QByteArray("data"));
+}
+
+void tst_QUsbTransport::timeout()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint in(&dev, QUsbEndpoint::bulkEndpoint, InEndpoint);
+    QUsbEndpoint out(&dev, QUsbEndpoint::bulkEndpoint, OutEndpoint);
+    char buf[64] = {};
+    QElapsedTimer timer;
+
+    // Nothing to read, the device NAKs until the timeout
+    timer.start();
+    QCOMPARE(in.transferSync(buf, sizeof(buf), 50), qint64(-1));
+    QCOMPARE(in.status(), QUsbEndpoint::transferTimeout);
+    QVERIFY(timer.elapsed() >= 50);
+
+    fake->setLatency(30 * 1000);
+    timer.start();
+    QCOMPARE(out.transferSync(buf, sizeof(buf)), qint64(sizeof(buf)));
+    QVERIFY(timer.elapsed() >= 30);
+    QCOMPARE(fake->takeWritten(OutEndpoint).size(), qsizetype(sizeof(buf)));
+    QVERIFY(fake->takeWritten(OutEndpoint).isEmpty());
+
+    // Paused transfers still complete once resumed
+    fake->setLatency(0);
+    fake->setPaused(true);
+    QUsbDevice::ControlRequest request;
+    QFuture<QUsbDevice::ControlResult> held = dev.controlTransfer(request);
+    QVERIFY(fake->waitForIdle());
+    QCOMPARE(fake->pendingTransfers(), 1);
+    QVERIFY(!held.isFinished());
+    fake->setPaused(false);
+    held.waitForFinished();
+    QCOMPARE(held.result().status, QUsbDevice::statusOK);
+}
+
+void tst_QUsbTransport::unplug()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    QCOMPARE(dev.open(), 0);
+
+    QUsbEndpoint in(&dev, QUsbEndpoint::bulkEndpoint, InEndpoint);
+    QVERIFY(in.open(QIODevice::ReadOnly));
+    in.setPolling(true);
+
+    fake->unplug();
+    QTRY_VERIFY(!dev.isConnected());
+    QVERIFY(fake->waitForIdle());
+    QCOMPARE(fake->pendingTransfers(), 0);
+    QVERIFY(dev.open() != 0);
+    in.close();
+}
+
+void tst_QUsbTransport::unplugControl()
+{
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = attachFake(&dev);
+    // Waiting for the requests from the completion thread would never end
+    dev.setTimeout(0);
+    QCOMPARE(dev.open(), 0);
+
+    fake->setPaused(true);
+    QList<QFuture<QUsbDevice::ControlResult>> futures;
+    for (int i = 0; i < 3; i++)
+        futures.append(dev.controlTransfer(0xc0, 0x01, 0, 0, QByteArray(), 64));
+    QCOMPARE(fake->pendingTransfers(), 3);
+
+    fake->unplug();
+    QTRY_VERIFY_WITH_TIMEOUT(!dev.isConnected(), 1000);
+    for (const QFuture<QUsbDevice::ControlResult> &future : std::as_const(futures)) {
+        QVERIFY(future.isFinished());
+        QCOMPARE(future.result().status, QUsbDevice::statusNoSuchDevice);
+    }
+    QVERIFY(fake->waitForIdle());
+    QCOMPARE(fake->pendingTransfers(), 0);
+}
+
+QTEST_MAIN(tst_QUsbTransport)
+#include "tst_qusbtransport.moc"
@@ -0,0 +1,59 @@
+#include <QtTest/QtTest>
+#include <QtUsb/QUsb>
+#include "../shared/qusbbenchmark.h"
+
+// Device list diffing as done on each refresh without hotplug support.
+// Every operation alternates between two lists that differ by one inserted
+// and one removed device, the usual case when something is plugged in.
+
+class BenchUsb : public QUsb
+{
+public:
+    using QUsb::m_system_list;
+    using QUsb::monitorDevices;
+};
+
+class tst_QUsb : public QObject
+{
+    Q_OBJECT
+private slots:
+    void monitorDevices_data();
+    void monitorDevices();
+};
+
+static QUsb::IdList deviceList(int count, int first)
+{
+    QUsb::IdList list;
+    for (int i = first; i < first + count; i++)
+        list.append(QUsb::Id(quint16(i), 0x0483, quint8(i / 128), quint8(i % 128)));
+    return list;
+}
+
+void tst_QUsb::monitorDevices_data()
+{
+    QTest::addColumn<int>("devices");
+
+    const int counts[] = { 8, 32, 128, 512 };
+    for (int count : counts)
+        QTest::addRow("%d", count) << count;
+}
+
+void tst_QUsb::monitorDevices()
+{
+    QFETCH(int, devices);
+
+    BenchUsb usb;
+    const QUsb::IdList lists[2] = { deviceList(devices, 0), deviceList(devices, 1) };
+    usb.m_system_list = lists[0];
+    int next = 1;
+    QUsbBenchmarkReport report;
+
+    QBENCHMARK {
+        usb.monitorDevices(lists[next]);
+        next ^= 1;
+        report.add(1);
+    }
+}
+
+QTEST_MAIN(tst_QUsb)
+#include "tst_bench_qusb.moc"
@@ -0,0 +1,176 @@
+#include <QtTest/QtTest>
+#include <QtUsb/QUsbDevice>
+#include <QtUsb/QUsbEndpoint>
+#include <QtUsb/private/qusbdevice_p.h>
+#include <QtUsb/private/qusbfaketransport_p.h>
+#include "../shared/qusbbenchmark.h"
+
+// Drives the endpoint data path without hardware. The device runs on a fake transport,
+// so transfers go through readUsb(), writeUsb() and submission like on a real device,
+// and complete from the fake's thread through cb_in() and cb_out(). Only libusb itself
+// and the bus are left out.
+
+class tst_QUsbEndpoint : public QObject
+{
+    Q_OBJECT
+private slots:
+    void completeRead_data();
+    void completeRead();
+    void readData_data();
+    void readData();
+    void writeData_data();
+    void writeData();
+
+private:
+    void addData();
+};
+
+static const quint8 InEndpoint = 0x81;
+static const quint8 OutEndpoint = 0x01;
+static volatile quint8 sink; // Keeps the consumers from being optimized out
+
+// Replace the libusb transport of dev with a full speed fake device, then open it.
+static QUsbFakeTransport *openFake(QUsbDevice *dev)
+{
+    QUsbFakeTransport *fake = new QUsbFakeTransport;
+    fake->setSpeed(QUsbDevice::fullSpeed);
+
+    QUsbDevice::InterfaceDescriptor interface;
+    for (quint8 address : { OutEndpoint, InEndpoint }) {
+        QUsbDevice::EndpointDescriptor endpoint;
+        endpoint.address = address;
+        endpoint.attributes = LIBUSB_TRANSFER_TYPE_BULK;
+        endpoint.maxPacketSize = 64;
+        interface.endpoints.append(endpoint);
+    }
+    QUsbDevice::ConfigDescriptor config;
+    config.value = 1;
+    config.interfaces.append(interface);
+    fake->setConfigDescriptor(config);
+
+    static_cast<QUsbDevicePrivate *>(QObjectPrivate::get(dev))->setTransport(fake);
+    dev->setId(QUsb::Id(0x0001, 0x0001));
+    if (dev->open() != 0)
+        qFatal("Could not open the fake device");
+    return fake;
+}
+
+// Wait until size bytes were received, a completion may carry less than a chunk.
+static bool waitForBytes(QUsbEndpoint *ep, qint64 size)
+{
+    while (ep->bytesAvailable() < size) {
+        if (!ep->waitForReadyRead(5000))
+            return false;
+    }
+    return true;
+}
+
+void tst_QUsbEndpoint::addData()
+{
+    QTest::addColumn<int>("chunkSize");
+
+    const int sizes[] = { 64, 512, 4 * 1024, 16 * 1024, 64 * 1024 };
+    for (int size : sizes)
+        QTest::addRow("%d", size) << size;
+}
+
+void tst_QUsbEndpoint::completeRead_data()
+{
+    addData();
+}
+
+// cb_in() appending to the read buffer, the buffer is filled then consumed at once.
+void tst_QUsbEndpoint::completeRead()
+{
+    QFETCH(int, chunkSize);
+
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = openFake(&dev);
+    QUsbEndpoint ep(&dev, QUsbEndpoint::bulkEndpoint, InEndpoint);
+    ep.setReadTransferSize(chunkSize);
+    ep.setQueueDepth(4);
+    QVERIFY(ep.open(QIODevice::ReadOnly));
+    ep.setPolling(true);
+
+    // Half the buffer, the rest is kept for transfers in flight
+    const int chunks = qMax(1, int(ep.readBufferSize() / chunkSize / 2));
+    const QByteArray payload(chunks * chunkSize, 'x');
+    QUsbBenchmarkReport report;
+
+    QBENCHMARK {
+        fake->injectData(InEndpoint, payload);
+        QVERIFY(waitForBytes(&ep, payload.size()));
+        ep.consume(ep.bytesAvailable());
+        report.add(chunks, payload.size());
+    }
+    ep.close();
+}
+
+void tst_QUsbEndpoint::readData_data()
+{
+    addData();
+}
+
+// A completion followed by a read of the same size, the steady state of a polled endpoint.
+void tst_QUsbEndpoint::readData()
+{
+    QFETCH(int, chunkSize);
+
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = openFake(&dev);
+    QUsbEndpoint ep(&dev, QUsbEndpoint::bulkEndpoint, InEndpoint);
+    ep.setReadTransferSize(chunkSize);
+    ep.setQueueDepth(4);
+    QVERIFY(ep.open(QIODevice::ReadOnly));
+    ep.setPolling(true);
+
+    const QByteArray payload(chunkSize, 'x');
+    QByteArray out(chunkSize, Qt::Uninitialized);
+    quint8 sum = 0;
+    QUsbBenchmarkReport report;
+
+    QBENCHMARK {
+        fake->injectData(InEndpoint, payload);
+        QVERIFY(waitForBytes(&ep, chunkSize));
+        const qint64 read = ep.read(out.data(), chunkSize);
+        sum += static_cast<quint8>(out.at(read - 1));
+        report.add(1, read);
+    }
+    sink = sum;
+    ep.close();
+}
+
+void tst_QUsbEndpoint::writeData_data()
+{
+    addData();
+}
+
+// 64 KiB written per operation, split in chunkSize transfers and completed by cb_out().
+void tst_QUsbEndpoint::writeData()
+{
+    QFETCH(int, chunkSize);
+
+    QUsbDevice dev;
+    QUsbFakeTransport *fake = openFake(&dev);
+    QUsbEndpoint ep(&dev, QUsbEndpoint::bulkEndpoint, OutEndpoint);
+    ep.setWriteChunkSize(chunkSize);
+    ep.setQueueDepth(4);
+    QVERIFY(ep.open(QIODevice::WriteOnly));
+
+    const QByteArray data(QUsbEndpoint::DefaultWriteChunkSize, 'x');
+    QUsbBenchmarkReport report;
+
+    QBENCHMARK {
+        QCOMPARE(ep.write(data), qint64(data.size()));
+        while (ep.bytesToWrite() > 0)
+            QVERIFY(ep.waitForBytesWritten(5000));
+        // Nothing reads the fake device, don't let it pile up
+        fake->takeWritten(OutEndpoint);
+        report.add(1, data.size());
+    }
+    QCOMPARE(ep.bytesToWrite(), qint64(0));
+    ep.close();
+}
+
+QTEST_MAIN(tst_QUsbEndpoint)
+#include "tst_bench_qusbendpoint.moc"
@@ -0,0 +1,154 @@
+#include <QtTest/QtTest>
+#include <QtUsb/QUsbEndpoint>
+#include <QtUsb/private/qusbringbuffer_p.h>
+
+// Simulates the endpoint read path: completions queue chunks, the reader drains them.
+// "QByteArray" is the original resize/memcpy/mid implementation, kept for comparison.
+// "QUsbRingBuffer" queues the transfer buffers and copies them out with read(),
+// "spans" parses them in place with spans() and skip().
+
+class tst_QUsbRingBuffer : public QObject
+{
+    Q_OBJECT
+private slots:
+    void appendAndConsume_data();
+    void appendAndConsume();
+    void smallReads_data();
+    void smallReads();
+
+private:
+    void addData();
+};
+
+enum Mode {
+    ByteArray,
+    RingRead,
+    RingSpans
+};
+
+static const qint64 TotalSize = 4 * 1024 * 1024;
+static volatile quint8 sink; // Keeps the consumers from being optimized out
+
+void tst_QUsbRingBuffer::addData()
+{
+    QTest::addColumn<int>("mode");
+    QTest::addColumn<int>("chunkSize");
+
+    const int sizes[] = { 64, 512, 16 * 1024 };
+    for (int size : sizes) {
+        QTest::addRow("QByteArray/%d", size) << int(ByteArray) << size;
+        QTest::addRow("QUsbRingBuffer/%d", size) << int(RingRead) << size;
+        QTest::addRow("spans/%d", size) << int(RingSpans) << size;
+    }
+}
+
+static quint8 checksum(const QByteArrayView &view)
+{
+    quint8 sum = 0;
+    for (char c : view)
+        sum += static_cast<quint8>(c);
+    return sum;
+}
+
+void tst_QUsbRingBuffer::appendAndConsume_data()
+{
+    addData();
+}
+
+void tst_QUsbRingBuffer::appendAndConsume()
+{
+    QFETCH(int, mode);
+    QFETCH(int, chunkSize);
+
+    const QByteArray chunk(chunkSize, 'x');
+    QByteArray out(chunkSize, Qt::Uninitialized);
+    const qint64 iterations = TotalSize / chunkSize;
+    quint8 sum = 0;
+
+    if (mode == ByteArray) {
+        QByteArray buf;
+        QBENCHMARK {
+            for (qint64 i = 0; i < iterations; i++) {
+                const int previous_size = buf.size();
+                buf.resize(previous_size + chunkSize);
+                memcpy(buf.data() + previous_size, chunk.constData(), chunkSize);
+                memcpy(out.data(), buf.constData(), chunkSize);
+                buf = buf.mid(chunkSize);
+                sum += checksum(out);
+            }
+        }
+    } else {
+        QUsbRingBuffer buf(int(QUsbEndpoint::DefaultReadBufferSize / chunkSize) + 1);
+        QBENCHMARK {
+            for (qint64 i = 0; i < iterations; i++) {
+                buf.append(chunk.constData(), chunkSize);
+                if (mode == RingRead) {
+                    buf.read(out.data(), chunkSize);
+                    sum += checksum(out);
+                } else {
+                    for (const QByteArrayView &span : buf.spans())
+                        sum += checksum(span);
+                    buf.skip(chunkSize);
+                }
+            }
+        }
+    }
+    sink = sum;
+}
+
+void tst_QUsbRingBuffer::smallReads_data()
+{
+    addData();
+}
+
+// Reader consumes a full buffer 16 bytes at a time, like a frame parser would.
+void tst_QUsbRingBuffer::smallReads()
+{
+    QFETCH(int, mode);
+    QFETCH(int, chunkSize);
+
+    const int readSize = 16;
+    const QByteArray chunk(chunkSize, 'x');
+    char out[readSize];
+    const qint64 chunks = QUsbEndpoint::DefaultReadBufferSize / chunkSize;
+    quint8 sum = 0;
+
+    if (mode == ByteArray) {
+        QByteArray buf;
+        QBENCHMARK {
+            for (qint64 i = 0; i < chunks; i++) {
+                const int previous_size = buf.size();
+                buf.resize(previous_size + chunkSize);
+                memcpy(buf.data() + previous_size, chunk.constData(), chunkSize);
+            }
+            while (!buf.isEmpty()) {
+                const int read_size = qMin(readSize, int(buf.size()));
+                memcpy(out, buf.constData(), read_size);
+                buf = buf.mid(read_size);
+                sum += checksum(QByteArrayView(out, read_size));
+            }
+        }
+    } else {
+        QUsbRingBuffer buf(int(chunks) + 1);
+        QBENCHMARK {
+            for (qint64 i = 0; i < chunks; i++)
+                buf.append(chunk.constData(), chunkSize);
+            if (mode == RingRead) {
+                qint64 read_size;
+                while ((read_size = buf.read(out, readSize)) > 0)
+                    sum += checksum(QByteArrayView(out, read_size));
+            } else {
+                while (!buf.isEmpty()) {
+                    const QByteArrayView span = buf.spans().first();
+                    for (qint64 i = 0; i + readSize <= span.size(); i += readSize)
+                        sum += checksum(span.sliced(i, readSize));
+                    buf.skip(span.size());
+                }
+            }
+        }
+    }
+    sink = sum;
+}
+
+QTEST_MAIN(tst_QUsbRingBuffer)
+#include "tst_bench_qusbringbuffer.moc"
@@ -0,0 +1,36 @@
+#ifndef QUSBBENCHMARK_H
+#define QUSBBENCHMARK_H
+
+#include <QtTest/QtTest>
+#include <QElapsedTimer>
+
+// QBENCHMARK reports time per iteration, this adds the cost of a single operation and
+// the throughput, so rows with different chunk sizes can be compared directly.
+class QUsbBenchmarkReport
+{
+public:
+    QUsbBenchmarkReport() : m_ops(0), m_bytes(0) { m_timer.start(); }
+    ~QUsbBenchmarkReport()
+    {
+        const double ns = static_cast<double>(m_timer.nsecsElapsed());
+        if (m_ops <= 0 || ns <= 0)
+            return;
+        if (m_bytes > 0)
+            qInfo("%s: %.1f ns/op, %.0f bytes/s", QTest::currentDataTag(), ns / m_ops, m_bytes * 1e9 / ns);
+        else
+            qInfo("%s: %.1f ns/op", QTest::currentDataTag(), ns / m_ops);
+    }
+
+    void add(qint64 ops, qint64 bytes = 0)
+    {
+        m_ops += ops;
+        m_bytes += bytes;
+    }
+
+private:
+    QElapsedTimer m_timer;
+    qint64 m_ops;
+    qint64 m_bytes;
+};
+
+#endif // QUSBBENCHMARK_H